@@ -1,7 +1,65 @@
-#include <gperftools/profiler.h>
-
 #include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
+#include <set>
+#include <string_view>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(SYS_getdents64)
+#define BAYAN_HAVE_GETDENTS
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define BAYAN_HAVE_IO_URING
+#endif
+
+#if defined(__linux__) && __has_include(<sys/inotify.h>)
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#define BAYAN_HAVE_INOTIFY
+#endif
+
+#if defined(__linux__) && __has_include(<linux/fiemap.h>)
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#define BAYAN_HAVE_FIEMAP
+#endif
 
 #include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/mapped_region.hpp>
@@ -9,24 +67,96 @@
 #include <boost/filesystem.hpp>
 
 #include <boost/algorithm/hex.hpp>
+#include <boost/crc.hpp>
 #include <boost/uuid/detail/md5.hpp>
 #include <boost/uuid/detail/sha1.hpp>
 
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#ifdef BAYAN_WITH_XXHASH
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+#endif
+
+#ifdef BAYAN_WITH_BLAKE3
+#include <blake3.h>
+#endif
+
+#ifdef BAYAN_WITH_PROFILER
+#include <gperftools/profiler.h>
+#endif
+
 namespace prog_opt = boost::program_options;
 using namespace boost::filesystem;
 using boost::uuids::detail::md5;
 using boost::uuids::detail::sha1;
 
 
+/*!
+    Двоичная запись значений для файлов контрольных точек и сообщений
+    процессов --shards: значения - байты в порядке машины, строки - длина
+    uint32_t и символы. Чтение возвращает false, если данных не хватает.
+*/
+template <typename T, typename = std::enable_if_t<std::is_trivially_copyable_v<T>>>
+inline void appendBinary(std::string& out, const T& value)
+{   out.append(reinterpret_cast<const char*>(&value), sizeof(value));    }
+
+inline void appendBinary(std::string& out, std::string_view value)
+{
+    appendBinary(out, static_cast<uint32_t>(value.size()));
+    out.append(value.data(), value.size());
+}
+
+template <typename T, typename = std::enable_if_t<std::is_trivially_copyable_v<T>>>
+inline bool readBinary(std::string_view& in, T& value)
+{
+    if (in.size() < sizeof(value))
+    {   return false;   }
+    std::memcpy(&value, in.data(), sizeof(value));
+    in.remove_prefix(sizeof(value));
+    return true;
+}
+
+inline bool readBinary(std::string_view& in, std::string& value)
+{
+    uint32_t size = 0;
+    if (!readBinary(in, size) || (in.size() < size))
+    {   return false;   }
+    value.assign(in.data(), size);
+    in.remove_prefix(size);
+    return true;
+}
+
+
 class Settings
 {
     std::vector<std::string> m_pathsForScan;
     std::vector<std::string> m_pathsForUnScan;
     size_t m_depthScan;
     size_t m_minimalSizeOfFile;
-    std::string m_maskForScan;
+    std::vector<std::string> m_masksForScan;
+    bool m_isMaskRegex;
     size_t m_sizeOfBlock;
+    size_t m_maxSizeOfBlock;
     std::string m_hashAlg;
+    std::string m_compareMode;
+    size_t m_cntThreads;
+    size_t m_maxOpenFiles;
+    std::string m_ioMode;
+    size_t m_queueDepth;
+    bool m_isDirectIo;
+    std::string m_cachePath;
+    std::string m_hardlinks;
+    bool m_isSample;
+    std::string m_outputFormat;
+    std::string m_readOrder;
+    size_t m_deviceQueueDepth;
+    bool m_isWatch;
+    std::string m_checkpointPath;
+    bool m_isResume;
+    size_t m_cntShards;
 
 public:
     Settings() :
@@ -34,9 +164,27 @@ public:
         , m_pathsForUnScan()
         , m_depthScan(0)
         , m_minimalSizeOfFile(1)
-        , m_maskForScan("*")
-        , m_sizeOfBlock(1)
+        , m_masksForScan({"*"})
+        , m_isMaskRegex(false)
+        , m_sizeOfBlock(4096)
+        , m_maxSizeOfBlock(1024 * 1024)
         , m_hashAlg("md5")
+        , m_compareMode("hash")
+        , m_cntThreads(0)
+        , m_maxOpenFiles(0)
+        , m_ioMode("auto")
+        , m_queueDepth(32)
+        , m_isDirectIo(false)
+        , m_cachePath()
+        , m_hardlinks("dup")
+        , m_isSample(false)
+        , m_outputFormat("plain")
+        , m_readOrder("physical")
+        , m_deviceQueueDepth(0)
+        , m_isWatch(false)
+        , m_checkpointPath()
+        , m_isResume(false)
+        , m_cntShards(0)
     {};
     ~Settings() = default;
 
@@ -76,11 +224,18 @@ public:
     {   return m_minimalSizeOfFile;  }
 
     /*!
-        Функция void getDepthScan()
-        - получение маски имени файла для сканирования.
+        Функция std::vector<std::string> getMasksForScan()
+        - получение масок имени файла для сканирования (файл подходит под любую из них).
+    */
+    std::vector<std::string> getMasksForScan() const
+    {   return m_masksForScan;  }
+
+    /*!
+        Функция bool isMaskRegex()
+        - признак масок-регулярных выражений вместо шаблонов glob.
     */
-    std::string getMaskForScan() const
-    {   return m_maskForScan;  }
+    bool isMaskRegex() const
+    {   return m_isMaskRegex;  }
 
     /*!
         Функция void getDepthScan()
@@ -89,12 +244,194 @@ public:
     size_t getSizeOfBlock() const
     {   return m_sizeOfBlock;  }
 
+    /*!
+        Функция size_t getMaxSizeOfBlock()
+        - получение предельного размера блока: пока группа файлов совпадает,
+        размер блока удваивается от getSizeOfBlock() до этого значения.
+    */
+    size_t getMaxSizeOfBlock() const
+    {   return std::max(m_maxSizeOfBlock, m_sizeOfBlock);  }
+
     /*!
         Функция void getDepthScan()
         - получение выбранного метода получения хэша для прочитанного блока памяти файла.
     */
     std::string getHashAlg() const
     {   return m_hashAlg;  }
+
+    /*!
+        Функция std::string getCompareMode()
+        - получение способа сравнения блоков: "hash" - по хэшу, "bytes" - побайтово.
+    */
+    std::string getCompareMode() const
+    {   return m_compareMode;  }
+
+    /*!
+        Функция size_t getCntThreads()
+        - получение количества потоков обхода дерева директорий и сравнения файлов (0 - по числу ядер).
+    */
+    size_t getCntThreads() const
+    {   return m_cntThreads;  }
+
+    /*!
+        Функция size_t getMaxOpenFiles()
+        - получение бюджета одновременно открытых файлов при сравнении (0 - по RLIMIT_NOFILE).
+    */
+    size_t getMaxOpenFiles() const
+    {   return m_maxOpenFiles;  }
+
+    /*!
+        Функция std::string getIoMode()
+        - получение способа чтения файлов: "stream", "pread", "mmap" или "auto" (по размеру файла).
+    */
+    std::string getIoMode() const
+    {   return m_ioMode;  }
+
+    /*!
+        Функция size_t getQueueDepth()
+        - получение глубины очереди асинхронного чтения --io=pread (0 - синхронное чтение).
+    */
+    size_t getQueueDepth() const
+    {   return m_queueDepth;  }
+
+    /*!
+        Функция bool isDirectIo()
+        - признак чтения --io=pread в обход страничного кэша (O_DIRECT).
+    */
+    bool isDirectIo() const
+    {   return m_isDirectIo;  }
+
+    /*!
+        Функция std::string getCachePath()
+        - получение пути до файла кэша ключей блоков (пусто - без кэша).
+    */
+    std::string getCachePath() const
+    {   return m_cachePath;  }
+
+    /*!
+        Функция std::string getHardlinks()
+        - получение режима жёстких ссылок: "dup" - ссылки на один файл
+        считаются дубликатами, "ignore" - нет.
+    */
+    std::string getHardlinks() const
+    {   return m_hardlinks;  }
+
+    /*!
+        Функция bool isSample()
+        - признак сравнения последнего и среднего блоков файлов сразу после первого.
+    */
+    bool isSample() const
+    {   return m_isSample;  }
+
+    /*!
+        Функция std::string getOutputFormat()
+        - получение формата вывода групп дубликатов: "plain", "null" или "jsonl".
+    */
+    std::string getOutputFormat() const
+    {   return m_outputFormat;  }
+
+    /*!
+        Функция std::string getReadOrder()
+        - получение порядка чтения файлов группы: "physical" - по устройству
+        и физическому положению на нём, "inode" - по устройству и inode,
+        "none" - в порядке обхода.
+    */
+    std::string getReadOrder() const
+    {   return m_readOrder;  }
+
+    /*!
+        Функция size_t getDeviceQueueDepth()
+        - получение числа пакетов чтения, одновременно читаемых с одного
+        устройства (0 - 1 для вращающихся дисков, без ограничения для остальных).
+    */
+    size_t getDeviceQueueDepth() const
+    {   return m_deviceQueueDepth;  }
+
+    /*!
+        Функция bool isWatch()
+        - признак слежения за директориями после первого поиска (--watch).
+    */
+    bool isWatch() const
+    {   return m_isWatch;  }
+
+    /*!
+        Функция std::string getCheckpointPath()
+        - получение пути до файла контрольных точек поиска (пусто - без них).
+    */
+    std::string getCheckpointPath() const
+    {   return m_checkpointPath;  }
+
+    /*!
+        Функция bool isResume()
+        - признак продолжения поиска с контрольной точки (--resume).
+    */
+    bool isResume() const
+    {   return m_isResume;  }
+
+    /*!
+        Функция size_t getCntShards()
+        - получение числа процессов поиска (--shards, 0 - поиск в этом процессе).
+    */
+    size_t getCntShards() const
+    {   return m_cntShards; }
+
+    /// Запись настроек в out (передача процессам --shards)
+    void save(std::string& out) const
+    {
+        for (const auto* paths : {&m_pathsForScan, &m_pathsForUnScan, &m_masksForScan})
+        {
+            appendBinary(out, static_cast<uint32_t>(paths->size()));
+            for (const auto& item : *paths)
+            {   appendBinary(out, std::string_view(item));  }
+        }
+        for (const size_t value : {m_depthScan, m_minimalSizeOfFile, m_sizeOfBlock, m_maxSizeOfBlock, m_cntThreads
+                                   , m_maxOpenFiles, m_queueDepth, m_deviceQueueDepth, m_cntShards})
+        {   appendBinary(out, static_cast<uint64_t>(value)); }
+        for (const bool value : {m_isMaskRegex, m_isDirectIo, m_isSample, m_isWatch, m_isResume})
+        {   appendBinary(out, static_cast<uint8_t>(value));  }
+        for (const auto* value : {&m_hashAlg, &m_compareMode, &m_ioMode, &m_cachePath, &m_hardlinks
+                                  , &m_outputFormat, &m_readOrder, &m_checkpointPath})
+        {   appendBinary(out, std::string_view(*value));    }
+    }
+
+    /// Чтение настроек, записанных save(); false - данные повреждены
+    bool load(std::string_view in)
+    {
+        for (auto* paths : {&m_pathsForScan, &m_pathsForUnScan, &m_masksForScan})
+        {
+            uint32_t cntPaths = 0;
+            if (!readBinary(in, cntPaths) || (in.size() < cntPaths))
+            {   return false;   }
+            paths->resize(cntPaths);
+            for (auto& item : *paths)
+            {
+                if (!readBinary(in, item))
+                {   return false;   }
+            }
+        }
+        for (size_t* value : {&m_depthScan, &m_minimalSizeOfFile, &m_sizeOfBlock, &m_maxSizeOfBlock, &m_cntThreads
+                              , &m_maxOpenFiles, &m_queueDepth, &m_deviceQueueDepth, &m_cntShards})
+        {
+            uint64_t number = 0;
+            if (!readBinary(in, number))
+            {   return false;   }
+            *value = static_cast<size_t>(number);
+        }
+        for (bool* value : {&m_isMaskRegex, &m_isDirectIo, &m_isSample, &m_isWatch, &m_isResume})
+        {
+            uint8_t flag = 0;
+            if (!readBinary(in, flag))
+            {   return false;   }
+            *value = (flag != 0);
+        }
+        for (auto* value : {&m_hashAlg, &m_compareMode, &m_ioMode, &m_cachePath, &m_hardlinks
+                            , &m_outputFormat, &m_readOrder, &m_checkpointPath})
+        {
+            if (!readBinary(in, *value))
+            {   return false;   }
+        }
+        return in.empty();
+    }
 };
 
 /// Use Builder pattern
@@ -105,6 +442,9 @@ class SettingsBuilder
 
 public:
     SettingsBuilder() = default;
+    explicit SettingsBuilder(const Settings& settings)
+        : m_settings(settings)
+    {}
     ~SettingsBuilder() = default;
 
     SettingsBuilder& withPathScan(const std::vector<std::string>& pathsForScan)
@@ -133,7 +473,19 @@ public:
 
     SettingsBuilder& withMaskForScan(const std::string& maskForScan)
     {
-        m_settings.m_maskForScan = maskForScan;
+        m_settings.m_masksForScan = {maskForScan};
+        return *this;
+    }
+
+    SettingsBuilder& withMasksForScan(const std::vector<std::string>& masksForScan)
+    {
+        m_settings.m_masksForScan = masksForScan;
+        return *this;
+    }
+
+    SettingsBuilder& withMaskRegex(const bool& isMaskRegex)
+    {
+        m_settings.m_isMaskRegex = isMaskRegex;
         return *this;
     }
 
@@ -143,12 +495,114 @@ public:
         return *this;
     }
 
+    SettingsBuilder& withMaxSizeOfBlock(const size_t& maxSizeOfBlock)
+    {
+        m_settings.m_maxSizeOfBlock = maxSizeOfBlock;
+        return *this;
+    }
+
     SettingsBuilder& withHashAlg(const std::string& hashAlg)
     {
         m_settings.m_hashAlg = hashAlg;
         return *this;
     }
 
+    SettingsBuilder& withCompareMode(const std::string& compareMode)
+    {
+        m_settings.m_compareMode = compareMode;
+        return *this;
+    }
+
+    SettingsBuilder& withCntThreads(const size_t& cntThreads)
+    {
+        m_settings.m_cntThreads = cntThreads;
+        return *this;
+    }
+
+    SettingsBuilder& withMaxOpenFiles(const size_t& maxOpenFiles)
+    {
+        m_settings.m_maxOpenFiles = maxOpenFiles;
+        return *this;
+    }
+
+    SettingsBuilder& withIoMode(const std::string& ioMode)
+    {
+        m_settings.m_ioMode = ioMode;
+        return *this;
+    }
+
+    SettingsBuilder& withQueueDepth(const size_t& queueDepth)
+    {
+        m_settings.m_queueDepth = queueDepth;
+        return *this;
+    }
+
+    SettingsBuilder& withDirectIo(const bool& isDirectIo)
+    {
+        m_settings.m_isDirectIo = isDirectIo;
+        return *this;
+    }
+
+    SettingsBuilder& withCachePath(const std::string& cachePath)
+    {
+        m_settings.m_cachePath = cachePath;
+        return *this;
+    }
+
+    SettingsBuilder& withHardlinks(const std::string& hardlinks)
+    {
+        m_settings.m_hardlinks = hardlinks;
+        return *this;
+    }
+
+    SettingsBuilder& withSample(const bool& isSample)
+    {
+        m_settings.m_isSample = isSample;
+        return *this;
+    }
+
+    SettingsBuilder& withOutputFormat(const std::string& outputFormat)
+    {
+        m_settings.m_outputFormat = outputFormat;
+        return *this;
+    }
+
+    SettingsBuilder& withReadOrder(const std::string& readOrder)
+    {
+        m_settings.m_readOrder = readOrder;
+        return *this;
+    }
+
+    SettingsBuilder& withDeviceQueueDepth(const size_t& deviceQueueDepth)
+    {
+        m_settings.m_deviceQueueDepth = deviceQueueDepth;
+        return *this;
+    }
+
+    SettingsBuilder& withWatch(const bool& isWatch)
+    {
+        m_settings.m_isWatch = isWatch;
+        return *this;
+    }
+
+    SettingsBuilder& withCheckpointPath(const std::string& checkpointPath)
+    {
+        m_settings.m_checkpointPath = checkpointPath;
+        return *this;
+    }
+
+    SettingsBuilder& withResume(const bool& isResume)
+    {
+        m_settings.m_isResume = isResume;
+        return *this;
+    }
+
+    SettingsBuilder& withCntShards(const size_t& cntShards)
+    {
+        m_settings.m_cntShards = cntShards;
+        return *this;
+    }
+
     Settings& build()
     {
         return m_settings;
@@ -156,127 +610,6968 @@ public:
 };
 
 
-std::unordered_multimap<boost::uintmax_t, path> doubleFiles;
-
+/*!
+    Структура IoStats - счётчики всех этапов работы (--stats): время этапов,
+    обход директорий (директории, элементы, stat(), байты элементов),
+    открытия файлов, системные вызовы чтения (pread/read и запросы
+    io_uring; чтения через mmap - обращения к памяти и не считаются),
+    чтение и хэширование блоков, разбиения групп по раундам сравнения.
+    Счётчики - атомарные без упорядочивания, обход директорий добавляет
+    их один раз на директорию, сравнение - один раз на раунд группы.
 
-void outputFiles(Settings& options, const path& currGlobPath, size_t& curDepthScan, const std::vector<path>& unScanPath)
+    При isCollectGroups сохраняются также чтения по каждой группе
+    дубликатов (для подбора --sb и --sbmax), при isCollectDevices - чтения
+    и переходы по каждому устройству. Переход - чтение, которое не
+    продолжает предыдущее чтение с того же устройства (другой файл или
+    не следующий блок файла).
+*/
+struct IoStats
 {
-    auto outputPath = [](const size_t replacedCount, const path& path_){
-        std::string replacedStr(path_.string());
-//        std::cout << "|_" << replacedStr.replace(0, replacedCount, replacedCount, '_') << '\n';
+    /// Этапы работы: обход директорий, группировка файлов по размеру, сравнение
+    enum Phase
+    {
+        kPhaseScan,
+        kPhaseGroup,
+        kPhaseCompare,
+        kCntPhases
     };
 
-    auto checkMatchPath = [unScanPath](const path& path_) -> bool {
-        for(const auto& item : unScanPath)
-        {
-            if (path_.compare(item) == 0)
-            {   return true;    }
-        }
-        return false;
+    /// Раунд сравнения группы - номер её очередного блока; раунды от
+    /// kMaxRounds - 1 учитываются вместе
+    static constexpr size_t kMaxRounds = 64;
+
+    struct RoundStats
+    {
+        std::atomic<uint64_t> cntGroups{0};
+        std::atomic<uint64_t> cntFiles{0};
+        std::atomic<uint64_t> cntSubGroups{0};
     };
 
-    ++curDepthScan;
+    struct DeviceStats
+    {
+        uint64_t cntReads = 0;
+        uint64_t bytesRead = 0;
+        uint64_t cntSeeks = 0;
+
+        uint64_t lastIno = 0;
+        uint64_t lastEnd = 0;
+    };
 
-    directory_iterator itrBeg(currGlobPath);
-    directory_iterator itrEnd;
-    path prevPath = currGlobPath;
-    while((curDepthScan < options.getDepthScan()) || ((itrBeg == itrEnd)))
+    struct GroupStats
     {
-        while (itrBeg != itrEnd)
-        {
-            path iterPath = itrBeg->path();
+        uint64_t fileSize = 0;
+        size_t cntFiles = 0;
+        uint64_t cntReads = 0;
+        uint64_t bytesRead = 0;
+    };
 
-            if (is_regular_file(iterPath))
-            {
-                outputPath(currGlobPath.string().size(), iterPath);
+    std::atomic<uint64_t> cntReads{0};
+    std::atomic<uint64_t> bytesRead{0};
+    std::atomic<uint64_t> cntAllocations{0};
+    std::atomic<uint64_t> bytesAllocated{0};
+    std::atomic<uint64_t> cntCacheHits{0};
+    std::atomic<uint64_t> bytesCacheHits{0};
+    std::atomic<uint64_t> cntHoles{0};
+    std::atomic<uint64_t> bytesHoles{0};
 
-                ///    2 а). Исколючение из поиска файлов, которые:
-                ///    меньше минимального рамера
-                ///    или
-                ///    имя файла не удовлетворяет заданной маске
-                if (
-                        (static_cast<size_t>(iterPath.size()) > options.getMinimalSizeOfFile()) &&
-                        (std::regex_search(iterPath.string()
-                                          , std::regex(options.getMaskForScan()
-                                          , std::regex_constants::ECMAScript)))
-                    )
-                {
-                    doubleFiles.insert({file_size(iterPath), iterPath});
-//                    std::cout << static_cast<uint64_t>(file_size(iterPath)) << "  " << iterPath.string() << '\n';
-                }
-            }
-            else if (
-                     (is_directory(iterPath)) &&
-                     (curDepthScan < options.getDepthScan()) &&
-                     (!checkMatchPath(iterPath))
-                     )
-            {
-                prevPath = currGlobPath;
+    std::array<std::atomic<uint64_t>, kCntPhases> phaseTimesNs{};
+    std::atomic<uint64_t> cntDirs{0};
+    std::atomic<uint64_t> cntEntries{0};
+    std::atomic<uint64_t> bytesEntries{0};
+    std::atomic<uint64_t> cntStats{0};
+    std::atomic<uint64_t> cntOpens{0};
+    std::atomic<uint64_t> cntReadCalls{0};
+    std::atomic<uint64_t> cntCandidates{0};
+    std::atomic<uint64_t> bytesCandidates{0};
+    std::atomic<uint64_t> cntBlocksHashed{0};
+    std::array<RoundStats, kMaxRounds> rounds;
 
-                outputPath(currGlobPath.string().size(), iterPath);
+    /// Найденные файлы и объём индексов процессов --shards (у координатора своего индекса нет)
+    uint64_t cntShardFiles = 0;
+    uint64_t bytesShardIndex = 0;
 
-                outputFiles(options, iterPath, curDepthScan, unScanPath);
-            }
-            ++itrBeg;
-        }
-        break;
+    void addPhaseTime(Phase phase, std::chrono::steady_clock::duration time)
+    {   phaseTimesNs[phase].fetch_add(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count()), std::memory_order_relaxed);    }
+
+    void addDir(uint64_t cntDirEntries, uint64_t bytesDirEntries, uint64_t cntDirStats)
+    {
+        cntDirs.fetch_add(1, std::memory_order_relaxed);
+        cntEntries.fetch_add(cntDirEntries, std::memory_order_relaxed);
+        bytesEntries.fetch_add(bytesDirEntries, std::memory_order_relaxed);
+        cntStats.fetch_add(cntDirStats, std::memory_order_relaxed);
+        cntOpens.fetch_add(1, std::memory_order_relaxed);
     }
-    --curDepthScan;
-}
 
+    void addStat()
+    {   cntStats.fetch_add(1, std::memory_order_relaxed);  }
 
+    void addOpen()
+    {   cntOpens.fetch_add(1, std::memory_order_relaxed);  }
 
-/*!
-    Ф-ия взятия хэша блока памяти
-*/
-template <typename HashType, typename HashType_DigestType>
-std::string getHash(char* readBlock, const uint64_t blockSize)
-{
-    std::string result;
-    HashType_DigestType digest;
+    void addReadCall()
+    {   cntReadCalls.fetch_add(1, std::memory_order_relaxed);  }
 
-    HashType m_currHash;
-    m_currHash.process_bytes(readBlock, blockSize);
-    m_currHash.get_digest(digest);
+    void addCandidates(uint64_t cntFiles, uint64_t fileSize)
+    {
+        cntCandidates.fetch_add(cntFiles, std::memory_order_relaxed);
+        bytesCandidates.fetch_add(cntFiles * fileSize, std::memory_order_relaxed);
+    }
 
-    const auto charDigest = reinterpret_cast<const char*>(&digest);
+    void addRound(size_t round, uint64_t cntFiles, uint64_t cntSubGroups, uint64_t cntHashed)
+    {
+        auto& roundStats = rounds[std::min(round, kMaxRounds - 1)];
+        roundStats.cntGroups.fetch_add(1, std::memory_order_relaxed);
+        roundStats.cntFiles.fetch_add(cntFiles, std::memory_order_relaxed);
+        roundStats.cntSubGroups.fetch_add(cntSubGroups, std::memory_order_relaxed);
+        cntBlocksHashed.fetch_add(cntHashed, std::memory_order_relaxed);
+    }
 
-    boost::algorithm::hex(charDigest, charDigest + sizeof(md5::digest_type), std::back_inserter(result));
+    void addRead(uint64_t size)
+    {
+        cntReads.fetch_add(1, std::memory_order_relaxed);
+        bytesRead.fetch_add(size, std::memory_order_relaxed);
+    }
 
-    result.resize(5); // Cutting hash
+    void addAllocation(uint64_t size)
+    {
+        cntAllocations.fetch_add(1, std::memory_order_relaxed);
+        bytesAllocated.fetch_add(size, std::memory_order_relaxed);
+    }
 
-    return result;
-}
+    bool isCollectGroups = false;
+    std::mutex groupsMutex;
+    std::vector<GroupStats> groups;
 
-/*!
-    Структура DataFile - хранилище св-в файла
-*/
-struct DataFile
-{
-    explicit DataFile(const std::string& pathToFile_, uint32_t blockSize_)
-        : pathToFile(pathToFile_)
-        , fileSize(static_cast<uint64_t>(file_size(pathToFile)))
-        , fd(pathToFile, std::ios::in | std::ios::binary)
-        , blockSize(blockSize_)
+    void addCacheHit(uint64_t size)
     {
-        if (!fd.is_open())
-        {   std::cout << "Error open file!\n";    } // std::throw
+        cntCacheHits.fetch_add(1, std::memory_order_relaxed);
+        bytesCacheHits.fetch_add(size, std::memory_order_relaxed);
     }
 
-    ~DataFile()
+    void addHole(uint64_t size)
     {
-//        std::cout << "~DataFile()!\n";
+        cntHoles.fetch_add(1, std::memory_order_relaxed);
+        bytesHoles.fetch_add(size, std::memory_order_relaxed);
+    }
 
-        if (fd.is_open())
-        {   fd.close(); }
+    void addGroup(const GroupStats& groupStats)
+    {
+        if (!isCollectGroups)
+        {   return; }
+        std::lock_guard<std::mutex> lock(groupsMutex);
+        groups.push_back(groupStats);
     }
 
-    const std::string& pathToFile;
-    uint64_t fileSize;
-    std::ifstream fd;
+    bool isCollectDevices = false;
+    std::mutex devicesMutex;
+    std::map<uint64_t, DeviceStats> devices;
 
-    uint32_t blockSize;
-    std::string hashFile;
+    void addDeviceRead(uint64_t dev, uint64_t ino, uint64_t offset, uint64_t size)
+    {
+        if (!isCollectDevices)
+        {   return; }
+        std::lock_guard<std::mutex> lock(devicesMutex);
+        auto& deviceStats = devices[dev];
+        if ((deviceStats.cntReads == 0) || (deviceStats.lastIno != ino) || (deviceStats.lastEnd != offset))
+        {   ++deviceStats.cntSeeks;    }
+        ++deviceStats.cntReads;
+        deviceStats.bytesRead += size;
+        deviceStats.lastIno = ino;
+        deviceStats.lastEnd = offset + size;
+    }
+
+    /*!
+        Функция void save(std::string& out)
+        - запись счётчиков, чтений групп и устройств в out: процессы --shards
+        передают их координатору. Время этапов не передаётся, координатор
+        учитывает его сам
+    */
+    void save(std::string& out)
+    {
+        forEachCounter(*this, [&out](const std::atomic<uint64_t>& counter) {
+            appendBinary(out, counter.load(std::memory_order_relaxed));
+        });
+
+        std::lock_guard<std::mutex> groupsLock(groupsMutex);
+        appendBinary(out, static_cast<uint64_t>(groups.size()));
+        for (const auto& groupStats : groups)
+        {   appendBinary(out, groupStats);  }
+
+        std::lock_guard<std::mutex> devicesLock(devicesMutex);
+        appendBinary(out, static_cast<uint64_t>(devices.size()));
+        for (const auto& item : devices)
+        {
+            appendBinary(out, item.first);
+            appendBinary(out, item.second);
+        }
+    }
+
+    /// Добавление к своим счётчиков, записанных save(); false - данные повреждены
+    bool add(std::string_view in)
+    {
+        bool isValid = true;
+        forEachCounter(*this, [&in, &isValid](std::atomic<uint64_t>& counter) {
+            uint64_t value = 0;
+            isValid = isValid && readBinary(in, value);
+            counter.fetch_add(value, std::memory_order_relaxed);
+        });
+
+        uint64_t cntItems = 0;
+        if (!isValid || !readBinary(in, cntItems))
+        {   return false;   }
+        for (uint64_t i = 0; i < cntItems; ++i)
+        {
+            GroupStats groupStats;
+            if (!readBinary(in, groupStats))
+            {   return false;   }
+            addGroup(groupStats);
+        }
+
+        if (!readBinary(in, cntItems))
+        {   return false;   }
+        for (uint64_t i = 0; i < cntItems; ++i)
+        {
+            uint64_t dev = 0;
+            DeviceStats deviceStats;
+            if (!readBinary(in, dev) || !readBinary(in, deviceStats))
+            {   return false;   }
+            if (!isCollectDevices)
+            {   continue;   }
+
+            std::lock_guard<std::mutex> lock(devicesMutex);
+            auto& sumStats = devices[dev];
+            sumStats.cntReads += deviceStats.cntReads;
+            sumStats.bytesRead += deviceStats.bytesRead;
+            sumStats.cntSeeks += deviceStats.cntSeeks;
+        }
+        return in.empty();
+    }
+
+private:
+    template <typename Self, typename Func>
+    static void forEachCounter(Self& self, Func func)
+    {
+        for (auto* counter : {&self.cntReads, &self.bytesRead, &self.cntAllocations, &self.bytesAllocated
+                              , &self.cntCacheHits, &self.bytesCacheHits, &self.cntHoles, &self.bytesHoles
+                              , &self.cntDirs, &self.cntEntries, &self.bytesEntries, &self.cntStats
+                              , &self.cntOpens, &self.cntReadCalls, &self.cntCandidates, &self.bytesCandidates
+                              , &self.cntBlocksHashed})
+        {   func(*counter); }
+        for (auto& roundStats : self.rounds)
+        {
+            func(roundStats.cntGroups);
+            func(roundStats.cntFiles);
+            func(roundStats.cntSubGroups);
+        }
+    }
 };
 
+IoStats ioStats;
 
+
+/*!
+    Класс PhaseTimer - учёт времени этапа phase в ioStats от создания
+    до разрушения объекта
+*/
+class PhaseTimer
+{
+    const IoStats::Phase m_phase;
+    const std::chrono::steady_clock::time_point m_timeStart;
+
+public:
+    explicit PhaseTimer(IoStats::Phase phase)
+        : m_phase(phase)
+        , m_timeStart(std::chrono::steady_clock::now())
+    {}
+
+    ~PhaseTimer()
+    {   ioStats.addPhaseTime(m_phase, std::chrono::steady_clock::now() - m_timeStart);   }
+};
+
+
+/*!
+    Структура FileStat - свойства файла из единственного stat() при обходе:
+    размер, идентификатор (устройство, inode), общий у жёстких ссылок,
+    и время изменения (для кэша --cache). Дальше по конвейеру файл
+    повторно не опрашивается.
+*/
+struct FileStat
+{
+    uint64_t size = 0;
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+    int64_t mtimeNs = 0;
+    int64_t ctimeNs = 0;
+
+    static FileStat fromStat(const struct stat& fileStat)
+    {
+        FileStat result;
+        result.size = static_cast<uint64_t>(fileStat.st_size);
+        result.dev = static_cast<uint64_t>(fileStat.st_dev);
+        result.ino = static_cast<uint64_t>(fileStat.st_ino);
+        result.mtimeNs = static_cast<int64_t>(fileStat.st_mtim.tv_sec) * 1000000000 + fileStat.st_mtim.tv_nsec;
+        result.ctimeNs = static_cast<int64_t>(fileStat.st_ctim.tv_sec) * 1000000000 + fileStat.st_ctim.tv_nsec;
+        return result;
+    }
+
+    /// Свойства файла по пути; исключение filesystem_error, если файл недоступен
+    static FileStat load(const std::string& pathToFile)
+    {
+        struct stat fileStat{};
+        ioStats.addStat();
+        if (::stat(pathToFile.c_str(), &fileStat) != 0)
+        {   throw filesystem_error("stat", path(pathToFile), boost::system::error_code(errno, boost::system::system_category()));   }
+        return fromStat(fileStat);
+    }
+};
+
+/*!
+    Класс FileIndex - компактный индекс найденных при обходе файлов.
+
+    Пути не хранятся целиком: имена директорий и файлов лежат подряд в
+    одной строке-арене, директория - пара (родительская директория, имя),
+    файл - пара (директория, имя). Корень сканирования - директория без
+    родителя, её имя - канонический путь. Полный путь собирается getPath()
+    только для файлов, которые действительно сравниваются.
+
+    Свойства файлов хранятся по столбцам (struct of arrays), без узлов
+    хэш-таблицы и отдельной строки на файл. После sortBySize() файлы одного
+    размера идут подряд (в порядке обхода), группа размера - непрерывный
+    диапазон индексов.
+*/
+class FileIndex
+{
+    std::string m_names;
+
+    std::vector<uint32_t> m_dirParents;
+    std::vector<uint64_t> m_dirNameOffsets;
+    std::vector<uint32_t> m_dirNameLengths;
+
+    std::vector<uint32_t> m_fileDirs;
+    std::vector<uint64_t> m_fileNameOffsets;
+    std::vector<uint32_t> m_fileNameLengths;
+    std::vector<uint64_t> m_sizes;
+    std::vector<uint64_t> m_devs;
+    std::vector<uint64_t> m_inos;
+    std::vector<int64_t> m_mtimesNs;
+    std::vector<int64_t> m_ctimesNs;
+
+    uint64_t addName(std::string_view name)
+    {
+        const uint64_t offset = m_names.size();
+        m_names.append(name.data(), name.size());
+        return offset;
+    }
+
+    template <typename T>
+    static void permute(std::vector<T>& column, const std::vector<uint32_t>& order)
+    {
+        std::vector<T> sorted;
+        sorted.reserve(column.size());
+        for (const uint32_t idx : order)
+        {   sorted.push_back(column[idx]);  }
+        column.swap(sorted);
+    }
+
+    template <typename T>
+    static uint64_t getBytesUsed(const std::vector<T>& column)
+    {   return column.capacity() * sizeof(T);  }
+
+    template <typename T>
+    static void saveColumn(const std::vector<T>& column, std::string& out)
+    {   out.append(reinterpret_cast<const char*>(column.data()), column.size() * sizeof(T));  }
+
+    template <typename T>
+    static bool loadColumn(std::string_view& in, uint64_t size, std::vector<T>& column)
+    {
+        if (in.size() / sizeof(T) < size)
+        {   return false;   }
+        column.resize(size);
+        std::memcpy(column.data(), in.data(), size * sizeof(T));
+        in.remove_prefix(size * sizeof(T));
+        return true;
+    }
+
+    void appendName(uint64_t offset, uint32_t length, std::string& result) const
+    {
+        if (!result.empty() && (result.back() != '/'))
+        {   result.push_back('/');  }
+        result.append(m_names, offset, length);
+    }
+
+    void appendDirPath(uint32_t dir, std::string& result) const
+    {
+        std::vector<uint32_t> dirs;
+        for (; dir != kNoDir; dir = m_dirParents[dir])
+        {   dirs.push_back(dir);    }
+
+        for (auto itDir = dirs.rbegin(); itDir != dirs.rend(); ++itDir)
+        {   appendName(m_dirNameOffsets[*itDir], m_dirNameLengths[*itDir], result);  }
+    }
+
+public:
+    static constexpr uint32_t kNoDir = std::numeric_limits<uint32_t>::max();
+
+    /// Добавление директории name в директорию parentDir (kNoDir - корень);
+    /// исключение std::length_error, если номер директории не помещается в uint32_t
+    uint32_t addDir(uint32_t parentDir, std::string_view name)
+    {
+        if (m_dirParents.size() >= kNoDir)
+        {   throw std::length_error("Too many directories for index of files");  }
+        m_dirParents.push_back(parentDir);
+        m_dirNameOffsets.push_back(addName(name));
+        m_dirNameLengths.push_back(static_cast<uint32_t>(name.size()));
+        return static_cast<uint32_t>(m_dirParents.size() - 1);
+    }
+
+    /// Добавление файла name со свойствами fileStat в директорию dir;
+    /// исключение std::length_error, если номер файла не помещается в uint32_t
+    void addFile(uint32_t dir, std::string_view name, const FileStat& fileStat)
+    {
+        if (m_sizes.size() >= std::numeric_limits<uint32_t>::max())
+        {   throw std::length_error("Too many files for index of files");   }
+        m_fileDirs.push_back(dir);
+        m_fileNameOffsets.push_back(addName(name));
+        m_fileNameLengths.push_back(static_cast<uint32_t>(name.size()));
+        m_sizes.push_back(fileStat.size);
+        m_devs.push_back(fileStat.dev);
+        m_inos.push_back(fileStat.ino);
+        m_mtimesNs.push_back(fileStat.mtimeNs);
+        m_ctimesNs.push_back(fileStat.ctimeNs);
+    }
+
+    size_t size() const
+    {   return m_sizes.size();  }
+
+    uint64_t getSize(size_t idx) const
+    {   return m_sizes[idx];    }
+
+    /// Директория файла idx
+    uint32_t getDir(size_t idx) const
+    {   return m_fileDirs[idx]; }
+
+    /// Имя файла idx в его директории
+    std::string_view getName(size_t idx) const
+    {   return std::string_view(m_names).substr(m_fileNameOffsets[idx], m_fileNameLengths[idx]);  }
+
+    FileStat getFileStat(size_t idx) const
+    {
+        FileStat fileStat;
+        fileStat.size = m_sizes[idx];
+        fileStat.dev = m_devs[idx];
+        fileStat.ino = m_inos[idx];
+        fileStat.mtimeNs = m_mtimesNs[idx];
+        fileStat.ctimeNs = m_ctimesNs[idx];
+        return fileStat;
+    }
+
+    /// Новые свойства файла idx (файл изменился на месте)
+    void setFileStat(size_t idx, const FileStat& fileStat)
+    {
+        m_sizes[idx] = fileStat.size;
+        m_devs[idx] = fileStat.dev;
+        m_inos[idx] = fileStat.ino;
+        m_mtimesNs[idx] = fileStat.mtimeNs;
+        m_ctimesNs[idx] = fileStat.ctimeNs;
+    }
+
+    size_t getCntDirs() const
+    {   return m_dirParents.size();  }
+
+    /// Уровень директории dir: 1 - корень сканирования
+    size_t getDirLevel(uint32_t dir) const
+    {
+        size_t level = 0;
+        for (; dir != kNoDir; dir = m_dirParents[dir])
+        {   ++level;    }
+        return level;
+    }
+
+    /// Полный путь директории dir
+    std::string getDirPath(uint32_t dir) const
+    {
+        std::string result;
+        appendDirPath(dir, result);
+        return result;
+    }
+
+    /// Полный путь файла idx
+    std::string getPath(size_t idx) const
+    {
+        std::string result;
+        appendDirPath(m_fileDirs[idx], result);
+        appendName(m_fileNameOffsets[idx], m_fileNameLengths[idx], result);
+        return result;
+    }
+
+    /// Устойчивая сортировка файлов по размеру
+    void sortBySize()
+    {
+        std::vector<uint32_t> order(size());
+        for (size_t i = 0; i < order.size(); ++i)
+        {   order[i] = static_cast<uint32_t>(i);   }
+        std::stable_sort(order.begin(), order.end(), [this](uint32_t lhs, uint32_t rhs) {
+            return m_sizes[lhs] < m_sizes[rhs];
+        });
+        permuteFiles(order);
+    }
+
+    /// Перестановка файлов: i-м становится файл order[i]
+    void permuteFiles(const std::vector<uint32_t>& order)
+    {
+        permute(m_fileDirs, order);
+        permute(m_fileNameOffsets, order);
+        permute(m_fileNameLengths, order);
+        permute(m_sizes, order);
+        permute(m_devs, order);
+        permute(m_inos, order);
+        permute(m_mtimesNs, order);
+        permute(m_ctimesNs, order);
+    }
+
+    /// Объём памяти, занятый индексом (байт)
+    uint64_t getBytesUsed() const
+    {
+        return m_names.capacity()
+                + getBytesUsed(m_dirParents) + getBytesUsed(m_dirNameOffsets) + getBytesUsed(m_dirNameLengths)
+                + getBytesUsed(m_fileDirs) + getBytesUsed(m_fileNameOffsets) + getBytesUsed(m_fileNameLengths)
+                + getBytesUsed(m_sizes) + getBytesUsed(m_devs) + getBytesUsed(m_inos)
+                + getBytesUsed(m_mtimesNs) + getBytesUsed(m_ctimesNs);
+    }
+
+    void clear()
+    {
+        *this = FileIndex();
+    }
+
+    /// Запись индекса в out: размеры арены и столбцов, затем сами столбцы
+    void save(std::string& out) const
+    {
+        const uint64_t sizes[3] = {m_names.size(), m_dirParents.size(), m_sizes.size()};
+        out.append(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+        out.append(m_names);
+        saveColumn(m_dirParents, out);
+        saveColumn(m_dirNameOffsets, out);
+        saveColumn(m_dirNameLengths, out);
+        saveColumn(m_fileDirs, out);
+        saveColumn(m_fileNameOffsets, out);
+        saveColumn(m_fileNameLengths, out);
+        saveColumn(m_sizes, out);
+        saveColumn(m_devs, out);
+        saveColumn(m_inos, out);
+        saveColumn(m_mtimesNs, out);
+        saveColumn(m_ctimesNs, out);
+    }
+
+    /// Чтение индекса, записанного save(); false - данные повреждены
+    bool load(std::string_view in)
+    {
+        uint64_t sizes[3] = {};
+        if (in.size() < sizeof(sizes))
+        {   return false;   }
+        std::memcpy(sizes, in.data(), sizeof(sizes));
+        in.remove_prefix(sizeof(sizes));
+        if (in.size() < sizes[0])
+        {   return false;   }
+        m_names.assign(in.data(), sizes[0]);
+        in.remove_prefix(sizes[0]);
+
+        return loadColumn(in, sizes[1], m_dirParents) && loadColumn(in, sizes[1], m_dirNameOffsets)
+                && loadColumn(in, sizes[1], m_dirNameLengths) && loadColumn(in, sizes[2], m_fileDirs)
+                && loadColumn(in, sizes[2], m_fileNameOffsets) && loadColumn(in, sizes[2], m_fileNameLengths)
+                && loadColumn(in, sizes[2], m_sizes) && loadColumn(in, sizes[2], m_devs)
+                && loadColumn(in, sizes[2], m_inos) && loadColumn(in, sizes[2], m_mtimesNs)
+                && loadColumn(in, sizes[2], m_ctimesNs) && in.empty();
+    }
+};
+
+FileIndex fileIndex;
+
+
+/*!
+    Ф-ия получения пикового объёма резидентной памяти процесса (байт)
+*/
+inline uint64_t getPeakRss()
+{
+    // Для завершённых процессов --shards - наибольший из них
+    rusage usage{};
+    rusage childrenUsage{};
+    if ((::getrusage(RUSAGE_SELF, &usage) != 0) || (::getrusage(RUSAGE_CHILDREN, &childrenUsage) != 0))
+    {   return 0;   }
+    // ru_maxrss в Linux - в килобайтах
+    return static_cast<uint64_t>(std::max(usage.ru_maxrss, childrenUsage.ru_maxrss)) * 1024;
+}
+
+
+/*!
+    Ф-ия получения количества потоков из настроек (0 - по числу ядер)
+*/
+inline size_t getCntThreads(const Settings& options)
+{
+    const size_t cntThreads = options.getCntThreads();
+    return (cntThreads != 0) ? cntThreads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+
+/*!
+    Класс FileMask - набор масок имени файла (--mask), скомпилированный
+    один раз на обход. Имя подходит, если подходит под любую из масок;
+    регистр букв (ASCII) не учитывается.
+
+    Маски - шаблоны glob: '*' - любая последовательность символов,
+    '?' - один символ, [abc], [a-z], [!abc] - класс символов. Частые
+    шаблоны разбираются заранее: "*" (любое имя), "*.jpg" (суффикс),
+    "img*" (префикс) и имя без спецсимволов сравниваются напрямую, без
+    обхода шаблона. С --mask-regex маски - регулярные выражения ECMAScript,
+    которые ищутся в имени файла.
+
+    match() не выделяет память и может вызываться из нескольких потоков.
+*/
+class FileMask
+{
+    enum class Kind
+    {
+        Any,
+        Literal,
+        Prefix,
+        Suffix,
+        Glob,
+        Regex
+    };
+
+    struct Pattern
+    {
+        Kind kind = Kind::Glob;
+        std::string text;       // в нижнем регистре; для Prefix/Suffix - без '*'
+        std::regex regex;
+    };
+
+    std::vector<Pattern> m_patterns;
+
+    static char toLower(char ch)
+    {   return ((ch >= 'A') && (ch <= 'Z')) ? static_cast<char>(ch - 'A' + 'a') : ch;  }
+
+    static bool equalsLower(std::string_view name, std::string_view text)
+    {
+        if (name.size() != text.size())
+        {   return false;   }
+        for (size_t i = 0; i < name.size(); ++i)
+        {
+            if (toLower(name[i]) != text[i])
+            {   return false;   }
+        }
+        return true;
+    }
+
+    /// Сопоставление символа ch с классом, начинающимся с '[' в позиции pos;
+    /// pos переводится за конец класса. Незакрытая '[' - обычный символ
+    static bool matchClass(std::string_view glob, size_t& pos, char ch)
+    {
+        size_t end = pos + 1;
+        const bool isNegative = (end < glob.size()) && (glob[end] == '!');
+        if (isNegative)
+        {   ++end;  }
+        const size_t begin = end;
+        // ']' сразу после '[' или '[!' - символ класса
+        if ((end < glob.size()) && (glob[end] == ']'))
+        {   ++end;  }
+        while ((end < glob.size()) && (glob[end] != ']'))
+        {   ++end;  }
+        if (end >= glob.size())
+        {
+            ++pos;
+            return ch == '[';
+        }
+
+        bool isFound = false;
+        for (size_t i = begin; i < end; ++i)
+        {
+            if ((i + 2 < end) && (glob[i + 1] == '-'))
+            {
+                isFound = isFound || ((ch >= glob[i]) && (ch <= glob[i + 2]));
+                i += 2;
+            }
+            else
+            {   isFound = isFound || (ch == glob[i]);   }
+        }
+        pos = end + 1;
+        return isFound != isNegative;
+    }
+
+public:
+    /// Сопоставление glob с откатом к последней '*': O(длина имени * длина шаблона).
+    /// При isIgnoreCase шаблон glob должен быть в нижнем регистре
+    static bool matchGlob(std::string_view glob, std::string_view name, bool isIgnoreCase = true)
+    {
+        size_t posGlob = 0;
+        size_t posName = 0;
+        size_t posStar = std::string_view::npos;
+        size_t posStarName = 0;
+
+        while (posName < name.size())
+        {
+            const char ch = isIgnoreCase ? toLower(name[posName]) : name[posName];
+            if (posGlob < glob.size())
+            {
+                if (glob[posGlob] == '*')
+                {
+                    posStar = posGlob++;
+                    posStarName = posName;
+                    continue;
+                }
+                if (glob[posGlob] == '?')
+                {
+                    ++posGlob;
+                    ++posName;
+                    continue;
+                }
+                if (glob[posGlob] == '[')
+                {
+                    size_t posNext = posGlob;
+                    if (matchClass(glob, posNext, ch))
+                    {
+                        posGlob = posNext;
+                        ++posName;
+                        continue;
+                    }
+                }
+                else if (glob[posGlob] == ch)
+                {
+                    ++posGlob;
+                    ++posName;
+                    continue;
+                }
+            }
+            if (posStar == std::string_view::npos)
+            {   return false;   }
+            posGlob = posStar + 1;
+            posName = ++posStarName;
+        }
+
+        while ((posGlob < glob.size()) && (glob[posGlob] == '*'))
+        {   ++posGlob;  }
+        return posGlob == glob.size();
+    }
+
+    static bool isGlob(std::string_view text)
+    {   return text.find_first_of("*?[") != std::string_view::npos;  }
+
+private:
+
+    static Pattern compileGlob(const std::string& mask)
+    {
+        Pattern pattern;
+        for (const char ch: mask)
+        {   pattern.text.push_back(toLower(ch));   }
+
+        const std::string_view text = pattern.text;
+        const auto isPlain = [](std::string_view part) {
+            return !isGlob(part);
+        };
+
+        if (text.find_first_not_of('*') == std::string_view::npos)
+        {   pattern.kind = Kind::Any;   }
+        else if (isPlain(text))
+        {   pattern.kind = Kind::Literal;   }
+        else if ((text.front() == '*') && isPlain(text.substr(1)))
+        {
+            pattern.kind = Kind::Suffix;
+            pattern.text.erase(0, 1);
+        }
+        else if ((text.back() == '*') && isPlain(text.substr(0, text.size() - 1)))
+        {
+            pattern.kind = Kind::Prefix;
+            pattern.text.pop_back();
+        }
+        return pattern;
+    }
+
+public:
+    FileMask(const std::vector<std::string>& masks, bool isRegex)
+    {
+        for (const auto& mask: masks)
+        {
+            if (isRegex)
+            {
+                Pattern pattern;
+                pattern.kind = Kind::Regex;
+                pattern.regex = std::regex(mask, std::regex_constants::ECMAScript
+                                               | std::regex_constants::icase
+                                               | std::regex_constants::optimize);
+                m_patterns.push_back(std::move(pattern));
+            }
+            else
+            {   m_patterns.push_back(compileGlob(mask));  }
+        }
+    }
+
+    /*!
+        Функция bool match(std::string_view name)
+        - подходит ли имя файла (без директории) под одну из масок
+    */
+    bool match(std::string_view name) const
+    {
+        for (const auto& pattern: m_patterns)
+        {
+            bool isMatched = false;
+            switch (pattern.kind)
+            {
+            case Kind::Any:
+                isMatched = true;
+                break;
+            case Kind::Literal:
+                isMatched = equalsLower(name, pattern.text);
+                break;
+            case Kind::Prefix:
+                isMatched = (name.size() >= pattern.text.size())
+                        && equalsLower(name.substr(0, pattern.text.size()), pattern.text);
+                break;
+            case Kind::Suffix:
+                isMatched = (name.size() >= pattern.text.size())
+                        && equalsLower(name.substr(name.size() - pattern.text.size()), pattern.text);
+                break;
+            case Kind::Glob:
+                isMatched = matchGlob(pattern.text, name);
+                break;
+            case Kind::Regex:
+                isMatched = std::regex_search(name.begin(), name.end(), pattern.regex);
+                break;
+            }
+            if (isMatched)
+            {   return true;    }
+        }
+        return false;
+    }
+};
+
+
+/*!
+    Класс ExclusionTrie - исключения из сканирования (--unsc), собранные
+    в дерево по компонентам пути.
+
+    Пути приводятся к абсолютному виду и нормализуются лексически
+    (без раскрытия ссылок, как и пути, которые строит обход). Компонента
+    может быть шаблоном glob ("*", "?", "[...]"), например
+    "/srv/tenants/tenant-?/cache". Исключение, которое начинается с "**"
+    и '/', - относительный путь на любой глубине (примеры - в README):
+    его компоненты лежат под отдельным корнем m_idxAnyDepth, который
+    входит в состояние каждой директории. Регистр букв учитывается.
+
+    Обход хранит для каждой директории состояние - узлы дерева, которым
+    соответствует её путь, - и проверяет поддиректорию переходом по
+    одной компоненте, поэтому проверка не зависит от числа исключений,
+    а исключённая директория не открывается.
+*/
+class ExclusionTrie
+{
+    static constexpr uint32_t kNoNode = UINT32_MAX;
+
+    struct Node
+    {
+        std::map<std::string, uint32_t, std::less<>> children;
+        std::vector<std::pair<std::string, uint32_t>> globChildren;
+        bool isExcluded = false;
+    };
+
+    std::vector<Node> m_nodes;
+    uint32_t m_idxAnyDepth = kNoNode;
+
+    uint32_t addChild(uint32_t idxNode, const std::string& name)
+    {
+        if (FileMask::isGlob(name))
+        {
+            for (const auto& child: m_nodes[idxNode].globChildren)
+            {
+                if (child.first == name)
+                {   return child.second;    }
+            }
+            m_nodes[idxNode].globChildren.emplace_back(name, static_cast<uint32_t>(m_nodes.size()));
+        }
+        else
+        {
+            auto itChild = m_nodes[idxNode].children.find(name);
+            if (itChild != m_nodes[idxNode].children.end())
+            {   return itChild->second; }
+            m_nodes[idxNode].children.emplace(name, static_cast<uint32_t>(m_nodes.size()));
+        }
+        m_nodes.emplace_back();
+        return static_cast<uint32_t>(m_nodes.size() - 1);
+    }
+
+public:
+    using State = std::vector<uint32_t>;
+
+    ExclusionTrie()
+        : m_nodes(1)
+    {}
+
+    explicit ExclusionTrie(const std::vector<std::string>& exclusions)
+        : m_nodes(1)
+    {
+        for (const auto& exclusion: exclusions)
+        {
+            if (exclusion.compare(0, 3, "**/") == 0)
+            {
+                addAnyDepth(exclusion);
+                continue;
+            }
+
+            uint32_t idxNode = 0;
+            for (const auto& component: canonicalize(exclusion))
+            {
+                const std::string name = component.string();
+                if ((name != "/") && (name != "."))
+                {   idxNode = addChild(idxNode, name);  }
+            }
+            m_nodes[idxNode].isExcluded = true;
+        }
+    }
+
+    /*!
+        Функция void addAnyDepth(const std::string& exclusion)
+        - добавление компонент исключения после "**" и '/' под корень
+        m_idxAnyDepth; исключение std::invalid_argument, если компонент
+        нет или среди них есть "**" или ".."
+    */
+    void addAnyDepth(const std::string& exclusion)
+    {
+        std::vector<std::string> names;
+        for (const auto& component: path(exclusion.substr(3)))
+        {
+            const std::string name = component.string();
+            if ((name != "/") && (name != "."))
+            {   names.push_back(name);  }
+        }
+        const bool isValid = !names.empty() && std::none_of(names.begin(), names.end(), [](const std::string& name) {
+            return (name == "**") || (name == "..");
+        });
+        if (!isValid)
+        {   throw std::invalid_argument("Unsupported --unsc pattern: " + exclusion + " (\"**\" may only start it, \"..\" is not allowed)");  }
+
+        if (m_idxAnyDepth == kNoNode)
+        {
+            m_idxAnyDepth = static_cast<uint32_t>(m_nodes.size());
+            m_nodes.emplace_back();
+        }
+        uint32_t idxNode = m_idxAnyDepth;
+        for (const auto& name: names)
+        {   idxNode = addChild(idxNode, name);  }
+        m_nodes[idxNode].isExcluded = true;
+    }
+
+    /*!
+        Функция path canonicalize(const path& path_)
+        - абсолютный лексически нормализованный путь без завершающего '/'
+    */
+    static path canonicalize(const path& path_)
+    {
+        path result = absolute(path_).lexically_normal();
+        while ((result.filename() == ".") && result.has_parent_path())
+        {   result = result.parent_path();  }
+        return result;
+    }
+
+    /*!
+        Функция bool next(const State& state, std::string_view name, State& nextState)
+        - переход из состояния директории в её поддиректорию name;
+        true - поддиректория исключена
+    */
+    bool next(const State& state, std::string_view name, State& nextState) const
+    {
+        nextState.clear();
+        for (const uint32_t idxNode: state)
+        {
+            const Node& node = m_nodes[idxNode];
+            auto itChild = node.children.find(name);
+            if (itChild != node.children.end())
+            {   nextState.push_back(itChild->second);   }
+            for (const auto& child: node.globChildren)
+            {
+                if (FileMask::matchGlob(child.first, name, false))
+                {   nextState.push_back(child.second);  }
+            }
+        }
+        if (m_idxAnyDepth != kNoNode)
+        {   nextState.push_back(m_idxAnyDepth); }
+        if (nextState.size() > 1)
+        {
+            std::sort(nextState.begin(), nextState.end());
+            nextState.erase(std::unique(nextState.begin(), nextState.end()), nextState.end());
+        }
+
+        for (const uint32_t idxNode: nextState)
+        {
+            if (m_nodes[idxNode].isExcluded)
+            {   return true;    }
+        }
+        return false;
+    }
+
+    /*!
+        Функция bool start(const path& root, State& state)
+        - состояние директории root (канонический путь);
+        true - root или одна из её родительских директорий исключена
+    */
+    bool start(const path& root, State& state) const
+    {
+        state.assign(1, 0);
+        if (m_idxAnyDepth != kNoNode)
+        {   state.push_back(m_idxAnyDepth); }
+        if (m_nodes.front().isExcluded)
+        {   return true;    }
+
+        State nextState;
+        for (const auto& component: root)
+        {
+            const std::string name = component.string();
+            if ((name == "/") || (name == "."))
+            {   continue;   }
+            if (next(state, name, nextState))
+            {   return true;    }
+            state.swap(nextState);
+        }
+        return false;
+    }
+};
+
+
+/*!
+    Класс WorkStealingQueue - очередь заданий одного потока.
+    Владелец берёт задания с конца (LIFO), остальные потоки "крадут" с начала.
+*/
+template <typename Task>
+class WorkStealingQueue
+{
+    std::deque<Task> m_tasks;
+    std::mutex m_mutex;
+
+public:
+    void push(Task task)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+    }
+
+    bool pop(Task& task)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_tasks.empty())
+        {   return false;   }
+        task = std::move(m_tasks.back());
+        m_tasks.pop_back();
+        return true;
+    }
+
+    bool steal(Task& task)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_tasks.empty())
+        {   return false;   }
+        task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+        return true;
+    }
+};
+
+/*!
+    Класс ParallelWalker - многопоточный обход дерева директорий.
+
+    Каждая директория - отдельное задание. Элементы директории
+    собираются в DirListing (локально для потока) и сразу после её
+    просмотра добавляются в fileIndex, поэтому дерево обхода целиком в
+    памяти не хранится. Файлы одной директории идут в индексе подряд;
+    после завершения всех потоков они переставляются (orderFiles()) в
+    тот порядок, в котором их выдал бы последовательный рекурсивный обход.
+    Обработчик директорий (если задан) вызывается потоками обхода для
+    каждой директории перед её просмотром. Директория, которую не удалось
+    открыть или прочитать (нет прав, удалена во время обхода), пропускается
+    с сообщением в stderr; ошибкой обход прерывает только корень
+    сканирования. Поток без заданий спит на
+    условной переменной, пока не появятся новые поддиректории или обход
+    не закончится, и не занимает процессор, пока другие потоки читают
+    большие или медленные (NFS) директории.
+*/
+class ParallelWalker
+{
+public:
+    /// Обработчик директории dirPath уровня level (1 - корень обхода)
+    using DirHandler = std::function<void(const path& dirPath, size_t level)>;
+
+private:
+    /// Поддиректория, которую нужно обойти
+    struct SubDir
+    {
+        uint32_t nameOffset = 0;
+        uint32_t nameLength = 0;
+        uint32_t cntFilesBefore = 0;    // подходящих файлов директории перед ней
+        ExclusionTrie::State excludeState;
+    };
+
+    /// Подходящие файлы и поддиректории одной директории; имена - в names
+    struct DirListing
+    {
+        std::string names;
+        std::vector<std::pair<uint32_t, uint32_t>> fileNames;   // смещение и длина имени
+        std::vector<FileStat> fileStats;
+        std::vector<SubDir> subDirs;
+
+        uint32_t addName(const char* name)
+        {
+            const auto offset = static_cast<uint32_t>(names.size());
+            names.append(name);
+            return offset;
+        }
+    };
+
+    struct DirTask
+    {
+        path dirPath;
+        size_t depthScan = 0;
+        uint32_t parentDir = FileIndex::kNoDir;
+        uint32_t ordinal = 0;           // номер среди поддиректорий родителя
+        uint32_t cntFilesBefore = 0;
+        ExclusionTrie::State excludeState;
+    };
+
+    /// Место директории в порядке последовательного обхода и её файлы в fileIndex
+    struct DirOrder
+    {
+        uint32_t parentDir = FileIndex::kNoDir;
+        uint32_t ordinal = 0;
+        uint32_t cntFilesBefore = 0;
+        uint32_t firstFile = 0;
+        uint32_t cntFiles = 0;
+    };
+
+    const Settings& m_options;
+    const ExclusionTrie& m_exclusions;
+    const FileMask m_fileMask;
+
+    std::vector<std::unique_ptr<WorkStealingQueue<DirTask>>> m_queues;
+    std::atomic<size_t> m_cntPending{0};    // заданий в очередях и в работе
+    std::atomic<size_t> m_cntQueued{0};     // заданий в очередях
+    std::atomic<size_t> m_cntIdle{0};       // потоков, ждущих заданий
+    std::atomic<bool> m_isAborted{false};
+    std::mutex m_idleMutex;
+    std::condition_variable m_cvIdle;
+    std::exception_ptr m_error;
+    std::mutex m_errorMutex;
+
+    DirHandler m_onDir;
+    bool m_isScanRoot = true;
+
+    std::mutex m_indexMutex;            // fileIndex и m_dirOrders
+    uint32_t m_firstDir = 0;
+    std::vector<DirOrder> m_dirOrders;  // с m_firstDir
+
+    /// Добавление регулярного файла name со свойствами fileStat, если он
+    /// не меньше минимального размера (имя уже проверено по маске)
+    void addFile(DirListing& listing, const char* name, const struct stat& fileStat)
+    {
+        ///    2 а). Исколючение из поиска файлов, которые
+        ///    меньше минимального рамера
+        if (static_cast<uint64_t>(fileStat.st_size) >= m_options.getMinimalSizeOfFile())
+        {
+            listing.fileNames.emplace_back(listing.addName(name), static_cast<uint32_t>(std::strlen(name)));
+            listing.fileStats.push_back(FileStat::fromStat(fileStat));
+        }
+    }
+
+    /// Запоминание поддиректории name, если её нужно обойти
+    void addDir(const DirTask& task, DirListing& listing, const char* name)
+    {
+        if (task.depthScan + 1 >= m_options.getDepthScan())
+        {   return; }
+
+        ExclusionTrie::State excludeState;
+        if (m_exclusions.next(task.excludeState, name, excludeState))
+        {   return; }
+
+        const uint32_t nameOffset = listing.addName(name);
+        listing.subDirs.push_back({nameOffset, static_cast<uint32_t>(std::strlen(name))
+                                   , static_cast<uint32_t>(listing.fileNames.size()), std::move(excludeState)});
+    }
+
+    /*!
+        Функция void addListing(const DirTask& task, DirListing& listing, WorkStealingQueue<DirTask>& ownQueue)
+        - добавление просмотренной директории и её файлов в fileIndex
+        и постановка в очередь её поддиректорий
+    */
+    void addListing(const DirTask& task, DirListing& listing, WorkStealingQueue<DirTask>& ownQueue)
+    {
+        const std::string_view names(listing.names);
+        uint32_t dir = FileIndex::kNoDir;
+        {
+            std::lock_guard<std::mutex> lock(m_indexMutex);
+            dir = fileIndex.addDir(task.parentDir, (task.parentDir == FileIndex::kNoDir) ? task.dirPath.string()
+                                                                                          : task.dirPath.filename().string());
+            const auto firstFile = static_cast<uint32_t>(fileIndex.size());
+            for (size_t i = 0; i < listing.fileNames.size(); ++i)
+            {   fileIndex.addFile(dir, names.substr(listing.fileNames[i].first, listing.fileNames[i].second), listing.fileStats[i]);  }
+
+            m_dirOrders.resize(dir - m_firstDir + 1);
+            m_dirOrders[dir - m_firstDir] = {task.parentDir, task.ordinal, task.cntFilesBefore
+                                             , firstFile, static_cast<uint32_t>(listing.fileNames.size())};
+        }
+
+        for (size_t i = 0; i < listing.subDirs.size(); ++i)
+        {
+            auto& subDir = listing.subDirs[i];
+            ++m_cntPending;
+            ownQueue.push({task.dirPath / std::string(names.substr(subDir.nameOffset, subDir.nameLength))
+                           , task.depthScan + 1, dir, static_cast<uint32_t>(i), subDir.cntFilesBefore
+                           , std::move(subDir.excludeState)});
+            ++m_cntQueued;
+        }
+        if (!listing.subDirs.empty() && (m_cntIdle.load() != 0))
+        {   wakeIdle();  }
+    }
+
+    /// Пробуждение потоков, ждущих заданий (новые задания или конец обхода)
+    void wakeIdle()
+    {
+        {   std::lock_guard<std::mutex> lock(m_idleMutex); }
+        m_cvIdle.notify_all();
+    }
+
+    /*!
+        Функция void orderFiles(uint32_t rootDir)
+        - перестановка файлов обхода rootDir в fileIndex в порядок
+        последовательного рекурсивного обхода: файлы директории по порядку,
+        а перед каждой поддиректорией - все файлы её поддерева
+    */
+    void orderFiles(uint32_t rootDir)
+    {
+        // Поддиректории каждой директории подряд, в порядке просмотра
+        std::vector<uint32_t> children;
+        for (uint32_t dir = m_firstDir; dir < m_firstDir + m_dirOrders.size(); ++dir)
+        {
+            if (dir != rootDir)
+            {   children.push_back(dir);    }
+        }
+        std::sort(children.begin(), children.end(), [this](uint32_t lhs, uint32_t rhs) {
+            const DirOrder& lhsOrder = m_dirOrders[lhs - m_firstDir];
+            const DirOrder& rhsOrder = m_dirOrders[rhs - m_firstDir];
+            return (lhsOrder.parentDir < rhsOrder.parentDir)
+                    || ((lhsOrder.parentDir == rhsOrder.parentDir) && (lhsOrder.ordinal < rhsOrder.ordinal));
+        });
+        std::vector<uint32_t> firstChildren(m_dirOrders.size() + 1, 0);
+        for (const uint32_t child: children)
+        {   ++firstChildren[m_dirOrders[child - m_firstDir].parentDir - m_firstDir + 1];   }
+        for (size_t i = 1; i < firstChildren.size(); ++i)
+        {   firstChildren[i] += firstChildren[i - 1];   }
+
+        const uint32_t firstFile = m_dirOrders[rootDir - m_firstDir].firstFile;
+        std::vector<uint32_t> order;
+        order.reserve(fileIndex.size());
+        for (uint32_t idxFile = 0; idxFile < firstFile; ++idxFile)
+        {   order.push_back(idxFile);   }
+
+        // Обход в глубину: директория, следующая поддиректория, число выданных файлов
+        struct Frame
+        {
+            uint32_t dir;
+            uint32_t idxChild;
+            uint32_t cntFilesDone;
+        };
+        std::vector<Frame> stack{{rootDir, firstChildren[rootDir - m_firstDir], 0}};
+        while (!stack.empty())
+        {
+            Frame& frame = stack.back();
+            const DirOrder& dirOrder = m_dirOrders[frame.dir - m_firstDir];
+            const bool hasChild = (frame.idxChild < firstChildren[frame.dir - m_firstDir + 1]);
+            const uint32_t cntFilesBefore = hasChild ? m_dirOrders[children[frame.idxChild] - m_firstDir].cntFilesBefore
+                                                     : dirOrder.cntFiles;
+            for (; frame.cntFilesDone < cntFilesBefore; ++frame.cntFilesDone)
+            {   order.push_back(dirOrder.firstFile + frame.cntFilesDone);    }
+
+            if (!hasChild)
+            {
+                stack.pop_back();
+                continue;
+            }
+            const uint32_t child = children[frame.idxChild++];
+            stack.push_back({child, firstChildren[child - m_firstDir], 0});
+        }
+
+        fileIndex.permuteFiles(order);
+    }
+
+    /*!
+        Функция void skipDir(const DirTask& task, const char* what, const boost::system::error_code& error)
+        - ошибка просмотра директории: корень сканирования - исключение,
+        остальные директории пропускаются с сообщением
+    */
+    void skipDir(const DirTask& task, const char* what, const boost::system::error_code& error)
+    {
+        const filesystem_error except(what, task.dirPath, error);
+        if (m_isScanRoot && (task.parentDir == FileIndex::kNoDir))
+        {   throw except;   }
+
+        std::lock_guard<std::mutex> lock(m_errorMutex);
+        std::cerr << except.what() << '\n';
+    }
+
+#ifdef BAYAN_HAVE_GETDENTS
+    struct LinuxDirent64
+    {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+    };
+
+    /*!
+        Обход директории системными вызовами getdents64() и fstatat()
+        относительно её дескриптора. Тип элемента берётся из d_type:
+        директории и специальные файлы не опрашиваются, stat() делается
+        только для регулярных файлов и ссылок (DT_UNKNOWN - для всех)
+    */
+    void processDir(const DirTask& task, WorkStealingQueue<DirTask>& ownQueue)
+    {
+        const int dirHandle = ::open(task.dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirHandle == -1)
+        {
+            skipDir(task, "open directory", boost::system::error_code(errno, boost::system::system_category()));
+            return;
+        }
+
+        DirListing listing;
+        int error = 0;
+        try
+        {
+            error = readDir(task, dirHandle, listing);
+        }
+        catch (...)
+        {
+            ::close(dirHandle);
+            throw;
+        }
+        ::close(dirHandle);
+        if (error != 0)
+        {
+            skipDir(task, "read directory", boost::system::error_code(error, boost::system::system_category()));
+            return;
+        }
+        addListing(task, listing, ownQueue);
+    }
+
+    /// Просмотр директории; errno ошибки чтения или 0
+    int readDir(const DirTask& task, int dirHandle, DirListing& listing)
+    {
+        uint64_t cntEntries = 0;
+        uint64_t bytesEntries = 0;
+        uint64_t cntStats = 0;
+
+        alignas(LinuxDirent64) char buffer[64 * 1024];
+        for (;;)
+        {
+            const long cntBytes = ::syscall(SYS_getdents64, dirHandle, buffer, sizeof(buffer));
+            if ((cntBytes < 0) && (errno == EINTR))
+            {   continue;   }
+            if (cntBytes < 0)
+            {   return errno;   }
+            if (cntBytes == 0)
+            {   break;  }
+            bytesEntries += static_cast<uint64_t>(cntBytes);
+
+            for (long pos = 0; pos < cntBytes;)
+            {
+                const auto* dirEntry = reinterpret_cast<const LinuxDirent64*>(buffer + pos);
+                pos += dirEntry->d_reclen;
+
+                const char* name = dirEntry->d_name;
+                if ((std::strcmp(name, ".") == 0) || (std::strcmp(name, "..") == 0))
+                {   continue;   }
+                ++cntEntries;
+
+                if (dirEntry->d_type == DT_DIR)
+                {
+                    addDir(task, listing, name);
+                    continue;
+                }
+                if ((dirEntry->d_type != DT_REG) && (dirEntry->d_type != DT_LNK) && (dirEntry->d_type != DT_UNKNOWN))
+                {   continue;   }
+
+                ///    2 а). Исколючение из поиска файлов, имя которых
+                ///    не удовлетворяет маске (до stat(), если тип известен)
+                const bool isMatched = m_fileMask.match(name);
+                if (!isMatched && (dirEntry->d_type == DT_REG))
+                {   continue;   }
+
+                struct stat fileStat{};
+                ++cntStats;
+                if (::fstatat(dirHandle, name, &fileStat, 0) != 0)
+                {   continue;   }
+
+                if (S_ISREG(fileStat.st_mode))
+                {
+                    if (isMatched)
+                    {   addFile(listing, name, fileStat);   }
+                }
+                else if (S_ISDIR(fileStat.st_mode))
+                {   addDir(task, listing, name);    }
+            }
+        }
+
+        ioStats.addDir(cntEntries, bytesEntries, cntStats);
+        return 0;
+    }
+#else
+    void processDir(const DirTask& task, WorkStealingQueue<DirTask>& ownQueue)
+    {
+        uint64_t cntEntries = 0;
+        uint64_t bytesEntries = 0;
+
+        DirListing listing;
+        boost::system::error_code error;
+        directory_iterator itrBeg(task.dirPath, error);
+        directory_iterator itrEnd;
+        for (; !error && (itrBeg != itrEnd); itrBeg.increment(error))
+        {
+            path iterPath = itrBeg->path();
+            ++cntEntries;
+            bytesEntries += iterPath.filename().size();
+
+            // Один stat() на элемент: тип, размер и (st_dev, st_ino)
+            struct stat fileStat{};
+            if (::stat(iterPath.c_str(), &fileStat) != 0)
+            {   continue;   }
+
+            const std::string name = iterPath.filename().string();
+            if (S_ISREG(fileStat.st_mode))
+            {
+                if (m_fileMask.match(name))
+                {   addFile(listing, name.c_str(), fileStat);   }
+            }
+            else if (S_ISDIR(fileStat.st_mode))
+            {   addDir(task, listing, name.c_str());    }
+        }
+
+        ioStats.addDir(cntEntries, bytesEntries, cntEntries);
+        if (error)
+        {
+            skipDir(task, "read directory", error);
+            return;
+        }
+        addListing(task, listing, ownQueue);
+    }
+#endif
+
+    bool takeTask(size_t idxThread, DirTask& task)
+    {
+        bool isTaken = m_queues[idxThread]->pop(task);
+        for (size_t i = 1; !isTaken && (i < m_queues.size()); ++i)
+        {   isTaken = m_queues[(idxThread + i) % m_queues.size()]->steal(task);   }
+        if (isTaken)
+        {   --m_cntQueued;  }
+        return isTaken;
+    }
+
+    void worker(size_t idxThread)
+    {
+        while ((m_cntPending.load() != 0) && (!m_isAborted.load()))
+        {
+            DirTask task;
+            if (!takeTask(idxThread, task))
+            {
+                // Заданий нет, но другие потоки ещё просматривают директории
+                std::unique_lock<std::mutex> lock(m_idleMutex);
+                ++m_cntIdle;
+                m_cvIdle.wait(lock, [this]() {
+                    return (m_cntQueued.load() != 0) || (m_cntPending.load() == 0) || m_isAborted.load();
+                });
+                --m_cntIdle;
+                continue;
+            }
+
+            try
+            {
+                if (m_onDir)
+                {   m_onDir(task.dirPath, task.depthScan);  }
+                processDir(task, *m_queues[idxThread]);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(m_errorMutex);
+                if (!m_error)
+                {   m_error = std::current_exception();   }
+                m_isAborted = true;
+            }
+            if ((--m_cntPending == 0) || m_isAborted.load())
+            {   wakeIdle(); }
+        }
+    }
+
+public:
+    ParallelWalker(const Settings& options, const ExclusionTrie& exclusions)
+        : m_options(options)
+        , m_exclusions(exclusions)
+        , m_fileMask(options.getMasksForScan(), options.isMaskRegex())
+    {}
+
+    /*!
+        Функция void walk(const path& root, DirHandler onDir, bool isScanRoot)
+        - обход директории root (канонический путь) с глубиной getDepthScan()
+        и добавление найденных файлов в fileIndex. Исключённая
+        директория root не обходится. onDir (если задан) должен быть
+        потокобезопасным; его исключение прерывает обход. Ошибка просмотра
+        root - исключение filesystem_error, если root - корень сканирования
+        (isScanRoot), иначе root пропускается, как любая поддиректория
+    */
+    void walk(const path& root, DirHandler onDir = nullptr, bool isScanRoot = true)
+    {
+        // Корень сканирования - первый уровень. Директория уровня N
+        // просматривается, только если N < getDepthScan()
+        if (1 >= m_options.getDepthScan())
+        {   return;    }
+
+        const size_t cntThreads = getCntThreads(m_options);
+
+        m_queues.clear();
+        for (size_t i = 0; i < cntThreads; ++i)
+        {   m_queues.push_back(std::make_unique<WorkStealingQueue<DirTask>>());  }
+
+        m_error = nullptr;
+        m_isAborted = false;
+        m_cntQueued = 0;
+        m_onDir = std::move(onDir);
+        m_isScanRoot = isScanRoot;
+
+        DirTask rootTask{root, 1, FileIndex::kNoDir, 0, 0, {}};
+        if (m_exclusions.start(root, rootTask.excludeState))
+        {   return; }
+
+        m_firstDir = static_cast<uint32_t>(fileIndex.getCntDirs());
+        m_dirOrders.clear();
+        m_cntPending = 1;
+        m_queues[0]->push(std::move(rootTask));
+        m_cntQueued = 1;
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < cntThreads; ++i)
+        {   threads.emplace_back(&ParallelWalker::worker, this, i);   }
+
+        worker(0);
+
+        for (auto& thread : threads)
+        {   thread.join();  }
+
+        if (m_error)
+        {   std::rethrow_exception(m_error);    }
+
+        orderFiles(m_firstDir);
+        m_dirOrders = std::vector<DirOrder>();
+    }
+};
+
+
+/*!
+    Функция void outputFiles(...)
+    - поиск файлов в директории currGlobPath, кроме исключений exclusions,
+    и добавление их в fileIndex; onDir вызывается для каждой директории
+    перед её просмотром
+*/
+void outputFiles(Settings& options, const path& currGlobPath, const ExclusionTrie& exclusions
+                 , const ParallelWalker::DirHandler& onDir = nullptr)
+{
+    ParallelWalker walker(options, exclusions);
+    walker.walk(currGlobPath, onDir);
+}
+
+
+
+/*!
+    Алгоритмы хэширования блоков.
+
+    Каждый алгоритм - структура с типом digest_type (двоичный хэш
+    фиксированного размера) и статической функцией hash(). Алгоритм
+    выбирается по имени один раз при создании DoublesFinder, дальше
+    сравнение работает с конкретным типом без ветвлений.
+*/
+struct Md5Hasher
+{
+    using digest_type = std::array<unsigned char, sizeof(md5::digest_type)>;
+
+    static void hash(const char* readBlock, uint64_t blockSize, digest_type& result)
+    {
+        md5::digest_type digest;
+        md5 currHash;
+        currHash.process_bytes(readBlock, blockSize);
+        currHash.get_digest(digest);
+        std::memcpy(result.data(), &digest, result.size());
+    }
+};
+
+struct Sha1Hasher
+{
+    using digest_type = std::array<unsigned char, sizeof(sha1::digest_type)>;
+
+    static void hash(const char* readBlock, uint64_t blockSize, digest_type& result)
+    {
+        sha1::digest_type digest;
+        sha1 currHash;
+        currHash.process_bytes(readBlock, blockSize);
+        currHash.get_digest(digest);
+        std::memcpy(result.data(), &digest, result.size());
+    }
+};
+
+/// CRC-32C (Castagnoli): программный расчёт таблицей boost::crc
+struct Crc32Hasher
+{
+    using digest_type = std::array<unsigned char, sizeof(uint32_t)>;
+    using crc_type = boost::crc_optimal<32, 0x1EDC6F41, 0xFFFFFFFF, 0xFFFFFFFF, true, true>;
+
+    static void hash(const char* readBlock, uint64_t blockSize, digest_type& result)
+    {
+        crc_type crc;
+        crc.process_bytes(readBlock, blockSize);
+        const uint32_t checksum = crc.checksum();
+        std::memcpy(result.data(), &checksum, result.size());
+    }
+};
+
+#if defined(__x86_64__)
+/// CRC-32C инструкцией crc32 из SSE4.2; результат совпадает с Crc32Hasher
+struct Crc32HwHasher
+{
+    using digest_type = Crc32Hasher::digest_type;
+
+    __attribute__((target("sse4.2")))
+    static void hash(const char* readBlock, uint64_t blockSize, digest_type& result)
+    {
+        uint64_t crc = 0xFFFFFFFF;
+        for (; blockSize >= sizeof(uint64_t); blockSize -= sizeof(uint64_t), readBlock += sizeof(uint64_t))
+        {
+            uint64_t word;
+            std::memcpy(&word, readBlock, sizeof(word));
+            crc = _mm_crc32_u64(crc, word);
+        }
+        for (; blockSize != 0; --blockSize, ++readBlock)
+        {   crc = _mm_crc32_u8(static_cast<uint32_t>(crc), static_cast<uint8_t>(*readBlock));   }
+
+        const uint32_t checksum = static_cast<uint32_t>(crc) ^ 0xFFFFFFFF;
+        std::memcpy(result.data(), &checksum, result.size());
+    }
+};
+#endif
+
+#ifdef BAYAN_WITH_XXHASH
+struct Xxh3Hasher
+{
+    using digest_type = std::array<unsigned char, sizeof(XXH64_hash_t)>;
+
+    static void hash(const char* readBlock, uint64_t blockSize, digest_type& result)
+    {
+        const XXH64_hash_t digest = XXH3_64bits(readBlock, blockSize);
+        std::memcpy(result.data(), &digest, result.size());
+    }
+};
+
+struct Xxh128Hasher
+{
+    using digest_type = std::array<unsigned char, sizeof(XXH128_hash_t)>;
+
+    static void hash(const char* readBlock, uint64_t blockSize, digest_type& result)
+    {
+        const XXH128_hash_t digest = XXH3_128bits(readBlock, blockSize);
+        std::memcpy(result.data(), &digest, result.size());
+    }
+};
+#endif
+
+#ifdef BAYAN_WITH_BLAKE3
+struct Blake3Hasher
+{
+    using digest_type = std::array<unsigned char, BLAKE3_OUT_LEN>;
+
+    static void hash(const char* readBlock, uint64_t blockSize, digest_type& result)
+    {
+        blake3_hasher currHash;
+        blake3_hasher_init(&currHash);
+        blake3_hasher_update(&currHash, readBlock, blockSize);
+        blake3_hasher_finalize(&currHash, result.data(), result.size());
+    }
+};
+#endif
+
+/// Сравнение блоков без хэширования (--cmp=bytes): ключ - сам блок
+struct BytesCompare
+{
+    using digest_type = std::array<unsigned char, 0>;
+};
+
+/*!
+    Ф-ия взятия хэша блока памяти
+*/
+template <typename Hasher>
+typename Hasher::digest_type getHash(const char* readBlock, const uint64_t blockSize)
+{
+    typename Hasher::digest_type result;
+    Hasher::hash(readBlock, blockSize, result);
+    return result;
+}
+
+
+/*!
+    Структура DataFile - хранилище св-в файла
+
+    Файл открывается не в конструкторе, а при первом чтении через
+    BlockSource, и может быть закрыт между раундами сравнения.
+    fileStat - свойства файла, полученные при обходе (без повторного stat()).
+    offset - позиция следующего непрочитанного блока.
+    Блоки растут геометрически: первый - blockSize байт, каждый следующий
+    вдвое больше, но не больше maxBlockSize (0 - размер блока постоянный).
+    fd, handle и region - состояние выбранного способа чтения
+    (--io=stream, pread и mmap соответственно).
+    digests - ключи первых блоков файла подряд для кэша --cache.
+    isChanged - файл изменился после обхода (checkUnchanged()) и не сравнивается.
+    holes - дыры разреженного файла: участки без данных на устройстве,
+    которые читаются как нули.
+*/
+struct DataFile
+{
+    DataFile(const std::string& pathToFile_, const FileStat& fileStat_, uint32_t blockSize_, uint32_t maxBlockSize_ = 0)
+        : pathToFile(pathToFile_)
+        , fileStat(fileStat_)
+        , fileSize(fileStat_.size)
+        , blockSize(blockSize_)
+        , maxBlockSize(std::max(blockSize_, maxBlockSize_))
+    {}
+
+    explicit DataFile(const std::string& pathToFile_, uint32_t blockSize_, uint32_t maxBlockSize_ = 0)
+        : DataFile(pathToFile_, FileStat::load(pathToFile_), blockSize_, maxBlockSize_)
+    {}
+
+    ~DataFile()
+    {
+//        std::cout << "~DataFile()!\n";
+
+        if (fd.is_open())
+        {   fd.close(); }
+        if (handle != -1)
+        {   ::close(handle);    }
+    }
+
+    std::string pathToFile;
+    FileStat fileStat;
+    uint64_t fileSize;
+    std::ifstream fd;
+    int handle = -1;
+    std::unique_ptr<boost::interprocess::mapped_region> region;
+    uint64_t regionOffset = 0;
+    uint64_t offset = 0;
+
+    uint32_t blockSize;
+    uint32_t maxBlockSize;
+
+    std::string digests;
+    std::vector<std::pair<uint64_t, uint64_t>> holes;   // [begin, end), по возрастанию
+
+    uint64_t cntReads = 0;
+    uint64_t bytesRead = 0;
+
+    bool isInOpenFiles = false;
+    std::list<std::pair<DataFile*, const std::function<void(DataFile&)>*>>::iterator itOpenFiles;
+
+    bool isChanged = false;
+
+    /*!
+        Функция bool checkUnchanged(int handle)
+        - проверка при открытии, что файл не изменился после обхода:
+        inode, размер и времена изменения те же, что в fileStat (по ним же
+        найдены ключи в кэше). handle - дескриптор открытого файла или -1,
+        тогда проверяется файл по пути. Ошибку самой проверки покажет чтение
+    */
+    bool checkUnchanged(int handle)
+    {
+        struct stat current{};
+        const int result = (handle != -1) ? ::fstat(handle, &current) : ::stat(pathToFile.c_str(), &current);
+        if (result != 0)
+        {   return true;    }
+
+        const FileStat currentStat = FileStat::fromStat(current);
+        isChanged = (currentStat.dev != fileStat.dev) || (currentStat.ino != fileStat.ino)
+                || (currentStat.size != fileStat.size)
+                || (currentStat.mtimeNs != fileStat.mtimeNs) || (currentStat.ctimeNs != fileStat.ctimeNs);
+        return !isChanged;
+    }
+
+    /*!
+        Функция uint64_t getBlockSize(uint64_t offsetBlock, uint64_t* idxBlock)
+        - размер (без учёта конца файла) и номер блока, начинающегося с offsetBlock
+    */
+    uint64_t getBlockSize(uint64_t offsetBlock, uint64_t* idxBlock = nullptr) const
+    {
+        uint64_t size = blockSize;
+        uint64_t begin = 0;
+        uint64_t index = 0;
+        while ((size < maxBlockSize) && (begin + size <= offsetBlock))
+        {
+            begin += size;
+            size = std::min<uint64_t>(size * 2, maxBlockSize);
+            ++index;
+        }
+        if (size == maxBlockSize)
+        {   index += (offsetBlock - begin) / size;  }
+
+        if (idxBlock != nullptr)
+        {   *idxBlock = index;  }
+        return size;
+    }
+
+    /*!
+        Функция bool isHole(uint64_t offsetBlock, uint64_t size)
+        - блок size байт с позиции offsetBlock целиком лежит в дыре
+    */
+    bool isHole(uint64_t offsetBlock, uint64_t size) const
+    {
+        auto itHole = std::upper_bound(holes.begin(), holes.end(), std::make_pair(offsetBlock, UINT64_MAX));
+        if (itHole == holes.begin())
+        {   return false;   }
+        --itHole;
+        return (offsetBlock + size <= itHole->second);
+    }
+
+    /*!
+        Функция uint64_t getBlockOffset(uint64_t position)
+        - начало блока, содержащего байт с позиции position
+    */
+    uint64_t getBlockOffset(uint64_t position) const
+    {
+        uint64_t size = blockSize;
+        uint64_t begin = 0;
+        while ((size < maxBlockSize) && (begin + size <= position))
+        {
+            begin += size;
+            size = std::min<uint64_t>(size * 2, maxBlockSize);
+        }
+        if (size == maxBlockSize)
+        {   begin += (position - begin) / size * size;  }
+        return begin;
+    }
+};
+
+
+/*!
+    Ф-ия получения бюджета открытых файлов по умолчанию
+    - половина мягкого лимита RLIMIT_NOFILE
+*/
+inline size_t getDefaultMaxOpenFiles()
+{
+    rlimit limitFiles{};
+    if ((getrlimit(RLIMIT_NOFILE, &limitFiles) != 0) || (limitFiles.rlim_cur == RLIM_INFINITY))
+    {   return 512; }
+
+    return std::max<size_t>(16, static_cast<size_t>(limitFiles.rlim_cur) / 2);
+}
+
+
+/*!
+    Класс DeviceQueues - очереди чтения по блочным устройствам.
+
+    Пакет чтения группы занимает место в очереди каждого устройства, на
+    котором лежат его файлы, от submit() до wait(). С устройства
+    одновременно читается не больше depth пакетов всех потоков сравнения,
+    остальные ждут, поэтому сравнение в несколько потоков не гоняет
+    головки одного диска, а разные диски читаются параллельно. Глубина 0 -
+    по типу устройства: 1 для вращающегося диска, без ограничения для
+    остальных.
+
+    Движок держит места в очередях не больше чем для одного пакета и
+    занимает их по возрастанию номера устройства, поэтому взаимных
+    блокировок нет.
+*/
+class DeviceQueues
+{
+    struct Queue
+    {
+        size_t depth = 0;       // 0 - без ограничения
+        size_t cntActive = 0;
+        std::condition_variable condition;
+    };
+
+    std::mutex m_mutex;
+    std::map<uint64_t, Queue> m_queues;
+
+public:
+    /// Устройство dev - вращающийся диск (по /sys/dev/block/<major>:<minor>)
+    static bool isRotational(uint64_t dev)
+    {
+        const std::string devPath = "/sys/dev/block/" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev));
+        // У раздела нет своей очереди, она у диска - родительской директории
+        for (const std::string& queuePath : {devPath + "/queue/rotational", devPath + "/../queue/rotational"})
+        {
+            std::ifstream file(queuePath);
+            char flag = '0';
+            if (file >> flag)
+            {   return (flag == '1');   }
+        }
+        return false;
+    }
+
+    /*!
+        Класс Slots - места одного пакета в очередях устройств,
+        освобождаются release() или при разрушении
+    */
+    class Slots
+    {
+        DeviceQueues* m_queues = nullptr;
+        std::vector<uint64_t> m_devices;
+
+    public:
+        Slots() = default;
+        Slots(const Slots&) = delete;
+        Slots& operator=(const Slots&) = delete;
+        ~Slots()
+        {   release();  }
+
+        /// Занятие мест на устройствах devices (по возрастанию) с глубиной depth
+        void acquire(DeviceQueues& queues, const std::vector<uint64_t>& devices, size_t depth)
+        {
+            release();
+            m_queues = &queues;
+            for (const uint64_t dev : devices)
+            {
+                queues.acquire(dev, depth);
+                m_devices.push_back(dev);
+            }
+        }
+
+        void release()
+        {
+            for (auto itDev = m_devices.rbegin(); itDev != m_devices.rend(); ++itDev)
+            {   m_queues->release(*itDev);  }
+            m_devices.clear();
+        }
+    };
+
+    void acquire(uint64_t dev, size_t depth)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto itQueue = m_queues.find(dev);
+        if (itQueue == m_queues.end())
+        {
+            itQueue = m_queues.emplace(std::piecewise_construct, std::forward_as_tuple(dev), std::forward_as_tuple()).first;
+            itQueue->second.depth = (depth != 0) ? depth : (isRotational(dev) ? 1 : 0);
+        }
+
+        Queue& queue = itQueue->second;
+        queue.condition.wait(lock, [&queue]() { return (queue.depth == 0) || (queue.cntActive < queue.depth); });
+        ++queue.cntActive;
+    }
+
+    void release(uint64_t dev)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Queue& queue = m_queues.at(dev);
+        --queue.cntActive;
+        queue.condition.notify_one();
+    }
+};
+
+DeviceQueues deviceQueues;
+
+
+/*!
+    Ф-ия получения физического положения начала файла на устройстве
+    (первый экстент по FIEMAP); false, если файловая система его не сообщает.
+    В isSupported (если задан) сбрасывается флаг, когда FIEMAP не
+    поддерживается файловой системой вовсе (EOPNOTSUPP, ENOTTY)
+*/
+inline bool getPhysicalOffset(int handle, uint64_t& physicalOffset, bool* isSupported = nullptr)
+{
+#ifdef BAYAN_HAVE_FIEMAP
+    alignas(fiemap) char request[sizeof(fiemap) + sizeof(fiemap_extent)] = {};
+    auto* extents = reinterpret_cast<fiemap*>(request);
+    extents->fm_start = 0;
+    extents->fm_length = FIEMAP_MAX_OFFSET;
+    extents->fm_extent_count = 1;
+
+    const int result = ::ioctl(handle, FS_IOC_FIEMAP, extents);
+    if ((result != 0) && (isSupported != nullptr))
+    {   *isSupported = (errno != EOPNOTSUPP) && (errno != ENOTTY);   }
+
+    const bool isMapped = (result == 0)
+            && (extents->fm_mapped_extents == 1)
+            && ((extents->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)) == 0);
+    if (isMapped)
+    {   physicalOffset = extents->fm_extents[0].fe_physical;   }
+    return isMapped;
+#else
+    (void)handle;
+    (void)physicalOffset;
+    if (isSupported != nullptr)
+    {   *isSupported = false;   }
+    return false;
+#endif
+}
+
+
+/*!
+    Ф-ия получения дыр файла размера fileSize (SEEK_HOLE/SEEK_DATA):
+    участков [begin, end) без данных на устройстве, которые читаются как
+    нули. У файла без дыр - один вызов lseek()
+*/
+inline std::vector<std::pair<uint64_t, uint64_t>> getHoles(int handle, uint64_t fileSize)
+{
+    std::vector<std::pair<uint64_t, uint64_t>> holes;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    for (uint64_t offset = 0; offset < fileSize;)
+    {
+        const off_t begin = ::lseek(handle, static_cast<off_t>(offset), SEEK_HOLE);
+        if ((begin < 0) || (static_cast<uint64_t>(begin) >= fileSize))
+        {   break;  }
+
+        // Данных после дыры нет (ENXIO) - дыра до конца файла
+        const off_t end = ::lseek(handle, begin, SEEK_DATA);
+        if ((end < 0) && (errno != ENXIO))
+        {   break;  }
+
+        offset = (end < 0) ? fileSize : std::min<uint64_t>(static_cast<uint64_t>(end), fileSize);
+        holes.emplace_back(static_cast<uint64_t>(begin), offset);
+    }
+#else
+    (void)handle;
+    (void)fileSize;
+#endif
+    return holes;
+}
+
+
+/*!
+    Класс AlignedBufferPool - пул буферов блоков, выровненных по kAlignment
+    (требование O_DIRECT). Ёмкость буфера округляется до степени двойки
+    страниц; освобождённые буферы хранятся по ёмкостям и выдаются повторно,
+    поэтому после первых раундов чтение блоков не выделяет память.
+    Пул не потокобезопасен: он принадлежит одному DoublesEngine.
+*/
+class AlignedBufferPool
+{
+    struct FreeDeleter
+    {
+        void operator()(char* buffer) const
+        {   std::free(buffer);  }
+    };
+
+    std::vector<std::unique_ptr<char, FreeDeleter>> m_buffers;
+    std::map<size_t, std::vector<char*>> m_freeBuffers;
+
+public:
+    static constexpr size_t kAlignment = 4096;
+
+    static size_t getCapacity(size_t size)
+    {
+        size_t capacity = kAlignment;
+        while (capacity < size)
+        {   capacity *= 2;  }
+        return capacity;
+    }
+
+    /// Буфер не меньше size байт: из свободных той же ёмкости или новый
+    char* acquire(size_t size)
+    {
+        const size_t capacity = getCapacity(size);
+        auto& freeBuffers = m_freeBuffers[capacity];
+        if (!freeBuffers.empty())
+        {
+            char* buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+            return buffer;
+        }
+
+        void* memory = nullptr;
+        if (::posix_memalign(&memory, kAlignment, capacity) != 0)
+        {   throw std::bad_alloc(); }
+        m_buffers.emplace_back(static_cast<char*>(memory));
+        ioStats.addAllocation(capacity);
+        return m_buffers.back().get();
+    }
+
+    /// Возврат буфера, полученного acquire(size), для повторного использования
+    void release(char* buffer, size_t size)
+    {   m_freeBuffers[getCapacity(size)].push_back(buffer);  }
+
+    size_t getCntBuffers() const
+    {   return m_buffers.size();    }
+};
+
+
+/*!
+    Ф-ия чтения size байт с позиции offset системным вызовом pread()
+    с повтором при прерывании и неполном чтении. Достаточно прочитать
+    minSize байт: при чтении O_DIRECT size выровнен и может выходить
+    за конец файла
+*/
+inline bool preadFull(int handle, char* buffer, uint64_t size, uint64_t offset, uint64_t minSize)
+{
+    uint64_t cntRead = 0;
+    while (cntRead < minSize)
+    {
+        ioStats.addReadCall();
+        const ssize_t result = ::pread(handle, buffer + cntRead, size - cntRead
+                                       , static_cast<off_t>(offset + cntRead));
+        if ((result < 0) && (errno == EINTR))
+        {   continue;   }
+        if (result <= 0)
+        {   return false;   }
+        cntRead += static_cast<uint64_t>(result);
+    }
+    return true;
+}
+
+inline bool preadFull(int handle, char* buffer, uint64_t size, uint64_t offset)
+{   return preadFull(handle, buffer, size, offset, size);  }
+
+
+/*!
+    Структура ReadRequest - запрос асинхронного чтения блока
+*/
+struct ReadRequest
+{
+    int handle = -1;
+    char* buffer = nullptr;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    uint64_t minSize = 0;   // достаточно прочитать (size при O_DIRECT выровнен)
+    bool isDone = false;
+};
+
+/*!
+    Класс AsyncReader - асинхронное чтение пакета блоков.
+
+    submit() запускает чтение всех запросов пакета и сразу возвращает
+    управление, wait() дожидается завершения всего пакета. Одновременно
+    выполняется не больше одного пакета.
+*/
+class AsyncReader
+{
+public:
+    virtual ~AsyncReader() = default;
+
+    virtual void submit(std::vector<ReadRequest>& batch) = 0;
+    virtual void wait() = 0;
+};
+
+
+#ifdef BAYAN_HAVE_IO_URING
+/*!
+    Класс IoUringReader - пакетное чтение через io_uring.
+
+    Работает напрямую через системные вызовы io_uring_setup/io_uring_enter,
+    без liburing. В очереди одновременно не больше queueDepth запросов,
+    остальные досылаются по мере завершения предыдущих.
+    Если io_uring_enter() завершается ошибкой, неотправленные запросы
+    убираются из очереди, а отправленные дожидаются (drain()): после
+    этого весь пакет, кроме прочитанного, читается синхронно. Если
+    дождаться запросов нельзя, бросается исключение - буферы пакета
+    ещё могут быть записаны ядром.
+*/
+class IoUringReader : public AsyncReader
+{
+    int m_ringFd = -1;
+
+    void* m_sqRing = MAP_FAILED;
+    size_t m_sqRingSize = 0;
+    void* m_cqRing = MAP_FAILED;
+    size_t m_cqRingSize = 0;
+    io_uring_sqe* m_sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t m_sqesSize = 0;
+
+    unsigned* m_sqHead = nullptr;
+    unsigned* m_sqTail = nullptr;
+    unsigned* m_sqMask = nullptr;
+    unsigned* m_sqArray = nullptr;
+    unsigned* m_cqHead = nullptr;
+    unsigned* m_cqTail = nullptr;
+    unsigned* m_cqMask = nullptr;
+    io_uring_cqe* m_cqes = nullptr;
+    unsigned m_sqEntries = 0;
+
+    std::vector<ReadRequest>* m_batch = nullptr;
+    size_t m_idxNext = 0;
+    size_t m_cntInFlight = 0;
+    std::vector<uint64_t> m_cntDone;
+    bool m_isDraining = false;
+
+protected:
+    bool setup(unsigned queueDepth)
+    {
+        io_uring_params params{};
+        m_ringFd = static_cast<int>(::syscall(__NR_io_uring_setup, queueDepth, &params));
+        if (m_ringFd < 0)
+        {   return false;   }
+
+        m_sqEntries = params.sq_entries;
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool isSingleMmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+        if (isSingleMmap)
+        {   m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);  }
+
+        m_sqRing = ::mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE
+                          , m_ringFd, IORING_OFF_SQ_RING);
+        if (m_sqRing == MAP_FAILED)
+        {   return false;   }
+
+        if (isSingleMmap)
+        {   m_cqRing = m_sqRing;  }
+        else
+        {
+            m_cqRing = ::mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE
+                              , m_ringFd, IORING_OFF_CQ_RING);
+            if (m_cqRing == MAP_FAILED)
+            {   return false;   }
+        }
+
+        m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE
+                                                   , MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES));
+        if (m_sqes == MAP_FAILED)
+        {   return false;   }
+
+        auto sqRing = static_cast<char*>(m_sqRing);
+        auto cqRing = static_cast<char*>(m_cqRing);
+        m_sqHead  = reinterpret_cast<unsigned*>(sqRing + params.sq_off.head);
+        m_sqTail  = reinterpret_cast<unsigned*>(sqRing + params.sq_off.tail);
+        m_sqMask  = reinterpret_cast<unsigned*>(sqRing + params.sq_off.ring_mask);
+        m_sqArray = reinterpret_cast<unsigned*>(sqRing + params.sq_off.array);
+        m_cqHead  = reinterpret_cast<unsigned*>(cqRing + params.cq_off.head);
+        m_cqTail  = reinterpret_cast<unsigned*>(cqRing + params.cq_off.tail);
+        m_cqMask  = reinterpret_cast<unsigned*>(cqRing + params.cq_off.ring_mask);
+        m_cqes    = reinterpret_cast<io_uring_cqe*>(cqRing + params.cq_off.cqes);
+        return true;
+    }
+
+    void pushRequest(size_t idxRequest)
+    {
+        auto& request = (*m_batch)[idxRequest];
+        const uint64_t cntDone = m_cntDone[idxRequest];
+
+        const unsigned tail = *m_sqTail;
+        const unsigned idxSqe = tail & *m_sqMask;
+        io_uring_sqe& sqe = m_sqes[idxSqe];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = request.handle;
+        sqe.addr = reinterpret_cast<uint64_t>(request.buffer + cntDone);
+        sqe.len = static_cast<uint32_t>(request.size - cntDone);
+        sqe.off = request.offset + cntDone;
+        sqe.user_data = idxRequest;
+        m_sqArray[idxSqe] = idxSqe;
+        ioStats.addReadCall();
+        __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++m_cntInFlight;
+    }
+
+    /// Досылка запросов пакета, пока есть место в очереди
+    unsigned fillQueue()
+    {
+        unsigned cntPushed = 0;
+        while ((m_idxNext < m_batch->size()) && (m_cntInFlight < m_sqEntries))
+        {
+            pushRequest(m_idxNext++);
+            ++cntPushed;
+        }
+        return cntPushed;
+    }
+
+    /*!
+        Функция bool enter(unsigned cntSubmit, unsigned minComplete)
+        - отправка cntSubmit запросов и ожидание minComplete завершений;
+        false, если не все запросы приняты ядром или произошла ошибка
+    */
+    virtual bool enter(unsigned cntSubmit, unsigned minComplete)
+    {
+        const unsigned flags = (minComplete != 0) ? IORING_ENTER_GETEVENTS : 0;
+        long cntSubmitted = 0;
+        while ((cntSubmitted = ::syscall(__NR_io_uring_enter, m_ringFd, cntSubmit, minComplete, flags, nullptr, 0)) < 0)
+        {
+            if (errno != EINTR)
+            {   return false;   }
+        }
+        return (static_cast<unsigned long>(cntSubmitted) >= cntSubmit);
+    }
+
+private:
+    /*!
+        Функция void drain()
+        - снятие пакета после ошибки io_uring_enter(): запросы, не принятые
+        ядром, убираются из очереди, принятые - дожидаются без досылки
+    */
+    void drain()
+    {
+        const unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        m_cntInFlight -= *m_sqTail - head;
+        __atomic_store_n(m_sqTail, head, __ATOMIC_RELEASE);
+
+        m_isDraining = true;
+        while (m_cntInFlight != 0)
+        {
+            const size_t cntInFlight = m_cntInFlight;
+            reapCompletions();
+            if ((m_cntInFlight == cntInFlight) && !enter(0, 1))
+            {
+                m_isDraining = false;
+                throw std::runtime_error(std::string("io_uring: reads in flight are lost: ") + std::strerror(errno));
+            }
+        }
+        m_isDraining = false;
+        m_idxNext = m_batch->size();
+    }
+
+    /// Разбор завершённых запросов; неполное чтение досылается, ошибка
+    /// оставляет запрос невыполненным для синхронного повтора
+    unsigned reapCompletions()
+    {
+        unsigned cntResubmit = 0;
+        unsigned head = *m_cqHead;
+        const unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe& cqe = m_cqes[head & *m_cqMask];
+            const auto idxRequest = static_cast<size_t>(cqe.user_data);
+            auto& request = (*m_batch)[idxRequest];
+            --m_cntInFlight;
+
+            if (cqe.res > 0)
+            {
+                m_cntDone[idxRequest] += static_cast<uint64_t>(cqe.res);
+                if (m_cntDone[idxRequest] >= request.minSize)
+                {   request.isDone = true;  }
+                else if (!m_isDraining)
+                {
+                    pushRequest(idxRequest);
+                    ++cntResubmit;
+                }
+            }
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+        return cntResubmit;
+    }
+
+protected:
+    IoUringReader() = default;
+
+public:
+    ~IoUringReader() override
+    {
+        if (m_sqes != MAP_FAILED)
+        {   ::munmap(m_sqes, m_sqesSize);  }
+        if ((m_cqRing != MAP_FAILED) && (m_cqRing != m_sqRing))
+        {   ::munmap(m_cqRing, m_cqRingSize);  }
+        if (m_sqRing != MAP_FAILED)
+        {   ::munmap(m_sqRing, m_sqRingSize);  }
+        if (m_ringFd >= 0)
+        {   ::close(m_ringFd);  }
+    }
+
+    /*!
+        Ф-ия создания IoUringReader; nullptr, если io_uring недоступен
+    */
+    static std::unique_ptr<IoUringReader> create(unsigned queueDepth)
+    {
+        std::unique_ptr<IoUringReader> reader(new IoUringReader());
+        if (!reader->setup(queueDepth))
+        {   return nullptr; }
+        return reader;
+    }
+
+    void submit(std::vector<ReadRequest>& batch) override
+    {
+        m_batch = &batch;
+        m_idxNext = 0;
+        m_cntDone.assign(batch.size(), 0);
+
+        const unsigned cntPushed = fillQueue();
+        if ((cntPushed != 0) && !enter(cntPushed, 0))
+        {   drain();    }
+    }
+
+    void wait() override
+    {
+        if (m_batch == nullptr)
+        {   return; }
+
+        while (m_cntInFlight != 0)
+        {
+            if (!enter(0, 1))
+            {
+                drain();
+                break;
+            }
+
+            const unsigned cntSubmit = reapCompletions() + fillQueue();
+            if ((cntSubmit != 0) && !enter(cntSubmit, 0))
+            {
+                drain();
+                break;
+            }
+        }
+        m_batch = nullptr;
+    }
+};
+#endif
+
+
+/*!
+    Класс PreadThreadPool - пул потоков, читающих запросы через pread().
+
+    Один пул на процесс (getShared()): его делят все PreadPoolReader
+    всех потоков сравнения, поэтому потоков чтения не больше --qd, а не
+    --qd на каждый источник. Запросы разных пакетов обслуживаются в
+    порядке поступления; каждый пакет ждёт только свои запросы.
+*/
+class PreadThreadPool
+{
+public:
+    /// Счётчик невыполненных запросов одного пакета
+    struct Batch
+    {
+        size_t cntLeft = 0;
+    };
+
+private:
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_cvWork;
+    std::condition_variable m_cvDone;
+    std::deque<std::pair<ReadRequest*, Batch*>> m_requests;
+    bool m_isStopped = false;
+
+    void worker()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true)
+        {
+            m_cvWork.wait(lock, [this] { return m_isStopped || !m_requests.empty(); });
+            if (m_isStopped)
+            {   return; }
+
+            auto [request, batch] = m_requests.front();
+            m_requests.pop_front();
+            lock.unlock();
+            request->isDone = preadFull(request->handle, request->buffer, request->size, request->offset, request->minSize);
+            lock.lock();
+
+            if (--batch->cntLeft == 0)
+            {   m_cvDone.notify_all();  }
+        }
+    }
+
+    void addThreads(size_t cntThreads)
+    {
+        while (m_threads.size() < cntThreads)
+        {   m_threads.emplace_back(&PreadThreadPool::worker, this);  }
+    }
+
+public:
+    explicit PreadThreadPool(size_t cntThreads)
+    {   addThreads(std::max<size_t>(1, cntThreads));    }
+
+    PreadThreadPool(const PreadThreadPool&) = delete;
+    PreadThreadPool& operator=(const PreadThreadPool&) = delete;
+
+    ~PreadThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_isStopped = true;
+        }
+        m_cvWork.notify_all();
+        for (auto& thread : m_threads)
+        {   thread.join();  }
+    }
+
+    /*!
+        Ф-ия получения пула процесса не меньше чем из cntThreads потоков;
+        пул живёт, пока есть его пользователи
+    */
+    static std::shared_ptr<PreadThreadPool> getShared(size_t cntThreads)
+    {
+        static std::mutex mutex;
+        static std::weak_ptr<PreadThreadPool> sharedPool;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto pool = sharedPool.lock();
+        if (!pool)
+        {
+            pool = std::make_shared<PreadThreadPool>(cntThreads);
+            sharedPool = pool;
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lockPool(pool->m_mutex);
+            pool->addThreads(cntThreads);
+        }
+        return pool;
+    }
+
+    void submit(std::vector<ReadRequest>& requests, Batch& batch)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            batch.cntLeft += requests.size();
+            for (auto& request : requests)
+            {   m_requests.emplace_back(&request, &batch);   }
+        }
+        m_cvWork.notify_all();
+    }
+
+    void wait(Batch& batch)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cvDone.wait(lock, [&batch] { return batch.cntLeft == 0; });
+    }
+
+    size_t getCntThreads()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_threads.size();
+    }
+};
+
+
+/*!
+    Класс PreadPoolReader - пакетное чтение пулом потоков через pread().
+    Используется, если io_uring недоступен. Пул общий для процесса,
+    число его потоков - наибольшая запрошенная глубина очереди.
+*/
+class PreadPoolReader : public AsyncReader
+{
+    std::shared_ptr<PreadThreadPool> m_pool;
+    PreadThreadPool::Batch m_batch;
+
+public:
+    explicit PreadPoolReader(size_t cntThreads)
+        : m_pool(PreadThreadPool::getShared(cntThreads))
+    {}
+
+    ~PreadPoolReader() override
+    {   m_pool->wait(m_batch);  }
+
+    void submit(std::vector<ReadRequest>& batch) override
+    {   m_pool->submit(batch, m_batch); }
+
+    void wait() override
+    {   m_pool->wait(m_batch);  }
+};
+
+
+/*!
+    Ф-ия создания асинхронного чтения с глубиной очереди queueDepth:
+    io_uring, если он доступен, иначе пул потоков с pread()
+*/
+inline std::unique_ptr<AsyncReader> makeAsyncReader(size_t queueDepth)
+{
+#ifdef BAYAN_HAVE_IO_URING
+    if (auto reader = IoUringReader::create(static_cast<unsigned>(queueDepth)))
+    {   return reader;  }
+#endif
+    return std::make_unique<PreadPoolReader>(queueDepth);
+}
+
+
+/*!
+    Класс OpenFilesCache - ограниченный набор открытых файлов.
+
+    Не более maxOpenFiles файлов открыто одновременно. При превышении
+    бюджета закрывается файл, который дольше всех не читался (LRU).
+    Закрытый файл переоткрывается при следующем чтении с сохранённой
+    позиции DataFile::offset. Набор общий для всех BlockSource одного
+    DoublesEngine: как открыть файл, определяет источник, вызвавший
+    acquire(), и вместе с файлом запоминается функция его закрытия.
+*/
+class OpenFilesCache
+{
+public:
+    using OpenFunc = std::function<bool(DataFile&)>;
+    using CloseFunc = std::function<void(DataFile&)>;
+
+private:
+    size_t m_maxOpenFiles;
+    std::list<std::pair<DataFile*, const CloseFunc*>> m_openFiles;  // в начале - недавно читавшиеся
+
+public:
+    explicit OpenFilesCache(size_t maxOpenFiles)
+        : m_maxOpenFiles(std::max<size_t>(1, maxOpenFiles))
+    {}
+
+    OpenFilesCache(const OpenFilesCache&) = delete;
+    OpenFilesCache& operator=(const OpenFilesCache&) = delete;
+
+    ~OpenFilesCache()
+    {
+        while (!m_openFiles.empty())
+        {   close(*m_openFiles.back().first);  }
+    }
+
+    /*!
+        Функция bool acquire(DataFile& item, const OpenFunc& openFile, const CloseFunc& closeFile)
+        - получение открытого файла, спозиционированного на item.offset;
+        closeFile должна жить, пока файл остаётся в наборе
+    */
+    bool acquire(DataFile& item, const OpenFunc& openFile, const CloseFunc& closeFile)
+    {
+        if (item.isInOpenFiles)
+        {
+            m_openFiles.splice(m_openFiles.begin(), m_openFiles, item.itOpenFiles);
+            return true;
+        }
+
+        while (m_openFiles.size() >= m_maxOpenFiles)
+        {   close(*m_openFiles.back().first);  }
+
+        ioStats.addOpen();
+        if (!openFile(item))
+        {
+            if (item.isChanged)
+            {   std::cerr << "File " << item.pathToFile << " changed after scan, skipped\n";   }
+            else
+            {   std::cerr << "Error open file " << item.pathToFile << '\n';  }
+            return false;
+        }
+
+        m_openFiles.emplace_front(&item, &closeFile);
+        item.itOpenFiles = m_openFiles.begin();
+        item.isInOpenFiles = true;
+        return true;
+    }
+
+    /*!
+        Функция void close(DataFile& item)
+        - закрытие файла и исключение его из набора открытых
+    */
+    void close(DataFile& item)
+    {
+        if (!item.isInOpenFiles)
+        {   return; }
+
+        const CloseFunc& closeFile = *item.itOpenFiles->second;
+        m_openFiles.erase(item.itOpenFiles);
+        item.isInOpenFiles = false;
+        closeFile(item);
+    }
+
+    /*!
+        Функция void closeAll(const CloseFunc& closeFile)
+        - закрытие всех файлов, открытых с функцией закрытия closeFile
+    */
+    void closeAll(const CloseFunc& closeFile)
+    {
+        for (auto it = m_openFiles.begin(); it != m_openFiles.end();)
+        {
+            const auto entry = *(it++);
+            if (entry.second == &closeFile)
+            {   close(*entry.first);    }
+        }
+    }
+
+    size_t size() const
+    {   return m_openFiles.size();  }
+
+    size_t getMaxOpenFiles() const
+    {   return m_maxOpenFiles;  }
+};
+
+
+/*!
+    Класс BlockSource - способ чтения блоков файлов.
+
+    Блоки группы читаются пакетом: submit() начинает чтение блока size
+    байт с позиции DataFile::offset каждого файла в buffers[i], wait()
+    дожидается его и выдаёт data[i] - указатель на данные (buffers[i] или
+    память самого источника) либо nullptr при ошибке. Между submit() и
+    wait() вызывающий может обрабатывать предыдущий пакет, данные которого
+    остаются действительными до следующего wait().
+
+    По умолчанию пакет читается синхронно в wait() функцией read().
+*/
+class BlockSource
+{
+    OpenFilesCache& m_openFiles;
+    const OpenFilesCache::OpenFunc m_openFile;
+    const OpenFilesCache::CloseFunc m_closeFile;
+
+protected:
+
+    const std::vector<DataFile*>* m_batchFiles = nullptr;
+    const std::vector<char*>* m_batchBuffers = nullptr;
+    uint64_t m_batchSize = 0;
+
+public:
+    using HandleFunc = std::function<void(int)>;
+
+    BlockSource(OpenFilesCache& openFiles, OpenFilesCache::OpenFunc openFile, OpenFilesCache::CloseFunc closeFile)
+        : m_openFiles(openFiles)
+        , m_openFile(std::move(openFile))
+        , m_closeFile(std::move(closeFile))
+    {}
+
+    BlockSource(const BlockSource&) = delete;
+    BlockSource& operator=(const BlockSource&) = delete;
+
+    virtual ~BlockSource()
+    {   m_openFiles.closeAll(m_closeFile);   }
+
+    virtual void submit(const std::vector<DataFile*>& files, uint64_t size, const std::vector<char*>& buffers)
+    {
+        m_batchFiles = &files;
+        m_batchBuffers = &buffers;
+        m_batchSize = size;
+    }
+
+    virtual void wait(std::vector<const char*>& data)
+    {
+        data.assign(m_batchFiles->size(), nullptr);
+        for (size_t i = 0; i < m_batchFiles->size(); ++i)
+        {
+            data[i] = read(*(*m_batchFiles)[i], m_batchSize, (*m_batchBuffers)[i]);
+            if (data[i] != nullptr)
+            {   ioStats.addRead(m_batchSize);   }
+        }
+    }
+
+    virtual const char* read(DataFile& item, uint64_t size, char* buffer) = 0;
+
+    /*!
+        Функция bool inspect(DataFile& item, const HandleFunc& onHandle)
+        - открытие файла для чтения в бюджете открытых файлов и вызов
+        onHandle с дескриптором файла для запросов метаданных (дыры,
+        FIEMAP); файл остаётся открытым для чтения. У std::ifstream
+        дескриптора нет, поэтому здесь файл на время вызова открывается
+        ещё раз
+    */
+    virtual bool inspect(DataFile& item, const HandleFunc& onHandle)
+    {
+        if (!acquire(item))
+        {   return false;   }
+
+        ioStats.addOpen();
+        const int handle = ::open(item.pathToFile.c_str(), O_RDONLY | O_CLOEXEC);
+        if (handle == -1)
+        {   return false;   }
+        onHandle(handle);
+        ::close(handle);
+        return true;
+    }
+
+    void close(DataFile& item)
+    {   m_openFiles.close(item);    }
+
+protected:
+    bool acquire(DataFile& item)
+    {   return m_openFiles.acquire(item, m_openFile, m_closeFile);  }
+
+    size_t getMaxOpenFiles() const
+    {   return m_openFiles.getMaxOpenFiles();   }
+};
+
+
+/*!
+    Класс StreamBlockSource - чтение через std::ifstream (--io=stream)
+*/
+class StreamBlockSource : public BlockSource
+{
+public:
+    explicit StreamBlockSource(OpenFilesCache& openFiles)
+        : BlockSource(openFiles
+                      , [](DataFile& item) {
+                            item.fd.clear();
+                            item.fd.open(item.pathToFile, std::ios::in | std::ios::binary);
+                            if (item.fd.is_open() && !item.checkUnchanged(-1))
+                            {   item.fd.close();    }
+                            if (item.fd.is_open() && (item.offset != 0))
+                            {   item.fd.seekg(static_cast<std::streamoff>(item.offset));  }
+                            return item.fd.is_open();
+                        }
+                      , [](DataFile& item) {
+                            if (item.fd.is_open())
+                            {   item.fd.close();  }
+                        })
+    {}
+
+    const char* read(DataFile& item, uint64_t size, char* buffer) override
+    {
+        if (!acquire(item))
+        {   return nullptr; }
+
+        // Блоки читаются не подряд, если часть из них взята из выборки или кэша
+        if (static_cast<uint64_t>(item.fd.tellg()) != item.offset)
+        {   item.fd.seekg(static_cast<std::streamoff>(item.offset));  }
+        ioStats.addReadCall();
+        item.fd.read(buffer, static_cast<std::streamsize>(size));
+        if (item.fd.fail())
+        {   return nullptr; }
+
+        return buffer;
+    }
+};
+
+
+/*!
+    Класс PreadBlockSource - чтение системным вызовом pread() по смещению,
+    без хранения позиции в дескрипторе (--io=pread)
+
+    При ненулевой глубине очереди (--qd) пакет читается асинхронно
+    (io_uring или пул потоков), пока идёт обработка предыдущего пакета.
+    Если группа не помещается в бюджет открытых файлов, пакет читается
+    синхронно: иначе дескриптор мог бы закрыться до завершения чтения.
+
+    С --direct файлы открываются с O_DIRECT (если файловая система его не
+    поддерживает - обычным образом), а блок читается размером, выровненным
+    до AlignedBufferPool::kAlignment; хвост файла короче выровненного размера.
+*/
+class PreadBlockSource : public BlockSource
+{
+    std::unique_ptr<AsyncReader> m_reader;
+    std::vector<ReadRequest> m_requests;
+    bool m_isAsync = false;
+    bool m_isDirectIo = false;
+
+    uint64_t getReadSize(uint64_t size) const
+    {
+        if (!m_isDirectIo)
+        {   return size;    }
+        return (size + AlignedBufferPool::kAlignment - 1) & ~static_cast<uint64_t>(AlignedBufferPool::kAlignment - 1);
+    }
+
+public:
+    PreadBlockSource(OpenFilesCache& openFiles, size_t queueDepth, bool isDirectIo = false)
+        : BlockSource(openFiles
+                      , [isDirectIo](DataFile& item) {
+#ifdef O_DIRECT
+                            if (isDirectIo)
+                            {   item.handle = ::open(item.pathToFile.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);   }
+#endif
+                            if (item.handle == -1)
+                            {   item.handle = ::open(item.pathToFile.c_str(), O_RDONLY | O_CLOEXEC);   }
+                            if ((item.handle != -1) && !item.checkUnchanged(item.handle))
+                            {
+                                ::close(item.handle);
+                                item.handle = -1;
+                            }
+                            return (item.handle != -1);
+                        }
+                      , [](DataFile& item) {
+                            if (item.handle != -1)
+                            {
+                                ::close(item.handle);
+                                item.handle = -1;
+                            }
+                        })
+        , m_reader((queueDepth != 0) ? makeAsyncReader(queueDepth) : nullptr)
+        , m_isDirectIo(isDirectIo)
+    {}
+
+    void submit(const std::vector<DataFile*>& files, uint64_t size, const std::vector<char*>& buffers) override
+    {
+        BlockSource::submit(files, size, buffers);
+
+        m_isAsync = m_reader && (files.size() <= getMaxOpenFiles());
+        if (!m_isAsync)
+        {   return; }
+
+        m_requests.assign(files.size(), ReadRequest());
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            if (acquire(*files[i]))
+            {   m_requests[i] = {files[i]->handle, buffers[i], files[i]->offset, getReadSize(size), size, false};  }
+            else
+            {   m_requests[i].isDone = true;  } // нечего читать, ошибка будет в wait()
+        }
+        m_reader->submit(m_requests);
+    }
+
+    void wait(std::vector<const char*>& data) override
+    {
+        if (!m_isAsync)
+        {
+            BlockSource::wait(data);
+            return;
+        }
+
+        m_reader->wait();
+
+        data.assign(m_batchFiles->size(), nullptr);
+        for (size_t i = 0; i < m_batchFiles->size(); ++i)
+        {
+            auto& request = m_requests[i];
+            if (request.handle == -1)
+            {   continue;   }
+
+            if (request.isDone || preadFull(request.handle, request.buffer, request.size, request.offset, request.minSize))
+            {
+                data[i] = request.buffer;
+                ioStats.addRead(request.minSize);
+            }
+        }
+    }
+
+    const char* read(DataFile& item, uint64_t size, char* buffer) override
+    {
+        if (!acquire(item))
+        {   return nullptr; }
+
+        if (!preadFull(item.handle, buffer, getReadSize(size), item.offset, size))
+        {   return nullptr; }
+
+        return buffer;
+    }
+
+    bool inspect(DataFile& item, const HandleFunc& onHandle) override
+    {
+        if (!acquire(item))
+        {   return false;   }
+
+        onHandle(item.handle);
+        return true;
+    }
+};
+
+
+/*!
+    Класс MmapBlockSource - чтение блоков прямо из отображения файла в
+    память (boost::interprocess), без копирования (--io=mmap).
+
+    Файл отображается окнами не больше kWindowSize; окно сдвигается,
+    когда очередной блок выходит за его границы. На окно задаётся
+    MADV_SEQUENTIAL, а в submit() на читаемые блоки всех файлов
+    группы - MADV_WILLNEED, чтобы ядро подгружало их параллельно и
+    пока обрабатывается предыдущая группа.
+*/
+class MmapBlockSource : public BlockSource
+{
+    static constexpr uint64_t kWindowSize = 64 * 1024 * 1024;
+
+    /// Группа не помещается в бюджет: отображение может быть закрыто
+    /// до обработки данных, поэтому они копируются в buffer
+    bool m_isCopyData = false;
+
+    /// Обработчик дескриптора при открытии файла из inspect()
+    const HandleFunc* m_onHandle = nullptr;
+
+    static bool mapWindow(DataFile& item, uint64_t size, const HandleFunc* onHandle = nullptr)
+    {
+        namespace ipc = boost::interprocess;
+
+        const uint64_t windowSize = std::min(item.fileSize - item.offset, std::max(kWindowSize, size));
+        try
+        {
+            ipc::file_mapping mapping(item.pathToFile.c_str(), ipc::read_only);
+            if (!item.checkUnchanged(mapping.get_mapping_handle().handle))
+            {
+                item.region.reset();
+                return false;
+            }
+            if (onHandle != nullptr)
+            {   (*onHandle)(mapping.get_mapping_handle().handle);  }
+            item.region = std::make_unique<ipc::mapped_region>(mapping, ipc::read_only
+                                                               , static_cast<ipc::offset_t>(item.offset)
+                                                               , static_cast<size_t>(windowSize));
+        }
+        catch (const ipc::interprocess_exception&)
+        {
+            item.region.reset();
+            return false;
+        }
+        item.regionOffset = item.offset;
+        item.region->advise(ipc::mapped_region::advice_sequential);
+        return true;
+    }
+
+    static void adviseWillNeed(const DataFile& item, uint64_t size)
+    {
+        static const uintptr_t pageSize = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+
+        const auto address = reinterpret_cast<uintptr_t>(item.region->get_address()) + (item.offset - item.regionOffset);
+        const uintptr_t begin = address & ~(pageSize - 1);
+        ::madvise(reinterpret_cast<void*>(begin), static_cast<size_t>(address + size - begin), MADV_WILLNEED);
+    }
+
+    static bool isInWindow(const DataFile& item, uint64_t size)
+    {
+        return item.region
+                && (item.offset >= item.regionOffset)
+                && (item.offset + size <= item.regionOffset + item.region->get_size());
+    }
+
+public:
+    explicit MmapBlockSource(OpenFilesCache& openFiles)
+        : BlockSource(openFiles
+                      , [this](DataFile& item) {
+                            return mapWindow(item, item.getBlockSize(item.offset), m_onHandle);
+                        }
+                      , [](DataFile& item) {
+                            item.region.reset();
+                        })
+    {}
+
+    void submit(const std::vector<DataFile*>& files, uint64_t size, const std::vector<char*>& buffers) override
+    {
+        BlockSource::submit(files, size, buffers);
+        m_isCopyData = (files.size() > getMaxOpenFiles());
+
+        for (auto item : files)
+        {
+            if (item->isInOpenFiles && isInWindow(*item, size))
+            {   adviseWillNeed(*item, size);  }
+        }
+    }
+
+    const char* read(DataFile& item, uint64_t size, char* buffer) override
+    {
+        if (!acquire(item))
+        {   return nullptr; }
+
+        if (!isInWindow(item, size) && !mapWindow(item, size))
+        {   return nullptr; }
+
+        const char* data = static_cast<const char*>(item.region->get_address()) + (item.offset - item.regionOffset);
+        if (m_isCopyData)
+        {
+            std::memcpy(buffer, data, size);
+            return buffer;
+        }
+        return data;
+    }
+
+    /// Дескриптор есть только при отображении окна: файл отображается заново
+    bool inspect(DataFile& item, const HandleFunc& onHandle) override
+    {
+        close(item);
+        m_onHandle = &onHandle;
+        const bool isOpened = acquire(item);
+        m_onHandle = nullptr;
+        return isOpened;
+    }
+};
+
+
+/*!
+    Ф-ия выбора способа чтения для файлов размера fileSize при --io=auto:
+    небольшие файлы читаются через pread(), крупные - через mmap
+*/
+inline std::string getAutoIoMode(uint64_t fileSize)
+{
+    static constexpr uint64_t kMinMmapFileSize = 256 * 1024;
+    return (fileSize >= kMinMmapFileSize) ? "mmap" : "pread";
+}
+
+
+/*!
+    Структура CacheKey - ключ записи кэша ключей блоков (--cache).
+    Запись действительна, пока у файла не изменились устройство, inode,
+    размер, mtime и ctime; ключи разных размеров блока (--sb, --sbmax) и
+    алгоритмов хэширования хранятся отдельно. Поля без выравнивающих пропусков,
+    ключи сравниваются побайтно.
+*/
+struct CacheKey
+{
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+    uint64_t size = 0;
+    int64_t mtimeNs = 0;
+    int64_t ctimeNs = 0;
+    uint32_t blockSize = 0;
+    uint32_t maxBlockSize = 0;
+    char hashAlg[8] = {};
+
+    /// Ключ файла по его свойствам, полученным при обходе
+    static CacheKey make(const FileStat& fileStat, uint32_t blockSize, uint32_t maxBlockSize, const std::string& hashAlg)
+    {
+        CacheKey key;
+        key.dev = fileStat.dev;
+        key.ino = fileStat.ino;
+        key.size = fileStat.size;
+        key.mtimeNs = fileStat.mtimeNs;
+        key.ctimeNs = fileStat.ctimeNs;
+        key.blockSize = blockSize;
+        key.maxBlockSize = maxBlockSize;
+        std::memcpy(key.hashAlg, hashAlg.data(), std::min(hashAlg.size(), sizeof(key.hashAlg)));
+        return key;
+    }
+
+    bool operator<(const CacheKey& other) const
+    {   return std::memcmp(this, &other, sizeof(CacheKey)) < 0;    }
+
+    bool operator==(const CacheKey& other) const
+    {   return std::memcmp(this, &other, sizeof(CacheKey)) == 0;   }
+};
+
+static_assert(sizeof(CacheKey) == 56, "CacheKey must not have padding");
+
+
+/*!
+    Класс BlockDigestCache - файл кэша ключей блоков (--cache=path).
+
+    Файл: заголовок, отсортированный массив записей CacheEntry и ключи
+    блоков подряд. Загрузка - отображение файла в память и проверка
+    заголовка; поиск - двоичный поиск прямо в отображении. Для файла
+    хранятся ключи первых блоков подряд (не больше kMaxDigests),
+    вычисленные при прошлых запусках.
+
+    Новые ключи копятся в памяти (update() потокобезопасен), сразу
+    доступны lookup() и в save() сливаются со старыми записями в новый файл, который затем атомарно
+    заменяет прежний через rename() и загружается вместо него. Повреждённый
+    или чужой файл кэша игнорируется и при сохранении перезаписывается.
+
+    Каждый запуск, сохраняющий кэш, получает следующий номер. Запись
+    помнит номер последнего запуска, в котором её искали (lookup()), и
+    удаляется при сохранении, если её не искали kMaxUnusedRuns запусков
+    подряд: так из кэша уходят удалённые и изменённые файлы.
+
+    Кэш с пустым путём не связан с файлом (--watch без --cache): save()
+    собирает тот же образ в памяти, и ключи доступны lookup() до конца работы.
+*/
+class BlockDigestCache
+{
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t entrySize;
+        uint64_t cntEntries;
+        uint64_t fileSize;
+        uint64_t run;           // номер запуска, записавшего файл
+    };
+
+    struct CacheEntry
+    {
+        CacheKey key;
+        uint64_t digestsOffset;
+        uint32_t cntDigests;
+        uint32_t digestSize;
+        uint64_t lastRun;       // номер запуска, в котором запись искали
+    };
+
+    static constexpr char kMagic[8] = {'B', 'A', 'Y', 'A', 'N', 'D', 'C', '\0'};
+    static constexpr uint32_t kVersion = 2;
+
+    std::string m_pathToCache;
+
+    std::unique_ptr<boost::interprocess::mapped_region> m_region;
+    std::string m_image;
+    const CacheEntry* m_entries = nullptr;
+    uint64_t m_cntEntries = 0;
+    uint64_t m_fileRun = 0;
+    uint64_t m_run = 0;
+    std::unique_ptr<std::atomic<bool>[]> m_hits;    // искали ли m_entries[i] в этом запуске
+
+    mutable std::mutex m_updatesMutex;
+    std::map<CacheKey, std::pair<uint32_t, std::string>> m_updates;
+
+    const char* getBase() const
+    {   return m_region ? static_cast<const char*>(m_region->get_address()) : m_image.data(); }
+
+    uint64_t getImageSize() const
+    {   return m_region ? m_region->get_size() : m_image.size();   }
+
+    void load()
+    {
+        namespace ipc = boost::interprocess;
+
+        m_region.reset();
+        m_entries = nullptr;
+        m_cntEntries = 0;
+        m_fileRun = 0;
+        m_hits.reset();
+        if (m_pathToCache.empty())
+        {   return; }
+
+        boost::system::error_code errorCode;
+        const auto cacheSize = file_size(m_pathToCache, errorCode);
+        if (errorCode || (cacheSize < sizeof(Header)))
+        {   return; }
+
+        try
+        {
+            ipc::file_mapping mapping(m_pathToCache.c_str(), ipc::read_only);
+            m_region = std::make_unique<ipc::mapped_region>(mapping, ipc::read_only);
+        }
+        catch (const ipc::interprocess_exception&)
+        {
+            std::cerr << "Cache " << m_pathToCache << " is not readable, ignored\n";
+            m_region.reset();
+            return;
+        }
+
+        Header header{};
+        std::memcpy(&header, getBase(), sizeof(header));
+        const bool isValid = (std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0)
+                && (header.version == kVersion)
+                && (header.entrySize == sizeof(CacheEntry))
+                && (header.fileSize == m_region->get_size())
+                && (header.cntEntries <= (header.fileSize - sizeof(Header)) / sizeof(CacheEntry));
+        if (!isValid)
+        {
+            std::cerr << "Cache " << m_pathToCache << " has unknown format, ignored\n";
+            m_region.reset();
+            return;
+        }
+
+        setEntries(reinterpret_cast<const CacheEntry*>(getBase() + sizeof(Header)), header.cntEntries);
+        m_fileRun = header.run;
+    }
+
+    void setEntries(const CacheEntry* entries, uint64_t cntEntries)
+    {
+        m_entries = entries;
+        m_cntEntries = cntEntries;
+        m_hits.reset(new std::atomic<bool>[cntEntries]());
+    }
+
+    std::string_view getDigests(const CacheEntry& entry) const
+    {
+        const uint64_t size = static_cast<uint64_t>(entry.cntDigests) * entry.digestSize;
+        if ((entry.digestsOffset > getImageSize()) || (size > getImageSize() - entry.digestsOffset))
+        {   return std::string_view();  }
+        return std::string_view(getBase() + entry.digestsOffset, static_cast<size_t>(size));
+    }
+
+    static bool writeFull(int handle, const void* data, size_t size)
+    {
+        const char* bytes = static_cast<const char*>(data);
+        while (size != 0)
+        {
+            const ssize_t result = ::write(handle, bytes, size);
+            if ((result < 0) && (errno == EINTR))
+            {   continue;   }
+            if (result <= 0)
+            {   return false;   }
+            bytes += result;
+            size -= static_cast<size_t>(result);
+        }
+        return true;
+    }
+
+public:
+    static constexpr size_t kMaxDigests = 1024;
+    static constexpr uint64_t kMaxUnusedRuns = 16;
+
+    explicit BlockDigestCache(const std::string& pathToCache)
+        : m_pathToCache(pathToCache)
+    {
+        load();
+        m_run = m_fileRun + 1;
+    }
+
+    BlockDigestCache(const BlockDigestCache&) = delete;
+    BlockDigestCache& operator=(const BlockDigestCache&) = delete;
+
+    /*!
+        Функция std::string_view lookup(...)
+        - ключи первых блоков файла с ключом key (пусто, если их нет)
+    */
+    std::string_view lookup(const CacheKey& key, uint32_t digestSize) const
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_updatesMutex);
+            const auto itUpdate = m_updates.find(key);
+            if ((itUpdate != m_updates.end()) && (itUpdate->second.first == digestSize))
+            {   return itUpdate->second.second; }
+        }
+
+        const CacheEntry* end = m_entries + m_cntEntries;
+        const CacheEntry* it = std::lower_bound(m_entries, end, key, [](const CacheEntry& entry, const CacheKey& value) {
+            return entry.key < value;
+        });
+        if ((it == end) || !(it->key == key) || (it->digestSize != digestSize))
+        {   return std::string_view();  }
+        m_hits[static_cast<size_t>(it - m_entries)].store(true, std::memory_order_relaxed);
+        return getDigests(*it);
+    }
+
+    /*!
+        Функция void update(...)
+        - запоминание ключей первых блоков файла для записи в save();
+        для одного ключа (жёсткие ссылки) остаётся самый длинный список
+    */
+    void update(const CacheKey& key, uint32_t digestSize, std::string digests)
+    {
+        std::lock_guard<std::mutex> lock(m_updatesMutex);
+        auto& update = m_updates[key];
+        if (digests.size() >= update.second.size())
+        {   update = std::make_pair(digestSize, std::move(digests));   }
+    }
+
+    /*!
+        Функция bool save()
+        - запись кэша со всеми обновлениями во временный файл и замена им прежнего
+        (для кэша без файла - в образ в памяти); записи, которые не искали
+        kMaxUnusedRuns запусков, удаляются
+    */
+    bool save()
+    {
+        std::lock_guard<std::mutex> lock(m_updatesMutex);
+
+        // Номер запуска, в котором запись искали последний раз; 0 - запись устарела
+        auto getLastRun = [this](size_t idxEntry) -> uint64_t {
+            if (m_hits[idxEntry].load(std::memory_order_relaxed))
+            {   return m_run;   }
+            return (m_run - m_entries[idxEntry].lastRun < kMaxUnusedRuns) ? m_entries[idxEntry].lastRun : 0;
+        };
+
+        bool isChanged = !m_updates.empty();
+        for (size_t i = 0; !isChanged && (i < m_cntEntries); ++i)
+        {   isChanged = (getLastRun(i) != m_entries[i].lastRun);  }
+        if (!isChanged)
+        {   return true;    }
+
+        std::vector<CacheEntry> entries;
+        std::vector<std::string_view> digests;
+        entries.reserve(m_cntEntries + m_updates.size());
+        digests.reserve(m_cntEntries + m_updates.size());
+
+        auto addEntry = [&entries, &digests](const CacheKey& key, uint32_t digestSize, std::string_view keyDigests, uint64_t lastRun) {
+            if ((digestSize == 0) || keyDigests.empty() || (lastRun == 0))
+            {   return; }
+            entries.push_back({key, 0, static_cast<uint32_t>(keyDigests.size() / digestSize), digestSize, lastRun});
+            digests.push_back(keyDigests);
+        };
+        auto addOldEntry = [this, &addEntry, &getLastRun](size_t idxEntry) {
+            const CacheEntry& entry = m_entries[idxEntry];
+            addEntry(entry.key, entry.digestSize, getDigests(entry), getLastRun(idxEntry));
+        };
+
+        size_t idxOld = 0;
+        for (const auto& update: m_updates)
+        {
+            for (; (idxOld < m_cntEntries) && (m_entries[idxOld].key < update.first); ++idxOld)
+            {   addOldEntry(idxOld);    }
+            if ((idxOld < m_cntEntries) && (m_entries[idxOld].key == update.first))
+            {   ++idxOld;   }
+            addEntry(update.first, update.second.first, update.second.second, m_run);
+        }
+        for (; idxOld < m_cntEntries; ++idxOld)
+        {   addOldEntry(idxOld);    }
+
+        uint64_t digestsOffset = sizeof(Header) + entries.size() * sizeof(CacheEntry);
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            entries[i].digestsOffset = digestsOffset;
+            digestsOffset += digests[i].size();
+        }
+
+        Header header{};
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.entrySize = sizeof(CacheEntry);
+        header.cntEntries = entries.size();
+        header.fileSize = digestsOffset;
+        header.run = m_run;
+
+        if (m_pathToCache.empty())
+        {
+            std::string image;
+            image.reserve(digestsOffset);
+            image.append(reinterpret_cast<const char*>(&header), sizeof(header));
+            image.append(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(CacheEntry));
+            for (const auto& keyDigests: digests)
+            {   image.append(keyDigests.data(), keyDigests.size()); }
+
+            m_image = std::move(image);
+            setEntries(reinterpret_cast<const CacheEntry*>(m_image.data() + sizeof(Header)), entries.size());
+            m_updates.clear();
+            return true;
+        }
+
+        const std::string pathToTemp = m_pathToCache + ".tmp." + std::to_string(::getpid());
+        const int handle = ::open(pathToTemp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (handle == -1)
+        {
+            std::cerr << "Error write cache " << pathToTemp << '\n';
+            return false;
+        }
+
+        bool isWritten = writeFull(handle, &header, sizeof(header))
+                && writeFull(handle, entries.data(), entries.size() * sizeof(CacheEntry));
+        for (size_t i = 0; isWritten && (i < digests.size()); ++i)
+        {   isWritten = writeFull(handle, digests[i].data(), digests[i].size());  }
+        isWritten = isWritten && (::fsync(handle) == 0);
+        isWritten = (::close(handle) == 0) && isWritten;
+
+        if (!isWritten || (::rename(pathToTemp.c_str(), m_pathToCache.c_str()) != 0))
+        {
+            std::cerr << "Error write cache " << m_pathToCache << '\n';
+            ::unlink(pathToTemp.c_str());
+            return false;
+        }
+
+        m_updates.clear();
+        load();
+        return true;
+    }
+};
+
+
+/*!
+    Класс DoublesEngineBase - интерфейс поиска дубликатов, не зависящий
+    от алгоритма хэширования
+*/
+class DoublesEngineBase
+{
+public:
+    /// Обработчик подтверждённой группы дубликатов: пути файлов и ключ
+    /// содержимого (пустой для --cmp=bytes)
+    using DoublesHandler = std::function<void(std::vector<std::string>&& paths, const std::string& digest)>;
+
+    /// Подгруппа, сравнение которой не закончено: начало следующего блока,
+    /// число сравненных блоков, ключ прочитанных блоков (пустой для
+    /// --cmp=bytes) и файлы - номера в списке файлов группы
+    struct PendingGroup
+    {
+        uint64_t offset = 0;
+        uint64_t round = 0;
+        std::string digest;
+        std::vector<uint32_t> files;
+    };
+
+    /// Обработчик хода сравнения: вызывается после каждого раунда,
+    /// getGroups() выдаёт подгруппы, сравнение которых не закончено
+    using PendingGroupsFunc = std::function<std::vector<PendingGroup>()>;
+    using ProgressHandler = std::function<void(const PendingGroupsFunc& getGroups)>;
+
+    virtual ~DoublesEngineBase() = default;
+
+    virtual void find(std::list<DataFile>& openedFiles, const DoublesHandler& onDoubles
+                      , const ProgressHandler& onProgress, const std::vector<PendingGroup>& startGroups) = 0;
+};
+
+
+/*!
+    Класс DoublesEngine - поиск дубликатов среди файлов одного размера
+    методом последовательного уточнения разбиения.
+
+    За раунд из каждого файла группы читается очередной блок, и группа
+    разбивается на подгруппы по ключу блока: двоичному хэшу Hasher
+    фиксированного размера (--cmp=hash) или самому содержимому блока
+    (--cmp=bytes, Hasher = BytesCompare). Подгруппы из
+    одного файла сразу отбрасываются, их файлы больше не читаются. Хранится
+    только ключ текущего блока, поэтому раунд стоит O(n), а память не
+    зависит от длины файлов.
+
+    Подгруппы обрабатываются в ширину, в порядке появления, поэтому
+    результат детерминирован. Пока сравниваются блоки одной группы,
+    уже читаются блоки следующей группы очереди. Число открытых файлов ограничено
+    бюджетом OpenFilesCache: между раундами файлы могут закрываться и
+    переоткрываться с сохранённой позиции.
+
+    С выборкой (--sample) после первого блока читаются последний и средний
+    блоки файлов, и только затем остальные по порядку. Подгруппы уже
+    совпадают на блоках выборки, поэтому последовательные раунды их
+    пропускают: каждый блок по-прежнему читается и сравнивается один раз.
+
+    С кэшем (--cache) ключи первых блоков неизменившихся файлов берутся
+    из BlockDigestCache, и эти блоки не читаются; вычисленные ключи
+    первых блоков сохраняются в кэш после обработки группы.
+
+    Файлы группы читаются в порядке --order: по устройству и физическому
+    положению начала файла (или inode), подгруппы этот порядок сохраняют.
+    Пакет чтения занимает места в DeviceQueues устройств своих файлов.
+
+    Блок, целиком лежащий в дыре разреженного файла, не читается: его
+    содержимое - нули, а ключ - ключ нулевого блока того же размера,
+    поэтому сравнение побайтно совпадает со сравнением прочитанных блоков.
+
+    Группа дубликатов передаётся обработчику сразу, как только совпали
+    последние блоки её файлов. Ключ содержимого группы - хэш Hasher
+    цепочки ключей её блоков; он одинаков у одинаковых файлов при тех же
+    --hash, --sb, --sbmax и --sample.
+*/
+template <typename Hasher>
+class DoublesEngine final : public DoublesEngineBase
+{
+    /// Группа файлов, совпавших по всем уже прочитанным блокам
+    struct FileGroup
+    {
+        std::vector<DataFile*> files;
+        uint64_t offset = 0;
+        std::string digest;     // ключ уже прочитанных блоков
+        size_t round = 0;       // число уже сравненных блоков
+    };
+
+    /// Пакет чтения очередного блока группы; пакетов два - текущий и следующий
+    struct ReadBlocks
+    {
+        FileGroup group;
+        bool isSubmitted = false;
+
+        std::vector<DataFile*> files;   // файлы группы без ключа блока в кэше
+        DeviceQueues::Slots slots;      // места в очередях устройств files
+
+        std::vector<char*> buffers;     // из m_bufferPool
+        std::vector<const char*> data;
+        size_t blockSize = 0;
+    };
+
+    using digest_type = typename Hasher::digest_type;
+
+    const Settings& m_options;
+    BlockDigestCache* m_cache;
+    const std::string m_hashAlg;
+
+    OpenFilesCache m_openFiles;     // общий бюджет всех m_blockSources
+    std::map<std::string, std::unique_ptr<BlockSource>> m_blockSources;
+
+    AlignedBufferPool m_bufferPool;
+    ReadBlocks m_readBlocks[2];
+    std::vector<uint64_t> m_sampleOffsets;
+    std::vector<digest_type> m_keys;
+    std::vector<uint64_t> m_devices;
+    std::unordered_set<uint64_t> m_noFiemapDevices;    // устройства без поддержки FIEMAP
+
+    std::string m_zeros;
+    digest_type m_zeroKey{};
+    uint64_t m_zeroKeySize = UINT64_MAX;
+
+    const DoublesHandler* m_onDoubles = nullptr;
+    bool m_isKeepDigests = false;
+
+    void prepareReadBlocks(ReadBlocks& readBlocks, size_t cntBlocks, size_t blockSize)
+    {
+        if (readBlocks.blockSize != blockSize)
+        {
+            for (auto buffer: readBlocks.buffers)
+            {   m_bufferPool.release(buffer, readBlocks.blockSize);  }
+            readBlocks.buffers.clear();
+            readBlocks.blockSize = blockSize;
+        }
+        while (readBlocks.buffers.size() < cntBlocks)
+        {   readBlocks.buffers.push_back(m_bufferPool.acquire(blockSize));  }
+    }
+
+    /*!
+        Функция BlockSource& getBlockSource(uint64_t fileSize)
+        - способ чтения файлов размера fileSize, заданный --io
+    */
+    BlockSource& getBlockSource(uint64_t fileSize)
+    {
+        std::string ioMode = m_options.getIoMode();
+        if (ioMode == "auto")
+        {   ioMode = getAutoIoMode(fileSize);  }
+
+        auto& source = m_blockSources[ioMode];
+        if (!source)
+        {
+            if (ioMode == "mmap")
+            {   source = std::make_unique<MmapBlockSource>(m_openFiles);  }
+            else if (ioMode == "pread")
+            {   source = std::make_unique<PreadBlockSource>(m_openFiles, m_options.getQueueDepth(), m_options.isDirectIo());  }
+            else
+            {   source = std::make_unique<StreamBlockSource>(m_openFiles);  }
+        }
+        return *source;
+    }
+
+    /*!
+        Функция uint64_t getNextOffset(const DataFile& item, uint64_t offset)
+        - начало блока, читаемого после блока с позиции offset: после
+        первого блока - блоки выборки m_sampleOffsets, затем остальные
+        блоки по порядку без уже прочитанных в выборке (fileSize - конец)
+    */
+    uint64_t getNextOffset(const DataFile& item, uint64_t offset) const
+    {
+        auto itSample = std::find(m_sampleOffsets.begin(), m_sampleOffsets.end(), offset);
+        if ((offset == 0) && !m_sampleOffsets.empty())
+        {   return m_sampleOffsets.front(); }
+        if (itSample != m_sampleOffsets.end())
+        {
+            if (++itSample != m_sampleOffsets.end())
+            {   return *itSample;   }
+            offset = 0;
+        }
+
+        do
+        {   offset += item.getBlockSize(offset);    }
+        while (std::find(m_sampleOffsets.begin(), m_sampleOffsets.end(), offset) != m_sampleOffsets.end());
+        return std::min(offset, item.fileSize);
+    }
+
+    /// Блоки выборки (--sample): последний и средний, кроме первого блока
+    void prepareSampleOffsets(const DataFile& item)
+    {
+        m_sampleOffsets.clear();
+        if (!m_options.isSample())
+        {   return; }
+
+        for (const uint64_t position: {item.fileSize - 1, item.fileSize / 2})
+        {
+            const uint64_t offset = item.getBlockOffset(position);
+            if ((offset != 0) && (std::find(m_sampleOffsets.begin(), m_sampleOffsets.end(), offset) == m_sampleOffsets.end()))
+            {   m_sampleOffsets.push_back(offset);  }
+        }
+    }
+
+    static uint64_t getCurrBlockSize(const FileGroup& group)
+    {
+        ///    3. Формирование необходимого  размера блока данных
+        const uint64_t restReadSize = group.files.front()->fileSize - group.offset;
+        return std::min<uint64_t>(group.files.front()->getBlockSize(group.offset), restReadSize);
+    }
+
+    /*!
+        Функция void submitGroup(...)
+        - начало чтения очередного блока всех файлов первой группы очереди
+    */
+    void submitGroup(std::deque<FileGroup>& groups, ReadBlocks& readBlocks, BlockSource& source)
+    {
+        readBlocks.group = std::move(groups.front());
+        readBlocks.isSubmitted = true;
+        groups.pop_front();
+
+        const FileGroup& group = readBlocks.group;
+        const uint64_t currBlockSize = getCurrBlockSize(group);
+        readBlocks.files.clear();
+        for (auto item: group.files)
+        {
+            if (isReadNeeded(*item, group.offset, currBlockSize))
+            {   readBlocks.files.push_back(item);   }
+        }
+        prepareReadBlocks(readBlocks, readBlocks.files.size(), group.files.front()->getBlockSize(group.offset));
+
+        ///    4. Чтение блока данных из преодполагаемых файлов-дубликатов
+        if (!readBlocks.files.empty())
+        {
+            m_devices.clear();
+            for (auto item: readBlocks.files)
+            {   m_devices.push_back(item->fileStat.dev);  }
+            std::sort(m_devices.begin(), m_devices.end());
+            m_devices.erase(std::unique(m_devices.begin(), m_devices.end()), m_devices.end());
+            readBlocks.slots.acquire(deviceQueues, m_devices, m_options.getDeviceQueueDepth());
+
+            source.submit(readBlocks.files, currBlockSize, readBlocks.buffers);
+        }
+    }
+
+    /// Блок файла с позиции offset нужно читать: его ключа нет в кэше и он не в дыре
+    static bool isReadNeeded(const DataFile& item, uint64_t offset, uint64_t size)
+    {
+        return !hasCachedDigest(item, offset) && !item.isHole(offset, size);
+    }
+
+    /// Ключ блока из size нулей (блока в дыре файла)
+    std::string_view getZeroKey(uint64_t size)
+    {
+        if (m_zeros.size() < size)
+        {   m_zeros.resize(size, '\0');  }
+
+        if constexpr (std::is_same_v<Hasher, BytesCompare>)
+        {   return std::string_view(m_zeros.data(), size);  }
+        else
+        {
+            if (m_zeroKeySize != size)
+            {
+                Hasher::hash(m_zeros.data(), size, m_zeroKey);
+                m_zeroKeySize = size;
+            }
+            return std::string_view(reinterpret_cast<const char*>(m_zeroKey.data()), m_zeroKey.size());
+        }
+    }
+
+    /// Учёт прочитанных блоков пакета по устройствам (--stats)
+    static void addDeviceReads(const ReadBlocks& readBlocks)
+    {
+        if (!ioStats.isCollectDevices)
+        {   return; }
+
+        const uint64_t currBlockSize = getCurrBlockSize(readBlocks.group);
+        for (size_t i = 0; i < readBlocks.files.size(); ++i)
+        {
+            const DataFile& item = *readBlocks.files[i];
+            if (readBlocks.data[i] != nullptr)
+            {   ioStats.addDeviceRead(item.fileStat.dev, item.fileStat.ino, item.offset, currBlockSize);  }
+        }
+    }
+
+    /*!
+        Функция void prepareFiles(std::vector<DataFile*>& files, BlockSource& source)
+        - получение дыр файлов группы не меньше kMinSparseFileSize и
+        упорядочивание файлов для чтения (--order): по устройству, затем по
+        физическому положению начала файла (FIEMAP, в группах больше двух
+        файлов) или по inode, если файловая система положение не сообщает.
+        Файлы открывает source в бюджете открытых файлов, и они остаются
+        открытыми для чтения; запросы занимают места в очередях устройств,
+        как чтение. На устройстве, где FIEMAP не поддерживается (tmpfs),
+        положение запрашивается только до первого отказа. Файлы, которые
+        не удалось открыть, исключаются из группы
+    */
+    void prepareFiles(std::vector<DataFile*>& files, BlockSource& source)
+    {
+        static constexpr uint64_t kMinSparseFileSize = 1024 * 1024;
+
+        // Положение на устройстве стоит открытия файла: для пары файлов
+        // хватает порядка inode
+        const std::string readOrder = m_options.getReadOrder();
+        const bool isPhysical = (readOrder == "physical") && (files.size() > 2);
+        const bool isHoles = (files.front()->fileSize >= kMinSparseFileSize);
+        if (!isHoles && (readOrder == "none"))
+        {   return; }
+
+        const auto isFiemap = [this, isPhysical](const DataFile& item)
+        {   return isPhysical && (m_noFiemapDevices.count(item.fileStat.dev) == 0);    };
+
+        m_devices.clear();
+        for (auto item: files)
+        {
+            if (isHoles || isFiemap(*item))
+            {   m_devices.push_back(item->fileStat.dev);  }
+        }
+        std::sort(m_devices.begin(), m_devices.end());
+        m_devices.erase(std::unique(m_devices.begin(), m_devices.end()), m_devices.end());
+        DeviceQueues::Slots slots;
+        slots.acquire(deviceQueues, m_devices, m_options.getDeviceQueueDepth());
+
+        std::vector<std::tuple<uint64_t, bool, uint64_t, uint64_t, DataFile*>> keys;
+        keys.reserve(files.size());
+        for (auto item: files)
+        {
+            uint64_t physicalOffset = 0;
+            bool isMapped = false;
+            const bool isItemFiemap = isFiemap(*item);
+            if (isHoles || isItemFiemap)
+            {
+                const bool isOpened = source.inspect(*item, [&](int handle)
+                {
+                    bool isSupported = true;
+                    isMapped = isItemFiemap && getPhysicalOffset(handle, physicalOffset, &isSupported);
+                    if (!isSupported)
+                    {   m_noFiemapDevices.insert(item->fileStat.dev);  }
+                    if (isHoles)
+                    {   item->holes = getHoles(handle, item->fileSize);  }
+                });
+                if (!isOpened)
+                {   continue;   }
+            }
+            keys.emplace_back(item->fileStat.dev, !isMapped, physicalOffset, item->fileStat.ino, item);
+        }
+        if (readOrder != "none")
+        {   std::sort(keys.begin(), keys.end());    }
+
+        files.resize(keys.size());
+        for (size_t i = 0; i < files.size(); ++i)
+        {   files[i] = std::get<DataFile*>(keys[i]);  }
+    }
+
+    /// Ключ блока файла с позиции offset уже есть в кэше
+    static bool hasCachedDigest(const DataFile& item, uint64_t offset)
+    {
+        if constexpr (std::is_same_v<Hasher, BytesCompare>)
+        {   return false;   }
+        else
+        {
+            uint64_t idxBlock = 0;
+            item.getBlockSize(offset, &idxBlock);
+            return (idxBlock + 1) * sizeof(digest_type) <= item.digests.size();
+        }
+    }
+
+    /// Ключи первых блоков файлов группы из кэша
+    void loadDigests(const std::vector<DataFile*>& files, std::vector<CacheKey>& cacheKeys, std::vector<size_t>& cntLoaded)
+    {
+        cacheKeys.assign(files.size(), CacheKey());
+        cntLoaded.assign(files.size(), 0);
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            auto& item = *files[i];
+            cacheKeys[i] = CacheKey::make(item.fileStat, item.blockSize, item.maxBlockSize, m_hashAlg);
+
+            // Ключи, уже заданные до сравнения (--resume), длиннее кэша не заменяются
+            const std::string_view digests = m_cache->lookup(cacheKeys[i], sizeof(digest_type));
+            if (digests.size() > item.digests.size())
+            {   item.digests.assign(digests.data(), digests.size());  }
+            cntLoaded[i] = item.digests.size();
+        }
+    }
+
+    /// Сохранение в кэш ключей, вычисленных при сравнении
+    void storeDigests(const std::vector<DataFile*>& files, const std::vector<CacheKey>& cacheKeys, const std::vector<size_t>& cntLoaded)
+    {
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            if (files[i]->digests.size() > cntLoaded[i])
+            {   m_cache->update(cacheKeys[i], sizeof(digest_type), std::move(files[i]->digests));  }
+        }
+    }
+
+    /*!
+        Функция void splitGroup(...)
+        - разбиение группы на подгруппы с одинаковым ключом прочитанного блока.
+        Совпавшие до конца подгруппы - дубликаты, остальные (кроме одиночек)
+        ставятся в очередь groups
+    */
+    void splitGroup(const FileGroup& group, const ReadBlocks& readBlocks, BlockSource& source, std::deque<FileGroup>& groups)
+    {
+        const uint64_t currBlockSize = getCurrBlockSize(group);
+        const uint64_t nextOffset = getNextOffset(*group.files.front(), group.offset);
+        m_keys.resize(std::max(m_keys.size(), group.files.size()));
+
+        std::unordered_map<std::string_view, size_t> idxSubGroups;
+        idxSubGroups.reserve(group.files.size());
+
+        std::vector<FileGroup> subGroups;
+        size_t idxRead = 0;
+        uint64_t cntHashed = 0;
+        for (size_t i = 0; i < group.files.size(); ++i)
+        {
+            auto& item = *group.files[i];
+
+            uint64_t idxBlock = 0;
+            item.getBlockSize(group.offset, &idxBlock);
+
+            ///    5. Получение ключа блока данных выбранным методом
+            std::string_view key;
+            if (hasCachedDigest(item, group.offset))
+            {
+                key = std::string_view(item.digests).substr(idxBlock * sizeof(digest_type), sizeof(digest_type));
+                ioStats.addCacheHit(currBlockSize);
+                item.offset = nextOffset;
+            }
+            else
+            {
+                if (item.isHole(group.offset, currBlockSize))
+                {
+                    key = getZeroKey(currBlockSize);
+                    ioStats.addHole(currBlockSize);
+                }
+                else
+                {
+                    const char* readBlock = readBlocks.data[idxRead++];
+                    if (readBlock == nullptr)
+                    {
+                        if (!item.isChanged)
+                        {   std::cerr << "Error read file " << item.pathToFile << '\n';    }
+                        source.close(item);
+                        continue;
+                    }
+                    ++item.cntReads;
+                    item.bytesRead += currBlockSize;
+
+                    if constexpr (std::is_same_v<Hasher, BytesCompare>)
+                    {   key = std::string_view(readBlock, currBlockSize);   }
+                    else
+                    {
+                        Hasher::hash(readBlock, currBlockSize, m_keys[i]);
+                        key = std::string_view(reinterpret_cast<const char*>(m_keys[i].data()), m_keys[i].size());
+                        ++cntHashed;
+                    }
+                }
+                item.offset = nextOffset;
+
+                if constexpr (!std::is_same_v<Hasher, BytesCompare>)
+                {
+                    if (m_isKeepDigests && (item.digests.size() == idxBlock * sizeof(digest_type))
+                            && (item.digests.size() < BlockDigestCache::kMaxDigests * sizeof(digest_type)))
+                    {   item.digests.append(key);   }
+                }
+            }
+
+            auto itSub = idxSubGroups.emplace(key, subGroups.size());
+            if (itSub.second)
+            {
+                subGroups.emplace_back();
+                subGroups.back().offset = nextOffset;
+                subGroups.back().round = group.round + 1;
+                chainDigest(group.digest, key, subGroups.back().digest);
+            }
+            subGroups[itSub.first->second].files.push_back(&item);
+        }
+        ioStats.addRound(group.round, group.files.size(), subGroups.size(), cntHashed);
+
+        for (auto& subGroup: subGroups)
+        {
+            ///    6. Немедленное прекращение чтения файла, который оказался уникальным
+            if (subGroup.files.size() < 2)
+            {
+                source.close(*subGroup.files.front());
+                continue;
+            }
+
+            if (subGroup.offset == subGroup.files.front()->fileSize)
+            {
+                addDoubles(subGroup, source);
+                continue;
+            }
+
+            groups.push_back(std::move(subGroup));
+        }
+    }
+
+    /// Ключ digest подгруппы: хэш ключа группы prevDigest и ключа блока
+    static void chainDigest(const std::string& prevDigest, std::string_view key, std::string& digest)
+    {
+        if constexpr (!std::is_same_v<Hasher, BytesCompare>)
+        {
+            std::string chain = prevDigest;
+            chain.append(key);
+
+            digest_type result;
+            Hasher::hash(chain.data(), chain.size(), result);
+            digest.assign(reinterpret_cast<const char*>(result.data()), result.size());
+        }
+    }
+
+    void addDoubles(const FileGroup& group, BlockSource& source)
+    {
+        IoStats::GroupStats groupStats;
+        groupStats.fileSize = group.files.front()->fileSize;
+        groupStats.cntFiles = group.files.size();
+
+        std::vector<std::string> paths;
+        for (auto item: group.files)
+        {
+            paths.push_back(item->pathToFile);
+            groupStats.cntReads += item->cntReads;
+            groupStats.bytesRead += item->bytesRead;
+            source.close(*item);
+        }
+        ioStats.addGroup(groupStats);
+
+        (*m_onDoubles)(std::move(paths), group.digest);
+    }
+
+public:
+    DoublesEngine(const Settings& options, size_t maxOpenFiles, BlockDigestCache* cache = nullptr, const std::string& hashAlg = std::string())
+        : m_options(options)
+        , m_cache(std::is_same_v<Hasher, BytesCompare> ? nullptr : cache)
+        , m_hashAlg(hashAlg)
+        , m_openFiles(maxOpenFiles)
+    {}
+
+    /*!
+        Функция find(std::list<DataFile>& openedFiles, const DoublesHandler& onDoubles, ...)
+        - поиск групп файлов-дубликатов среди открытых файлов одного размера,
+        каждая найденная группа передаётся onDoubles, ход сравнения - onProgress
+        (если задан). Ключи блоков, уже записанные в DataFile::digests,
+        не читаются заново. Непустые startGroups - продолжение прерванного
+        сравнения с этих подгрупп вместо всей группы
+    */
+    void find(std::list<DataFile>& openedFiles, const DoublesHandler& onDoubles
+              , const ProgressHandler& onProgress, const std::vector<PendingGroup>& startGroups) override
+    {
+        if (openedFiles.size() < 2)
+        {   return;    }
+        m_onDoubles = &onDoubles;
+
+        std::vector<DataFile*> files;
+        for (auto& item: openedFiles)
+        {   files.push_back(&item);  }
+
+        BlockSource& source = getBlockSource(files.front()->fileSize);
+
+        std::deque<FileGroup> groups;
+        if (startGroups.empty())
+        {
+            groups.emplace_back();
+            groups.back().files = files;
+        }
+        for (const auto& startGroup: startGroups)
+        {
+            groups.emplace_back();
+            FileGroup& group = groups.back();
+            group.offset = startGroup.offset;
+            group.round = static_cast<size_t>(startGroup.round);
+            group.digest = startGroup.digest;
+            for (const uint32_t idxFile: startGroup.files)
+            {
+                files[idxFile]->offset = startGroup.offset;
+                group.files.push_back(files[idxFile]);
+            }
+        }
+
+        if (files.front()->fileSize == 0)
+        {
+            addDoubles(groups.front(), source);
+            return;
+        }
+
+        std::unordered_map<const DataFile*, uint32_t> positions;    // номер файла в openedFiles
+        if (onProgress)
+        {
+            for (size_t i = 0; i < files.size(); ++i)
+            {   positions.emplace(files[i], static_cast<uint32_t>(i));  }
+        }
+
+        files.clear();
+        for (auto itGroup = groups.begin(); itGroup != groups.end();)
+        {
+            prepareFiles(itGroup->files, source);
+            if (itGroup->files.size() < 2)
+            {
+                for (auto item: itGroup->files)
+                {   source.close(*item);    }
+                itGroup = groups.erase(itGroup);
+                continue;
+            }
+            files.insert(files.end(), itGroup->files.begin(), itGroup->files.end());
+            ++itGroup;
+        }
+        if (groups.empty())
+        {   return; }
+
+        // Ключи прочитанных блоков нужны кэшу
+        m_isKeepDigests = (m_cache != nullptr);
+
+        std::vector<CacheKey> cacheKeys;
+        std::vector<size_t> cntLoaded;
+        if (m_cache)
+        {   loadDigests(files, cacheKeys, cntLoaded);   }
+
+        prepareSampleOffsets(*files.front());
+
+        size_t idxReadBlocks = 0;
+        const PendingGroupsFunc getPendingGroups = [this, &groups, &idxReadBlocks, &positions]() {
+            std::vector<PendingGroup> pendingGroups;
+            auto addGroup = [&pendingGroups, &positions](const FileGroup& group) {
+                pendingGroups.push_back({group.offset, group.round, group.digest, {}});
+                for (auto item: group.files)
+                {   pendingGroups.back().files.push_back(positions.at(item));   }
+            };
+            if (m_readBlocks[idxReadBlocks].isSubmitted)
+            {   addGroup(m_readBlocks[idxReadBlocks].group);   }
+            for (const auto& group: groups)
+            {   addGroup(group);    }
+            return pendingGroups;
+        };
+
+        submitGroup(groups, m_readBlocks[idxReadBlocks], source);
+        while (m_readBlocks[idxReadBlocks].isSubmitted)
+        {
+            ReadBlocks& readBlocks = m_readBlocks[idxReadBlocks];
+            if (!readBlocks.files.empty())
+            {
+                source.wait(readBlocks.data);
+                readBlocks.slots.release();
+                addDeviceReads(readBlocks);
+            }
+
+            // Следующая группа читается, пока разбивается текущая
+            idxReadBlocks ^= 1;
+            if (!groups.empty())
+            {   submitGroup(groups, m_readBlocks[idxReadBlocks], source);  }
+
+            splitGroup(readBlocks.group, readBlocks, source, groups);
+            readBlocks.isSubmitted = false;
+            if (onProgress)
+            {   onProgress(getPendingGroups);   }
+
+            if (!m_readBlocks[idxReadBlocks].isSubmitted && !groups.empty())
+            {   submitGroup(groups, m_readBlocks[idxReadBlocks], source);  }
+        }
+
+        if (m_cache)
+        {   storeDigests(files, cacheKeys, cntLoaded);  }
+    }
+};
+
+
+/*!
+    Структура HashAlgorithm - запись реестра алгоритмов хэширования:
+    имя для --hash и создание DoublesEngine для него
+*/
+struct HashAlgorithm
+{
+    using MakeEngineFunc = std::function<std::unique_ptr<DoublesEngineBase>(const Settings&, size_t, BlockDigestCache*)>;
+
+    std::string name;
+    MakeEngineFunc makeEngine;
+};
+
+template <typename Hasher>
+HashAlgorithm makeHashAlgorithm(const std::string& name)
+{
+    return {name, [name](const Settings& options, size_t maxOpenFiles, BlockDigestCache* cache) -> std::unique_ptr<DoublesEngineBase> {
+        return std::make_unique<DoublesEngine<Hasher>>(options, maxOpenFiles, cache, name);
+    }};
+}
+
+/*!
+    Ф-ия получения реестра доступных алгоритмов хэширования.
+    Для crc32 при поддержке процессором выбирается аппаратный расчёт.
+*/
+inline const std::vector<HashAlgorithm>& getHashAlgorithms()
+{
+    static const std::vector<HashAlgorithm> algorithms = [] {
+        std::vector<HashAlgorithm> result;
+        result.push_back(makeHashAlgorithm<Md5Hasher>("md5"));
+        result.push_back(makeHashAlgorithm<Sha1Hasher>("sha1"));
+#if defined(__x86_64__)
+        result.push_back(__builtin_cpu_supports("sse4.2") ? makeHashAlgorithm<Crc32HwHasher>("crc32")
+                                                          : makeHashAlgorithm<Crc32Hasher>("crc32"));
+#else
+        result.push_back(makeHashAlgorithm<Crc32Hasher>("crc32"));
+#endif
+#ifdef BAYAN_WITH_XXHASH
+        result.push_back(makeHashAlgorithm<Xxh3Hasher>("xxh3"));
+        result.push_back(makeHashAlgorithm<Xxh128Hasher>("xxh128"));
+#endif
+#ifdef BAYAN_WITH_BLAKE3
+        result.push_back(makeHashAlgorithm<Blake3Hasher>("blake3"));
+#endif
+        return result;
+    }();
+    return algorithms;
+}
+
+/*!
+    Ф-ия поиска алгоритма хэширования по имени;
+    исключение std::invalid_argument, если алгоритм недоступен
+*/
+inline const HashAlgorithm& findHashAlgorithm(const std::string& name)
+{
+    std::string available;
+    for (const auto& algorithm : getHashAlgorithms())
+    {
+        if (algorithm.name == name)
+        {   return algorithm;   }
+        available += (available.empty() ? "" : ", ") + algorithm.name;
+    }
+    throw std::invalid_argument("Unknown algorithm of hash \"" + name + "\" (available: " + available + ")");
+}
+
+
+/*!
+    Класс DoublesFinder - поиск дубликатов среди файлов одного размера.
+
+    Выбирает DoublesEngine для --cmp и --hash один раз при создании.
+    maxOpenFiles - бюджет открытых файлов этого экземпляра
+    (0 - getMaxOpenFiles() из настроек)
+*/
+class DoublesFinder
+{
+    std::unique_ptr<DoublesEngineBase> m_engine;
+
+public:
+    explicit DoublesFinder(const Settings& options, size_t maxOpenFiles = 0, BlockDigestCache* cache = nullptr)
+    {
+        if (maxOpenFiles == 0)
+        {   maxOpenFiles = (options.getMaxOpenFiles() != 0) ? options.getMaxOpenFiles() : getDefaultMaxOpenFiles();  }
+
+        if (options.getCompareMode() == "bytes")
+        {   m_engine = std::make_unique<DoublesEngine<BytesCompare>>(options, maxOpenFiles);  }
+        else
+        {   m_engine = findHashAlgorithm(options.getHashAlg()).makeEngine(options, maxOpenFiles, cache);  }
+    }
+
+    /*!
+        Функция find(std::list<DataFile>& openedFiles, const DoublesHandler& onDoubles)
+        - поиск групп файлов-дубликатов среди открытых файлов одного размера,
+        каждая группа передаётся onDoubles сразу после подтверждения
+    */
+    void find(std::list<DataFile>& openedFiles, const DoublesEngineBase::DoublesHandler& onDoubles)
+    {   m_engine->find(openedFiles, onDoubles, DoublesEngineBase::ProgressHandler(), {});  }
+
+    /*!
+        Функция find(std::list<DataFile>& openedFiles, const DoublesHandler& onDoubles, ...)
+        - то же с обработчиком хода сравнения onProgress после каждого раунда;
+        непустые startGroups - продолжение сравнения с этих подгрупп
+    */
+    void find(std::list<DataFile>& openedFiles, const DoublesEngineBase::DoublesHandler& onDoubles
+              , const DoublesEngineBase::ProgressHandler& onProgress
+              , const std::vector<DoublesEngineBase::PendingGroup>& startGroups = {})
+    {   m_engine->find(openedFiles, onDoubles, onProgress, startGroups);  }
+
+    /*!
+        Функция find(std::list<DataFile>& openedFiles)
+        - поиск групп файлов-дубликатов среди открытых файлов одного размера
+    */
+    std::vector<std::vector<std::string>> find(std::list<DataFile>& openedFiles)
+    {
+        std::vector<std::vector<std::string>> doubles;
+        m_engine->find(openedFiles, [&doubles](std::vector<std::string>&& paths, const std::string&) {
+            doubles.push_back(std::move(paths));
+        }, DoublesEngineBase::ProgressHandler(), {});
+        return doubles;
+    }
+};
+
+
+/*!
+    Структура DoubleFile - файл группы дубликатов в результате поиска.
+    isHardlink - жёсткая ссылка на файл, идущий в группе раньше
+*/
+struct DoubleFile
+{
+    std::string pathToFile;
+    bool isHardlink = false;
+};
+
+
+/*!
+    Структура DoublesGroup - подтверждённая группа дубликатов: размер файлов,
+    ключ содержимого (пустой для --cmp=bytes и для группы из жёстких ссылок
+    на один файл) и сами файлы
+*/
+struct DoublesGroup
+{
+    uint64_t fileSize = 0;
+    std::string digest;
+    std::vector<DoubleFile> files;
+};
+
+
+/*!
+    Структура SizeGroup - файлы одного размера, свёрнутые по inode:
+    inodes[i] - индексы в fileIndex всех путей одного файла по возрастанию
+    пути (первый - представитель, не зависящий от порядка обхода)
+*/
+struct SizeGroup
+{
+    boost::uintmax_t fileSize = 0;
+    std::vector<std::vector<uint32_t>> inodes;
+};
+
+/*!
+    Класс Checkpoint - контрольные точки поиска (--checkpoint=path) для
+    продолжения прерванного поиска (--resume).
+
+    Файл - журнал: заголовок с отпечатком настроек, от которых зависит
+    результат, и записи с контрольной суммой CRC-32C:
+    индекс обхода (fileIndex, один раз после обхода);
+    выведенная группа дубликатов (индексы файлов в отсортированном по
+    размеру fileIndex), записывается сразу после вывода;
+    завершённая группа одного размера;
+    ход сравнения группы - подгруппы, сравнение которых не закончено:
+    начало следующего блока, ключ прочитанных блоков и файлы. При
+    продолжении сравнение идёт с этих подгрупп без повторного чтения
+    сравненных блоков, в том числе для --cmp=bytes, а уже выведенные
+    группы не сравниваются и не выводятся повторно.
+
+    Записи копятся в буфере, который поток записи сбрасывает в файл с
+    fdatasync() не чаще раза в interval; ход группы тоже записывается не
+    чаще раза в interval, поэтому контрольная точка стоит одной короткой
+    записи, а не всего состояния. Когда устаревшие записи хода занимают
+    больше половины журнала, поток записи переписывает его заново по
+    снимку записей (временный файл и rename()). Потоки сравнения только
+    дописывают записи в буфер и не ждут диска. Испорченный хвост журнала
+    (прерванная запись) при чтении отбрасывается. При успешном окончании
+    поиска файл контрольных точек удаляется.
+*/
+class Checkpoint
+{
+    enum RecordType : uint32_t
+    {
+        kRecordIndex = 1,
+        kRecordDone = 2,
+        kRecordProgress = 3,
+        kRecordGroup = 4
+    };
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        Md5Hasher::digest_type fingerprint;
+    };
+
+    struct RecordHeader
+    {
+        uint32_t type;
+        uint32_t checksum;
+        uint64_t size;
+    };
+
+    /// Состояние группы размера из журнала: ход сравнения (индексы файлов
+    /// в fileIndex) и файлы уже выведенных групп
+    struct RestoredGroup
+    {
+        bool hasProgress = false;
+        std::vector<DoublesEngineBase::PendingGroup> groups;
+        std::unordered_set<uint32_t> reportedFiles;
+    };
+
+    static constexpr char kMagic[8] = {'B', 'A', 'Y', 'A', 'N', 'C', 'P', '\0'};
+    static constexpr uint32_t kVersion = 2;
+    static constexpr uint64_t kMinCompactSize = 1024 * 1024;
+
+    const std::string m_pathToCheckpoint;
+    const std::chrono::steady_clock::duration m_interval;
+    Md5Hasher::digest_type m_fingerprint{};
+
+    std::mutex m_mutex;
+    std::condition_variable m_cvWrite;
+    std::thread m_writer;
+    bool m_isStopped = false;
+    std::exception_ptr m_error;
+    std::string m_buffer;
+    std::chrono::steady_clock::time_point m_timeFlush;
+
+    // Только поток записи (или до его запуска)
+    int m_handle = -1;
+    uint64_t m_bytesJournal = 0;
+    uint64_t m_bytesIndex = 0;
+
+    std::unordered_set<uint64_t> m_doneSizes;
+    std::vector<std::pair<RecordType, std::string>> m_records;
+    std::unordered_map<uint64_t, std::string> m_progressRecords;
+    uint64_t m_bytesLive = 0;
+    std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> m_timeProgress;
+    std::unordered_map<uint64_t, RestoredGroup> m_restored;
+
+    static uint32_t getChecksum(std::string_view payload)
+    {
+        Crc32Hasher::crc_type crc;
+        crc.process_bytes(payload.data(), payload.size());
+        return crc.checksum();
+    }
+
+    static void appendRecord(std::string& out, RecordType type, std::string_view payload)
+    {
+        appendBinary(out, RecordHeader{type, getChecksum(payload), payload.size()});
+        out.append(payload.data(), payload.size());
+    }
+
+    /// Отпечаток настроек, от которых зависят индекс и ключи блоков
+    static Md5Hasher::digest_type getFingerprint(const Settings& options)
+    {
+        std::string text;
+        auto add = [&text](std::string_view value) {
+            appendBinary(text, value);
+        };
+        for (const auto& pathForScan : options.getPathsForScan())
+        {   add(pathForScan);   }
+        add("--unsc");
+        for (const auto& pathForUnScan : options.getPathsForUnScan())
+        {   add(pathForUnScan); }
+        add("--mask");
+        for (const auto& mask : options.getMasksForScan())
+        {   add(mask);  }
+        add(std::to_string(options.getDepthScan()) + ' ' + std::to_string(options.getMinimalSizeOfFile())
+            + ' ' + std::to_string(options.isMaskRegex()) + ' ' + std::to_string(options.getSizeOfBlock())
+            + ' ' + std::to_string(options.getMaxSizeOfBlock()) + ' ' + std::to_string(options.isSample()));
+        add(options.getHashAlg());
+        add(options.getCompareMode());
+        add(options.getHardlinks());
+        return getHash<Md5Hasher>(text.data(), text.size());
+    }
+
+    std::string getHeader() const
+    {
+        Header header{};
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.fingerprint = m_fingerprint;
+
+        std::string result;
+        appendBinary(result, header);
+        return result;
+    }
+
+    void writeFull(const std::string& data) const
+    {
+        for (size_t pos = 0; pos < data.size();)
+        {
+            const ssize_t result = ::write(m_handle, data.data() + pos, data.size() - pos);
+            if ((result < 0) && (errno == EINTR))
+            {   continue;   }
+            if (result <= 0)
+            {   throw std::runtime_error("Error write checkpoint " + m_pathToCheckpoint + ": " + std::strerror(errno));  }
+            pos += static_cast<size_t>(result);
+        }
+    }
+
+    /// Живые записи журнала (кроме индекса) - снимок для compact()
+    std::string getRecords() const
+    {
+        std::string records;
+        records.reserve(m_bytesLive);
+        for (const auto& record : m_records)
+        {   appendRecord(records, record.first, record.second); }
+        for (const auto& item : m_progressRecords)
+        {   appendRecord(records, kRecordProgress, item.second);  }
+        return records;
+    }
+
+    void addLive(RecordType type, std::string&& payload)
+    {
+        m_bytesLive += payload.size() + sizeof(RecordHeader);
+        appendRecord(m_buffer, type, payload);
+        m_records.emplace_back(type, std::move(payload));
+    }
+
+    /*!
+        Функция void compact(const std::string& records)
+        - запись журнала заново: индекс и живые записи records; файл
+        заменяется атомарно
+    */
+    void compact(const std::string& records)
+    {
+        std::string journal = getHeader();
+        std::string index;
+        fileIndex.save(index);
+        appendRecord(journal, kRecordIndex, index);
+        m_bytesIndex = index.size() + sizeof(RecordHeader);
+        journal.append(records);
+
+        const std::string pathToTemp = m_pathToCheckpoint + ".tmp." + std::to_string(::getpid());
+        if (m_handle != -1)
+        {   ::close(m_handle);  }
+        m_handle = ::open(pathToTemp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (m_handle == -1)
+        {   throw std::runtime_error("Error write checkpoint " + pathToTemp + ": " + std::strerror(errno));  }
+
+        writeFull(journal);
+        if ((::fdatasync(m_handle) != 0) || (::rename(pathToTemp.c_str(), m_pathToCheckpoint.c_str()) != 0))
+        {
+            ::unlink(pathToTemp.c_str());
+            throw std::runtime_error("Error write checkpoint " + m_pathToCheckpoint + ": " + std::strerror(errno));
+        }
+        m_bytesJournal = journal.size();
+    }
+
+    /*!
+        Функция void flush(std::unique_lock<std::mutex>& lock)
+        - сброс накопленных записей: дописывание в журнал или, если в нём
+        больше половины устаревших записей, запись заново. Диск - без
+        блокировки, потоки сравнения тем временем пишут в новый буфер
+    */
+    void flush(std::unique_lock<std::mutex>& lock)
+    {
+        if (m_buffer.empty())
+        {   return; }
+
+        const bool isCompact = (m_bytesJournal + m_buffer.size() > std::max(kMinCompactSize, 2 * (m_bytesIndex + m_bytesLive)));
+        std::string data;
+        if (isCompact)
+        {   data = getRecords();    }
+        else
+        {   data.swap(m_buffer);    }
+        m_buffer.clear();
+
+        lock.unlock();
+        if (isCompact)
+        {   compact(data);  }
+        else
+        {
+            writeFull(data);
+            ::fdatasync(m_handle);
+            m_bytesJournal += data.size();
+        }
+        lock.lock();
+        m_timeFlush = std::chrono::steady_clock::now();
+    }
+
+    /// Поток записи: сброс буфера не чаще раза в m_interval, при остановке - сразу
+    void writeLoop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            m_cvWrite.wait(lock, [this]() { return m_isStopped || !m_buffer.empty(); });
+            m_cvWrite.wait_until(lock, m_timeFlush + m_interval, [this]() { return m_isStopped; });
+            try
+            {   flush(lock);    }
+            catch (...)
+            {
+                if (!lock.owns_lock())
+                {   lock.lock();    }
+                m_error = std::current_exception();
+                return;
+            }
+            // Записи, добавленные во время последнего сброса, тоже сбрасываются
+            if (m_isStopped && m_buffer.empty())
+            {   return; }
+        }
+    }
+
+    void startWriter()
+    {
+        m_timeFlush = std::chrono::steady_clock::now();
+        m_writer = std::thread(&Checkpoint::writeLoop, this);
+    }
+
+    /// Остановка потока записи с последним сбросом буфера
+    void stopWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_isStopped = true;
+        }
+        m_cvWrite.notify_one();
+        if (m_writer.joinable())
+        {   m_writer.join();    }
+    }
+
+    /// Ошибка записи журнала передаётся потоку сравнения (под m_mutex)
+    void checkError() const
+    {
+        if (m_error)
+        {   std::rethrow_exception(m_error);  }
+    }
+
+    /// Файл idxFile fileIndex не изменился с обхода
+    static bool isUnchanged(uint32_t idxFile)
+    {
+        const FileStat oldStat = fileIndex.getFileStat(idxFile);
+        struct stat fileStat{};
+        ioStats.addStat();
+        if (::stat(fileIndex.getPath(idxFile).c_str(), &fileStat) != 0)
+        {   return false;   }
+        const FileStat newStat = FileStat::fromStat(fileStat);
+        return (newStat.size == oldStat.size) && (newStat.dev == oldStat.dev) && (newStat.ino == oldStat.ino)
+                && (newStat.mtimeNs == oldStat.mtimeNs) && (newStat.ctimeNs == oldStat.ctimeNs);
+    }
+
+    /// Разбор записи при чтении журнала; false - запись повреждена
+    bool loadRecord(uint32_t type, std::string_view payload, const std::function<void(DoublesGroup&& group)>& onGroup)
+    {
+        if (type == kRecordIndex)
+        {
+            fileIndex.clear();
+            if (!fileIndex.load(payload))
+            {   return false;   }
+            // Файлы в записях - в порядке после сортировки по размеру (устойчивой)
+            fileIndex.sortBySize();
+            return true;
+        }
+
+        uint64_t fileSize = 0;
+        std::string_view in = payload;
+        if (!readBinary(in, fileSize))
+        {   return false;   }
+
+        if (type == kRecordGroup)
+        {
+            DoublesGroup group{fileSize, std::string(), {}};
+            uint32_t cntFiles = 0;
+            if (!readBinary(in, group.digest) || !readBinary(in, cntFiles))
+            {   return false;   }
+            std::vector<uint32_t> files;
+            for (uint32_t i = 0; i < cntFiles; ++i)
+            {
+                uint32_t idxFile = 0;
+                uint8_t isHardlink = 0;
+                if (!readBinary(in, idxFile) || !readBinary(in, isHardlink) || (idxFile >= fileIndex.size()))
+                {   return false;   }
+                group.files.push_back({fileIndex.getPath(idxFile), isHardlink != 0});
+                files.push_back(idxFile);
+            }
+            onGroup(std::move(group));
+
+            m_restored[fileSize].reportedFiles.insert(files.begin(), files.end());
+            m_bytesLive += payload.size() + sizeof(RecordHeader);
+            m_records.emplace_back(kRecordGroup, payload);
+            return true;
+        }
+
+        if (type == kRecordDone)
+        {
+            m_doneSizes.insert(fileSize);
+            m_bytesLive += payload.size() + sizeof(RecordHeader);
+            m_records.emplace_back(kRecordDone, payload);
+            m_progressRecords.erase(fileSize);
+            m_restored.erase(fileSize);
+            return true;
+        }
+
+        if (type == kRecordProgress)
+        {
+            uint32_t count = 0;
+            if (!readBinary(in, count))
+            {   return false;   }
+            std::vector<DoublesEngineBase::PendingGroup> groups(count);
+            for (auto& group : groups)
+            {
+                uint32_t cntFiles = 0;
+                if (!readBinary(in, group.offset) || !readBinary(in, group.round) || !readBinary(in, group.digest)
+                        || !readBinary(in, cntFiles) || (group.offset > fileSize))
+                {   return false;   }
+                group.files.resize(cntFiles);
+                for (auto& idxFile : group.files)
+                {
+                    if (!readBinary(in, idxFile) || (idxFile >= fileIndex.size()))
+                    {   return false;   }
+                }
+            }
+            auto& restored = m_restored[fileSize];
+            restored.hasProgress = true;
+            restored.groups = std::move(groups);
+            m_progressRecords[fileSize] = std::string(payload);
+            return true;
+        }
+        return false;
+    }
+
+public:
+    static constexpr std::chrono::seconds kInterval{5};
+
+    Checkpoint(const std::string& pathToCheckpoint, const Settings& options
+               , std::chrono::steady_clock::duration interval = kInterval)
+        : m_pathToCheckpoint(pathToCheckpoint)
+        , m_interval(interval)
+        , m_fingerprint(getFingerprint(options))
+    {}
+
+    /// Прерванный поиск (исключение): накопленные записи сохраняются
+    ~Checkpoint()
+    {
+        stopWriter();
+        if (m_error)
+        {
+            try
+            {   std::rethrow_exception(m_error);    }
+            catch (const std::exception& except)
+            {   std::cerr << except.what() << '\n';   }
+        }
+        if (m_handle != -1)
+        {   ::close(m_handle);  }
+    }
+
+    Checkpoint(const Checkpoint&) = delete;
+    Checkpoint& operator=(const Checkpoint&) = delete;
+
+    /*!
+        Функция bool load(...)
+        - чтение журнала: индекс обхода в fileIndex, выведенные группы
+        дубликатов - в onGroup, ход незавершённых групп - для restore().
+        false - контрольной точки нет.
+        Исключение std::invalid_argument, если журнал записан с другими настройками
+    */
+    bool load(const std::function<void(DoublesGroup&& group)>& onGroup)
+    {
+        std::ifstream in(m_pathToCheckpoint, std::ios::binary);
+        if (!in)
+        {   return false;   }
+        const std::string journal((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+        std::string_view data = journal;
+        Header header{};
+        if (!readBinary(data, header) || (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0)
+                || (header.version != kVersion))
+        {   throw std::invalid_argument("Checkpoint " + m_pathToCheckpoint + " has unknown format"); }
+        if (header.fingerprint != m_fingerprint)
+        {   throw std::invalid_argument("Checkpoint " + m_pathToCheckpoint + " was written with other options of scan or compare"); }
+
+        bool isIndex = false;
+        RecordHeader record{};
+        while (readBinary(data, record) && (data.size() >= record.size))
+        {
+            const std::string_view payload = data.substr(0, record.size);
+            data.remove_prefix(record.size);
+            if ((getChecksum(payload) != record.checksum) || (!isIndex && (record.type != kRecordIndex))
+                    || !loadRecord(record.type, payload, onGroup))
+            {   break;  }
+            isIndex = true;
+        }
+        if (!isIndex)
+        {   return false;   }
+
+        for (const auto& item : m_progressRecords)
+        {   m_bytesLive += item.second.size() + sizeof(RecordHeader);  }
+        compact(getRecords());
+        startWriter();
+        return true;
+    }
+
+    /*!
+        Функция void start()
+        - начало журнала после обхода: индекс fileIndex
+    */
+    void start()
+    {
+        m_doneSizes.clear();
+        m_records.clear();
+        m_progressRecords.clear();
+        m_restored.clear();
+        m_bytesLive = 0;
+        compact(std::string());
+        startWriter();
+    }
+
+    /// Группа размера fileSize уже сравнена до прерывания
+    bool isDone(uint64_t fileSize) const
+    {   return m_doneSizes.count(fileSize) != 0;  }
+
+    /*!
+        Функция bool restore(...)
+        - состояние группы размера fileSize до прерывания: groups - подгруппы,
+        сравнение которых не закончено (файлы - индексы в fileIndex; файлы,
+        изменившиеся с тех пор, исключены), reportedFiles - файлы уже
+        выведенных групп. false - хода сравнения нет, группа сравнивается
+        с начала (кроме reportedFiles)
+    */
+    bool restore(uint64_t fileSize, std::vector<DoublesEngineBase::PendingGroup>& groups
+                 , std::unordered_set<uint32_t>& reportedFiles)
+    {
+        RestoredGroup restored;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            const auto itRestored = m_restored.find(fileSize);
+            if (itRestored == m_restored.end())
+            {   return false;   }
+            restored = std::move(itRestored->second);
+            m_restored.erase(itRestored);
+        }
+
+        groups.clear();
+        for (auto& group : restored.groups)
+        {
+            auto& files = group.files;
+            files.erase(std::remove_if(files.begin(), files.end(), [&restored](uint32_t idxFile) {
+                return (restored.reportedFiles.count(idxFile) != 0) || !isUnchanged(idxFile);
+            }), files.end());
+            if (files.size() >= 2)
+            {   groups.push_back(std::move(group)); }
+        }
+        reportedFiles = std::move(restored.reportedFiles);
+        return restored.hasProgress;
+    }
+
+    /// Пора ли записать ход сравнения группы размера fileSize
+    bool isProgressDue(uint64_t fileSize)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto now = std::chrono::steady_clock::now();
+        auto itTime = m_timeProgress.emplace(fileSize, now).first;
+        if (now - itTime->second < m_interval)
+        {   return false;   }
+        itTime->second = now;
+        return true;
+    }
+
+    /*!
+        Функция void addProgress(...)
+        - запись хода сравнения группы размера fileSize: подгруппы, сравнение
+        которых не закончено (файлы - индексы в fileIndex)
+    */
+    void addProgress(uint64_t fileSize, const std::vector<DoublesEngineBase::PendingGroup>& groups)
+    {
+        std::string payload;
+        appendBinary(payload, fileSize);
+        appendBinary(payload, static_cast<uint32_t>(groups.size()));
+        for (const auto& group : groups)
+        {
+            appendBinary(payload, group.offset);
+            appendBinary(payload, group.round);
+            appendBinary(payload, std::string_view(group.digest));
+            appendBinary(payload, static_cast<uint32_t>(group.files.size()));
+            for (const uint32_t idxFile : group.files)
+            {   appendBinary(payload, idxFile); }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            checkError();
+            appendRecord(m_buffer, kRecordProgress, payload);
+            std::string& record = m_progressRecords[fileSize];
+            m_bytesLive -= record.empty() ? 0 : (record.size() + sizeof(RecordHeader));
+            m_bytesLive += payload.size() + sizeof(RecordHeader);
+            record = std::move(payload);
+        }
+        m_cvWrite.notify_one();
+    }
+
+    /*!
+        Функция void addGroup(...)
+        - запись выведенной группы дубликатов размера fileSize: ключ
+        содержимого и файлы (индекс в fileIndex, признак жёсткой ссылки)
+    */
+    void addGroup(uint64_t fileSize, std::string_view digest, const std::vector<std::pair<uint32_t, bool>>& files)
+    {
+        std::string payload;
+        appendBinary(payload, fileSize);
+        appendBinary(payload, digest);
+        appendBinary(payload, static_cast<uint32_t>(files.size()));
+        for (const auto& file : files)
+        {
+            appendBinary(payload, file.first);
+            appendBinary(payload, static_cast<uint8_t>(file.second));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            checkError();
+            addLive(kRecordGroup, std::move(payload));
+        }
+        m_cvWrite.notify_one();
+    }
+
+    /*!
+        Функция void addDone(uint64_t fileSize)
+        - запись завершённой группы размера fileSize (её группы дубликатов
+        уже записаны addGroup())
+    */
+    void addDone(uint64_t fileSize)
+    {
+        std::string payload;
+        appendBinary(payload, fileSize);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            checkError();
+            addLive(kRecordDone, std::move(payload));
+            const auto itProgress = m_progressRecords.find(fileSize);
+            if (itProgress != m_progressRecords.end())
+            {
+                m_bytesLive -= itProgress->second.size() + sizeof(RecordHeader);
+                m_progressRecords.erase(itProgress);
+            }
+            m_timeProgress.erase(fileSize);
+        }
+        m_cvWrite.notify_one();
+    }
+
+    /*!
+        Функция void finish()
+        - поиск завершён: файл контрольных точек больше не нужен
+    */
+    void finish()
+    {
+        stopWriter();
+        if (m_handle != -1)
+        {
+            ::close(m_handle);
+            m_handle = -1;
+        }
+        ::unlink(m_pathToCheckpoint.c_str());
+    }
+};
+
+/*!
+    Ф-ия сбора группы из файлов [begin, end) индекса index одного размера
+    со сворачиванием путей с одинаковыми (st_dev, st_ino). Один и тот же
+    путь, найденный дважды (вложенные корни сканирования), остаётся один
+    раз и не считается жёсткой ссылкой на себя
+*/
+SizeGroup makeSizeGroup(const FileIndex& index, size_t begin, size_t end)
+{
+    SizeGroup sizeGroup;
+    sizeGroup.fileSize = index.getSize(begin);
+
+    std::map<std::pair<uint64_t, uint64_t>, size_t> idxInodes;
+    for (size_t idxFile = begin; idxFile < end; ++idxFile)
+    {
+        const FileStat fileStat = index.getFileStat(idxFile);
+        const auto itInode = idxInodes.emplace(std::make_pair(fileStat.dev, fileStat.ino), sizeGroup.inodes.size());
+        if (itInode.second)
+        {   sizeGroup.inodes.emplace_back();  }
+        sizeGroup.inodes[itInode.first->second].push_back(static_cast<uint32_t>(idxFile));
+    }
+    for (auto& links : sizeGroup.inodes)
+    {
+        if (links.size() > 1)
+        {
+            std::sort(links.begin(), links.end(), [&index](uint32_t lhs, uint32_t rhs) {
+                return index.getPath(lhs) < index.getPath(rhs);
+            });
+            links.erase(std::unique(links.begin(), links.end(), [&index](uint32_t lhs, uint32_t rhs) {
+                return index.getPath(lhs) == index.getPath(rhs);
+            }), links.end());
+        }
+    }
+    return sizeGroup;
+}
+
+/*!
+    Ф-ия сравнения файлов группы sizeGroup индекса index: каждая группа
+    дубликатов (с жёсткими ссылками представителей) передаётся onGroup,
+    при isHardlinkDoubles - и набор ссылок на файл без других дубликатов.
+    С checkpoint (только для index = fileIndex) сравнение продолжается с
+    подгрупп, не законченных до прерывания, уже выведенные группы
+    пропускаются; ход, каждая выведенная группа и конец группы
+    записываются в него
+*/
+void compareSizeGroup(const Settings& options, DoublesFinder& finder, const FileIndex& index
+                      , const SizeGroup& sizeGroup, bool isHardlinkDoubles
+                      , const std::function<void(DoublesGroup&& group)>& onGroup
+                      , Checkpoint* checkpoint = nullptr)
+{
+    std::vector<DoublesEngineBase::PendingGroup> startGroups;
+    std::unordered_set<uint32_t> reportedFiles;
+    const bool hasProgress = checkpoint && checkpoint->restore(sizeGroup.fileSize, startGroups, reportedFiles);
+
+    std::vector<bool> isReported(sizeGroup.inodes.size(), false);
+    std::list<DataFile> openedFiles;
+    std::vector<size_t> idxInodes;                          // inode файла openedFiles
+    std::unordered_map<std::string, size_t> idxByPath;
+    std::unordered_map<uint32_t, uint32_t> positions;       // индекс в index -> номер в openedFiles
+    for (size_t i = 0; i < sizeGroup.inodes.size(); ++i)
+    {
+        const uint32_t idxFile = sizeGroup.inodes[i].front();
+        if (reportedFiles.count(idxFile) != 0)
+        {
+            isReported[i] = true;
+            continue;
+        }
+        positions.emplace(idxFile, static_cast<uint32_t>(idxInodes.size()));
+        openedFiles.emplace_back(index.getPath(idxFile), index.getFileStat(idxFile)
+                                 , options.getSizeOfBlock(), options.getMaxSizeOfBlock());
+        idxByPath.emplace(openedFiles.back().pathToFile, i);
+        idxInodes.push_back(i);
+    }
+
+    for (auto itGroup = startGroups.begin(); itGroup != startGroups.end();)
+    {
+        std::vector<uint32_t> files;
+        for (const uint32_t idxFile : itGroup->files)
+        {
+            const auto itPosition = positions.find(idxFile);
+            if (itPosition != positions.end())
+            {   files.push_back(itPosition->second);  }
+        }
+        itGroup->files = std::move(files);
+        itGroup = (itGroup->files.size() < 2) ? startGroups.erase(itGroup) : std::next(itGroup);
+    }
+
+    DoublesEngineBase::ProgressHandler onProgress;
+    if (checkpoint)
+    {
+        onProgress = [&](const DoublesEngineBase::PendingGroupsFunc& getGroups) {
+            if (!checkpoint->isProgressDue(sizeGroup.fileSize))
+            {   return; }
+
+            std::vector<DoublesEngineBase::PendingGroup> groups = getGroups();
+            for (auto& group : groups)
+            {
+                for (auto& idxFile : group.files)
+                {   idxFile = sizeGroup.inodes[idxInodes[idxFile]].front();  }
+            }
+            checkpoint->addProgress(sizeGroup.fileSize, groups);
+        };
+    }
+
+    ///    3-6. Поблочное сравнение файлов с уточнением разбиения на группы
+    if (!hasProgress || !startGroups.empty())
+    {
+        finder.find(openedFiles, [&](std::vector<std::string>&& paths, const std::string& digest) {
+            DoublesGroup group{sizeGroup.fileSize, digest, {}};
+            std::vector<std::pair<uint32_t, bool>> files;
+            for (const auto& pathToFile: paths)
+            {
+                const size_t idxInode = idxByPath.at(pathToFile);
+                isReported[idxInode] = true;
+                const auto& links = sizeGroup.inodes[idxInode];
+                for (size_t i = 0; i < links.size(); ++i)
+                {
+                    group.files.push_back({index.getPath(links[i]), (i != 0)});
+                    files.emplace_back(links[i], (i != 0));
+                }
+            }
+            onGroup(std::move(group));
+            if (checkpoint)
+            {   checkpoint->addGroup(sizeGroup.fileSize, digest, files);    }
+        }, onProgress, startGroups);
+    }
+
+    ///    Жёсткие ссылки на файл без других дубликатов
+    for (size_t i = 0; isHardlinkDoubles && (i < sizeGroup.inodes.size()); ++i)
+    {
+        if (isReported[i] || (sizeGroup.inodes[i].size() < 2))
+        {   continue;   }
+
+        DoublesGroup group{sizeGroup.fileSize, std::string(), {}};
+        std::vector<std::pair<uint32_t, bool>> files;
+        for (const auto& link: sizeGroup.inodes[i])
+        {
+            files.emplace_back(link, !group.files.empty());
+            group.files.push_back({index.getPath(link), !group.files.empty()});
+        }
+        onGroup(std::move(group));
+        if (checkpoint)
+        {   checkpoint->addGroup(sizeGroup.fileSize, std::string_view(), files);   }
+    }
+
+    if (checkpoint)
+    {   checkpoint->addDone(sizeGroup.fileSize);    }
+}
+
+
+/*!
+    Ф-ия поиска дубликатов во всех группах файлов одного размера из fileIndex.
+
+    Пути с одинаковыми (st_dev, st_ino) сворачиваются в один файл до
+    сравнения, поэтому каждый физический файл читается один раз. В
+    результате за представителем следуют его жёсткие ссылки с пометкой
+    isHardlink. При --hardlinks=dup набор ссылок на один файл сам по себе
+    считается группой дубликатов, при --hardlinks=ignore - нет.
+
+    Группы независимы и обрабатываются пулом из getCntThreads() потоков,
+    у каждого потока свой DoublesFinder (буферы, источники блоков и доля
+    бюджета открытых файлов). Потоки берут группы начиная с самых больших
+    по объёму, чтобы закончить работу примерно одновременно. Каждая группа
+    дубликатов передаётся onGroup сразу после подтверждения, не дожидаясь
+    остальных; вызовы onGroup не пересекаются. С --cache (или с переданным
+    cache) потоки пользуются общим BlockDigestCache, который сохраняется
+    после сравнения. С checkpoint группы размера, сравненные до прерывания,
+    пропускаются, а ход и результат остальных записываются в него.
+*/
+void findDoubles(const Settings& options, const std::function<void(DoublesGroup&& group)>& onGroup
+                 , BlockDigestCache* cache = nullptr, Checkpoint* checkpoint = nullptr)
+{
+    std::vector<SizeGroup> sizeGroups;
+    std::vector<size_t> order;
+    {
+        const PhaseTimer phaseTimer(IoStats::kPhaseGroup);
+
+        ///    2 б). Исколючение из поиска файлов, которые "уникальны" по размеру
+        ///    за один проход по индексу, отсортированному по размеру
+        fileIndex.sortBySize();
+
+        for (size_t begin = 0, end = 0; begin < fileIndex.size(); begin = end)
+        {
+            const uint64_t fileSize = fileIndex.getSize(begin);
+            for (end = begin + 1; (end < fileIndex.size()) && (fileIndex.getSize(end) == fileSize); ++end)
+            {}
+
+            if ((end - begin < 2) || (checkpoint && checkpoint->isDone(fileSize)))
+            {   continue;   }
+
+            sizeGroups.push_back(makeSizeGroup(fileIndex, begin, end));
+            ioStats.addCandidates(sizeGroups.back().inodes.size(), fileSize);
+        }
+
+        order.resize(sizeGroups.size());
+        for (size_t i = 0; i < order.size(); ++i)
+        {   order[i] = i;   }
+        std::stable_sort(order.begin(), order.end(), [&sizeGroups](size_t lhs, size_t rhs) {
+            return (sizeGroups[lhs].fileSize * sizeGroups[lhs].inodes.size())
+                    > (sizeGroups[rhs].fileSize * sizeGroups[rhs].inodes.size());
+        });
+    }
+
+    const PhaseTimer phaseTimer(IoStats::kPhaseCompare);
+
+    const size_t cntThreads = std::min(getCntThreads(options), std::max<size_t>(1, sizeGroups.size()));
+    const size_t maxOpenFiles = (options.getMaxOpenFiles() != 0) ? options.getMaxOpenFiles() : getDefaultMaxOpenFiles();
+    const bool isHardlinkDoubles = (options.getHardlinks() == "dup");
+
+    std::unique_ptr<BlockDigestCache> ownCache;
+    if ((cache == nullptr) && !options.getCachePath().empty() && (options.getCompareMode() != "bytes"))
+    {
+        ownCache = std::make_unique<BlockDigestCache>(options.getCachePath());
+        cache = ownCache.get();
+    }
+
+    std::atomic<size_t> idxNext{0};
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    std::mutex groupMutex;
+
+    const std::function<void(DoublesGroup&& group)> emitGroup = [&onGroup, &groupMutex](DoublesGroup&& group) {
+        std::lock_guard<std::mutex> lock(groupMutex);
+        onGroup(std::move(group));
+    };
+
+    auto worker = [&]() {
+        DoublesFinder finder(options, std::max<size_t>(1, maxOpenFiles / cntThreads), cache);
+        for (size_t idx = idxNext++; idx < order.size(); idx = idxNext++)
+        {
+            try
+            {
+                compareSizeGroup(options, finder, fileIndex, sizeGroups[order[idx]], isHardlinkDoubles, emitGroup, checkpoint);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error)
+                {   error = std::current_exception();   }
+                idxNext = order.size();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < cntThreads; ++i)
+    {   threads.emplace_back(worker);  }
+    worker();
+    for (auto& thread : threads)
+    {   thread.join();  }
+
+    if (error)
+    {   std::rethrow_exception(error);  }
+
+    if (cache)
+    {   cache->save();  }
+}
+
+/*!
+    Ф-ия поиска дубликатов во всех группах файлов одного размера из fileIndex
+    - все группы дубликатов одним результатом (в порядке подтверждения)
+*/
+std::vector<std::vector<DoubleFile>> findDoubles(const Settings& options)
+{
+    std::vector<std::vector<DoubleFile>> doubles;
+    findDoubles(options, [&doubles](DoublesGroup&& group) {
+        doubles.push_back(std::move(group.files));
+    });
+    return doubles;
+}
+
+
+/*!
+    Класс ShardChannel - сообщения между координатором и процессом поиска
+    --shards через локальный сокет: заголовок (тип, длина) и содержимое.
+
+    Процесс читает и пишет блокирующими вызовами (send(), wait());
+    send() с обработчиком, пока сокет не принимает, разбирает встречные
+    сообщения, поэтому два процесса, пересылающие файлы друг другу, не
+    ждут друг друга. Координатор обслуживает все процессы одним циклом
+    poll() по неблокирующим сокетам: post() ставит сообщение в очередь,
+    flush() отправляет, сколько примет сокет, receive() и takeMessage()
+    разбирают принятое. Поэтому пересылка файлов между процессами никогда
+    не блокирует координатор.
+*/
+class ShardChannel
+{
+public:
+    enum MessageType : uint32_t
+    {
+        kSettings = 1,  ///< координатор: номер процесса, число процессов, настройки
+        kReady,         ///< процесс: готов к заданию обхода
+        kWalkTask,      ///< координатор: уровень, признак "только файлы", директория
+        kWalkDone,      ///< координатор: заданий обхода больше нет
+        kSizes,         ///< процесс: размеры найденных файлов и число файлов каждого (частями)
+        kSizesDone,     ///< процесс: размеры отправлены
+        kPartition,     ///< координатор: границы диапазонов размеров и признаки кандидатов
+        kFiles,         ///< файлы диапазона другого процесса (процесс - с номером владельца)
+        kFilesDone,     ///< процесс: файлы отправлены; координатор: все файлы доставлены
+        kGroup,         ///< процесс: группа дубликатов
+        kDone,          ///< процесс: сравнение закончено, найдено файлов, объём индекса, счётчики ioStats
+        kError          ///< процесс: текст ошибки
+    };
+
+private:
+    struct Header
+    {
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t size;
+    };
+
+    static constexpr uint64_t kMaxMessageSize = 1ULL << 30;
+
+    int m_handle = -1;
+    std::string m_input;
+    size_t m_inputPos = 0;
+    std::string m_output;
+    size_t m_outputPos = 0;
+
+    /// Ожидание готовности сокета к событиям events (poll())
+    short waitHandle(short events) const
+    {
+        struct pollfd handle = {m_handle, events, 0};
+        while (::poll(&handle, 1, -1) < 0)
+        {
+            if (errno != EINTR)
+            {   throw std::runtime_error(std::string("Error wait for shard: ") + std::strerror(errno));   }
+        }
+        return handle.revents;
+    }
+
+public:
+    using MessageHandler = std::function<void(MessageType type, std::string& payload)>;
+
+    explicit ShardChannel(int handle)
+        : m_handle(handle)
+    {}
+
+    ~ShardChannel()
+    {   close();    }
+
+    ShardChannel(const ShardChannel&) = delete;
+    ShardChannel& operator=(const ShardChannel&) = delete;
+
+    int getHandle() const
+    {   return m_handle;    }
+
+    void close()
+    {
+        if (m_handle != -1)
+        {
+            ::close(m_handle);
+            m_handle = -1;
+        }
+    }
+
+    bool hasOutput() const
+    {   return m_outputPos < m_output.size();  }
+
+    /// Объём очереди отправки
+    size_t getOutputSize() const
+    {   return m_output.size() - m_outputPos;  }
+
+    /// Постановка сообщения в очередь отправки
+    void post(MessageType type, std::string_view payload)
+    {
+        if (m_outputPos > m_output.size() / 2)
+        {
+            m_output.erase(0, m_outputPos);
+            m_outputPos = 0;
+        }
+        appendBinary(m_output, Header{type, 0, payload.size()});
+        m_output.append(payload.data(), payload.size());
+    }
+
+    /// Отправка очереди, сколько примет сокет (не блокируясь)
+    void flush()
+    {
+        while (hasOutput())
+        {
+            const ssize_t result = ::send(m_handle, m_output.data() + m_outputPos, getOutputSize(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            if ((result < 0) && (errno == EINTR))
+            {   continue;   }
+            if ((result < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+            {   return; }
+            if (result <= 0)
+            {   throw std::runtime_error(std::string("Error write to shard: ") + std::strerror(errno));  }
+            m_outputPos += static_cast<size_t>(result);
+        }
+        m_output.clear();
+        m_outputPos = 0;
+    }
+
+    /// Отправка сообщения целиком (блокирующий сокет)
+    void send(MessageType type, std::string_view payload)
+    {
+        post(type, payload);
+        for (flush(); hasOutput(); flush())
+        {   waitHandle(POLLOUT);   }
+    }
+
+    /*!
+        Функция void send(MessageType type, std::string_view payload, const MessageHandler& onMessage)
+        - отправка сообщения целиком; пока сокет не принимает, принятые
+        встречные сообщения передаются onMessage
+    */
+    void send(MessageType type, std::string_view payload, const MessageHandler& onMessage)
+    {
+        post(type, payload);
+        for (flush(); hasOutput(); flush())
+        {
+            if (!(waitHandle(POLLIN | POLLOUT) & (POLLIN | POLLHUP | POLLERR)))
+            {   continue;   }
+            if (!receive())
+            {   throw std::runtime_error("Shard channel closed by other side"); }
+            MessageType inputType;
+            std::string inputPayload;
+            while (takeMessage(inputType, inputPayload))
+            {   onMessage(inputType, inputPayload);    }
+        }
+    }
+
+    /// Приём данных одним вызовом recv(); false - сокет закрыт другой стороной
+    bool receive()
+    {
+        if (m_inputPos > m_input.size() / 2)
+        {
+            m_input.erase(0, m_inputPos);
+            m_inputPos = 0;
+        }
+
+        char buffer[64 * 1024];
+        for (;;)
+        {
+            const ssize_t result = ::recv(m_handle, buffer, sizeof(buffer), 0);
+            if ((result < 0) && (errno == EINTR))
+            {   continue;   }
+            if ((result < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+            {   return true;    }
+            if (result < 0)
+            {   throw std::runtime_error(std::string("Error read from shard: ") + std::strerror(errno));  }
+            m_input.append(buffer, static_cast<size_t>(result));
+            return result != 0;
+        }
+    }
+
+    /// Во входном буфере есть полностью принятое сообщение
+    bool hasMessage() const
+    {
+        std::string_view input(m_input);
+        input.remove_prefix(m_inputPos);
+        Header header{};
+        return readBinary(input, header) && (input.size() >= header.size);
+    }
+
+    /// Очередное полностью принятое сообщение
+    bool takeMessage(MessageType& type, std::string& payload)
+    {
+        std::string_view input(m_input);
+        input.remove_prefix(m_inputPos);
+
+        Header header{};
+        if (!readBinary(input, header))
+        {   return false;   }
+        if (header.size > kMaxMessageSize)
+        {   throw std::runtime_error("Broken message from shard");  }
+        if (input.size() < header.size)
+        {   return false;   }
+
+        type = static_cast<MessageType>(header.type);
+        payload.assign(input.data(), header.size);
+        m_inputPos += sizeof(header) + header.size;
+        return true;
+    }
+
+    /// Ожидание сообщения (блокирующий сокет); false - сокет закрыт
+    bool wait(MessageType& type, std::string& payload)
+    {
+        while (!takeMessage(type, payload))
+        {
+            if (!receive())
+            {   return false;   }
+        }
+        return true;
+    }
+};
+
+
+/*!
+    Класс ShardWorker - процесс поиска --shards.
+
+    Процесс получает настройки от координатора и обходит выданные им
+    директории, пока они есть, затем сообщает размеры найденных файлов.
+    По границам диапазонов размеров из ответа он оставляет себе
+    файлы-кандидаты своего диапазона, а остальные отправляет через
+    координатора их владельцам. Каждая группа одного размера целиком
+    оказывается у одного процесса и сравнивается существующим findDoubles();
+    группы дубликатов отправляются координатору по мере подтверждения.
+*/
+class ShardWorker
+{
+    static constexpr size_t kBatchSize = 1024 * 1024;
+
+    ShardChannel m_channel;
+    Settings m_options;
+    uint32_t m_idxShard = 0;
+    uint32_t m_cntShards = 0;
+    uint64_t m_cntFilesFound = 0;
+    uint64_t m_bytesIndex = 0;
+
+    std::string waitMessage(ShardChannel::MessageType expectedType)
+    {
+        ShardChannel::MessageType type;
+        std::string payload;
+        if (!m_channel.wait(type, payload))
+        {   throw std::runtime_error("Coordinator of shards closed connection");   }
+        if (type != expectedType)
+        {   throw std::runtime_error("Unexpected message from coordinator of shards");    }
+        return payload;
+    }
+
+    /// Добавление файла по полному пути в index (директории - по путям в dirs)
+    static void addFile(FileIndex& index, std::unordered_map<std::string, uint32_t>& dirs
+                        , std::string_view pathToFile, const FileStat& fileStat)
+    {
+        const size_t posName = pathToFile.rfind('/');
+        const std::string pathToDir(pathToFile.substr(0, std::max<size_t>(posName, 1)));
+        auto itDir = dirs.find(pathToDir);
+        if (itDir == dirs.end())
+        {   itDir = dirs.emplace(pathToDir, index.addDir(FileIndex::kNoDir, pathToDir)).first;  }
+        index.addFile(itDir->second, pathToFile.substr(posName + 1), fileStat);
+    }
+
+    /// Обход директорий, выдаваемых координатором, в fileIndex
+    void walk()
+    {
+        const ExclusionTrie exclusions(m_options.getPathsForUnScan());
+        fileIndex.clear();
+        m_channel.send(ShardChannel::kReady, {});
+        for (;;)
+        {
+            ShardChannel::MessageType type;
+            std::string payload;
+            if (!m_channel.wait(type, payload))
+            {   throw std::runtime_error("Coordinator of shards closed connection");   }
+            if (type == ShardChannel::kWalkDone)
+            {   break;  }
+
+            std::string_view in(payload);
+            uint64_t level = 0;
+            uint8_t isFilesOnly = 0;
+            std::string pathToDir;
+            if ((type != ShardChannel::kWalkTask) || !readBinary(in, level) || !readBinary(in, isFilesOnly)
+                    || !readBinary(in, pathToDir))
+            {   throw std::runtime_error("Unexpected message from coordinator of shards");    }
+
+            // Директория уровня level обходится как корень с оставшейся глубиной
+            SettingsBuilder optionsBuilder(m_options);
+            const Settings options = optionsBuilder.withDepthScan(isFilesOnly ? 2 : m_options.getDepthScan() - level + 1).build();
+            ParallelWalker walker(options, exclusions);
+            walker.walk(pathToDir, nullptr, level == 1);
+
+            m_channel.send(ShardChannel::kReady, {});
+        }
+    }
+
+    /// Обмен файлами-кандидатами: в fileIndex остаются файлы своего диапазона размеров
+    void exchangeFiles()
+    {
+        m_cntFilesFound = fileIndex.size();
+        m_bytesIndex = fileIndex.getBytesUsed();
+        fileIndex.sortBySize();
+
+        // Размеры - частями по kBatchSize: сообщение ограничено kMaxMessageSize
+        std::string sizes;
+        for (size_t begin = 0, end = 0; begin < fileIndex.size(); begin = end)
+        {
+            for (end = begin + 1; (end < fileIndex.size()) && (fileIndex.getSize(end) == fileIndex.getSize(begin)); ++end)
+            {}
+            appendBinary(sizes, fileIndex.getSize(begin));
+            appendBinary(sizes, static_cast<uint64_t>(end - begin));
+            if (sizes.size() >= kBatchSize)
+            {
+                m_channel.send(ShardChannel::kSizes, sizes);
+                sizes.clear();
+            }
+        }
+        if (!sizes.empty())
+        {   m_channel.send(ShardChannel::kSizes, sizes);  }
+        m_channel.send(ShardChannel::kSizesDone, {});
+
+        const std::string partition = waitMessage(ShardChannel::kPartition);
+        std::string_view in(partition);
+        uint32_t cntBounds = 0;
+        if (!readBinary(in, cntBounds) || (in.size() < cntBounds * sizeof(uint64_t)))
+        {   throw std::runtime_error("Broken message from coordinator of shards");   }
+        std::vector<uint64_t> bounds(cntBounds);
+        for (auto& bound : bounds)
+        {   readBinary(in, bound);  }
+        const std::string_view isCandidate = in;
+
+        FileIndex ownIndex;
+        std::unordered_map<std::string, uint32_t> ownDirs;
+        bool isFilesDone = false;
+        const ShardChannel::MessageHandler onMessage = [&ownIndex, &ownDirs, &isFilesDone](ShardChannel::MessageType type, std::string& payload) {
+            if (type == ShardChannel::kFilesDone)
+            {
+                isFilesDone = true;
+                return;
+            }
+            if ((type != ShardChannel::kFiles) || isFilesDone)
+            {   throw std::runtime_error("Unexpected message from coordinator of shards");    }
+
+            std::string_view files(payload);
+            while (!files.empty())
+            {
+                std::string pathToFile;
+                FileStat fileStat;
+                if (!readBinary(files, pathToFile) || !readBinary(files, fileStat))
+                {   throw std::runtime_error("Broken message from coordinator of shards");   }
+                addFile(ownIndex, ownDirs, pathToFile, fileStat);
+            }
+        };
+
+        // Файлы других процессов принимаются и во время отправки своих
+        std::vector<std::string> batches(m_cntShards);
+        auto sendBatch = [this, &onMessage](std::string& batch) {
+            m_channel.send(ShardChannel::kFiles, batch, onMessage);
+            batch.clear();
+        };
+
+        size_t idxSize = 0;
+        for (size_t begin = 0, end = 0; begin < fileIndex.size(); begin = end, ++idxSize)
+        {
+            const uint64_t fileSize = fileIndex.getSize(begin);
+            for (end = begin + 1; (end < fileIndex.size()) && (fileIndex.getSize(end) == fileSize); ++end)
+            {}
+            if ((idxSize >= isCandidate.size()) || (isCandidate[idxSize] == 0))
+            {   continue;   }
+
+            const uint32_t owner = static_cast<uint32_t>(std::lower_bound(bounds.begin(), bounds.end(), fileSize) - bounds.begin());
+            for (size_t idxFile = begin; idxFile < end; ++idxFile)
+            {
+                if (owner == m_idxShard)
+                {
+                    addFile(ownIndex, ownDirs, fileIndex.getPath(idxFile), fileIndex.getFileStat(idxFile));
+                    continue;
+                }
+
+                std::string& batch = batches[owner];
+                if (batch.empty())
+                {   appendBinary(batch, owner);   }
+                appendBinary(batch, std::string_view(fileIndex.getPath(idxFile)));
+                appendBinary(batch, fileIndex.getFileStat(idxFile));
+                if (batch.size() >= kBatchSize)
+                {   sendBatch(batch);   }
+            }
+        }
+        for (auto& batch : batches)
+        {
+            if (!batch.empty())
+            {   sendBatch(batch);   }
+        }
+        m_channel.send(ShardChannel::kFilesDone, {}, onMessage);
+        fileIndex.clear();
+
+        while (!isFilesDone)
+        {
+            ShardChannel::MessageType type;
+            std::string payload;
+            if (!m_channel.wait(type, payload))
+            {   throw std::runtime_error("Coordinator of shards closed connection");   }
+            onMessage(type, payload);
+        }
+        fileIndex = std::move(ownIndex);
+    }
+
+    /// Сравнение групп своего диапазона: группы дубликатов - координатору
+    void compare()
+    {
+        findDoubles(m_options, [this](DoublesGroup&& group) {
+            std::string payload;
+            appendBinary(payload, static_cast<uint64_t>(group.fileSize));
+            appendBinary(payload, std::string_view(group.digest));
+            appendBinary(payload, static_cast<uint32_t>(group.files.size()));
+            for (const auto& file : group.files)
+            {
+                appendBinary(payload, std::string_view(file.pathToFile));
+                appendBinary(payload, static_cast<uint8_t>(file.isHardlink));
+            }
+            m_channel.send(ShardChannel::kGroup, payload);
+        });
+
+        std::string counters;
+        appendBinary(counters, m_cntFilesFound);
+        appendBinary(counters, std::max<uint64_t>(m_bytesIndex, fileIndex.getBytesUsed()));
+        ioStats.save(counters);
+        m_channel.send(ShardChannel::kDone, counters);
+    }
+
+public:
+    explicit ShardWorker(int handle)
+        : m_channel(handle)
+    {}
+
+    /*!
+        Функция int run()
+        - работа процесса от получения настроек до отправки результата;
+        возвращает код завершения процесса, ошибка отправляется координатору
+    */
+    int run() noexcept
+    {
+        try
+        {
+            const std::string settings = waitMessage(ShardChannel::kSettings);
+            std::string_view in(settings);
+            if (!readBinary(in, m_idxShard) || !readBinary(in, m_cntShards) || !m_options.load(in))
+            {   throw std::runtime_error("Broken settings from coordinator of shards");  }
+
+            walk();
+            exchangeFiles();
+            compare();
+            return 0;
+        }
+        catch (const std::exception& except)
+        {
+            try
+            {   m_channel.send(ShardChannel::kError, except.what());  }
+            catch (...)
+            {}
+            return 1;
+        }
+    }
+};
+
+
+/*!
+    Класс ShardCoordinator - поиск дубликатов несколькими процессами (--shards).
+
+    Процессы ShardWorker создаются fork() в конструкторе, до запуска
+    потоков координатора, и связаны с ним сокетами socketpair(). Настройки
+    передаются каждому процессу сообщением (Settings::save()), поэтому
+    все процессы работают с одинаковыми настройками.
+
+    Обход: координатор раскрывает верхние уровни директорий сканирования,
+    пока заданий меньше kTasksPerShard на процесс. Раскрытая директория -
+    задание "только файлы", нераскрытая - поддерево целиком. Задания
+    раздаются процессам по мере освобождения.
+
+    Разбиение: процессы сообщают размеры найденных файлов (частями, так
+    как сообщение ограничено kMaxMessageSize), координатор
+    отбирает размеры, встречающиеся больше одного раза, и делит их на
+    непрерывные диапазоны примерно равного объёма (файл весит свой размер
+    плюс kFileCost на открытие и первое чтение). Группа одного размера не
+    делится. Файлы чужого диапазона пересылаются владельцу через
+    координатора. Пока очередь отправки владельцу больше kMaxQueuedOutput,
+    координатор не читает сокет отправителя, и память координатора не
+    растёт, если процесс принимает файлы медленнее, чем другие их шлют.
+
+    Сравнение: каждый процесс сравнивает свои группы существующим
+    findDoubles(), координатор передаёт полученные группы onGroup и
+    суммирует счётчики ioStats процессов; время этапов - время
+    координатора.
+*/
+class ShardCoordinator
+{
+    struct Shard
+    {
+        pid_t pid = -1;
+        std::unique_ptr<ShardChannel> channel;
+        bool isDone = false;
+        std::vector<uint64_t> sizes;    // размеры файлов процесса из kSizes
+        size_t idxBlocker = kNoShard;   // процесс, очередь к которому переполнена последним kFiles
+    };
+
+    struct WalkTask
+    {
+        std::string pathToDir;
+        uint64_t level = 0;
+        bool isFilesOnly = false;
+    };
+
+    static constexpr size_t kNoShard = std::numeric_limits<size_t>::max();
+    static constexpr size_t kTasksPerShard = 4;
+    static constexpr uint64_t kFileCost = 64 * 1024;
+    static constexpr size_t kMaxQueuedOutput = 64 * 1024 * 1024;
+
+    const Settings& m_options;
+    const ExclusionTrie& m_exclusions;
+    std::vector<Shard> m_shards;
+
+    std::deque<WalkTask> m_tasks;
+    size_t m_cntIdle = 0;
+    size_t m_cntSizes = 0;
+    size_t m_cntFilesDone = 0;
+    size_t m_cntDone = 0;
+    std::map<uint64_t, uint64_t> m_cntFilesBySize;
+    std::chrono::steady_clock::time_point m_timeWalkDone;
+    std::chrono::steady_clock::time_point m_timeFilesDone;
+
+    /// Задания обхода: верхние уровни директорий сканирования раскрываются
+    void makeTasks()
+    {
+        const size_t depthScan = m_options.getDepthScan();
+        std::deque<std::pair<path, size_t>> dirs;
+        for (const std::string& pathForScan : m_options.getPathsForScan())
+        {
+            const path root = ExclusionTrie::canonicalize(path(pathForScan));
+            ExclusionTrie::State excludeState;
+            if ((1 < depthScan) && !m_exclusions.start(root, excludeState))
+            {   dirs.emplace_back(root, 1); }
+        }
+
+        while (!dirs.empty() && (m_tasks.size() + dirs.size() < kTasksPerShard * m_shards.size()))
+        {
+            const auto [dir, level] = dirs.front();
+            dirs.pop_front();
+            if (level + 1 >= depthScan)
+            {
+                m_tasks.push_back({dir.string(), level, false});
+                continue;
+            }
+
+            // Директория, которую не удалось прочитать, пропускается (корень сканирования - ошибка)
+            std::vector<path> subDirs;
+            boost::system::error_code error;
+            directory_iterator itrBeg(dir, error);
+            for (directory_iterator itrEnd; !error && (itrBeg != itrEnd); itrBeg.increment(error))
+            {
+                boost::system::error_code statusError;
+                ExclusionTrie::State excludeState;
+                if (is_directory(itrBeg->status(statusError)) && !m_exclusions.start(itrBeg->path(), excludeState))
+                {   subDirs.push_back(itrBeg->path());  }
+            }
+            if (error)
+            {
+                const filesystem_error except("read directory", dir, error);
+                if (level == 1)
+                {   throw except;   }
+                std::cerr << except.what() << '\n';
+                continue;
+            }
+
+            m_tasks.push_back({dir.string(), level, true});
+            for (auto& subDir : subDirs)
+            {   dirs.emplace_back(std::move(subDir), level + 1);    }
+        }
+        for (const auto& item : dirs)
+        {   m_tasks.push_back({item.first.string(), item.second, false}); }
+    }
+
+    void postTask(Shard& shard)
+    {
+        std::string payload;
+        appendBinary(payload, m_tasks.front().level);
+        appendBinary(payload, static_cast<uint8_t>(m_tasks.front().isFilesOnly));
+        appendBinary(payload, std::string_view(m_tasks.front().pathToDir));
+        m_tasks.pop_front();
+        shard.channel->post(ShardChannel::kWalkTask, payload);
+    }
+
+    /// Границы диапазонов размеров и признаки кандидатов каждому процессу
+    void postPartition()
+    {
+        unsigned __int128 weightTotal = 0;
+        for (const auto& item : m_cntFilesBySize)
+        {
+            if (item.second >= 2)
+            {   weightTotal += static_cast<unsigned __int128>(item.first + kFileCost) * item.second; }
+        }
+
+        std::vector<uint64_t> bounds;
+        unsigned __int128 weight = 0;
+        for (const auto& item : m_cntFilesBySize)
+        {
+            if (item.second < 2)
+            {   continue;   }
+            weight += static_cast<unsigned __int128>(item.first + kFileCost) * item.second;
+            while ((bounds.size() + 1 < m_shards.size()) && (weight * m_shards.size() >= weightTotal * (bounds.size() + 1)))
+            {   bounds.push_back(item.first);   }
+        }
+
+        for (auto& shard : m_shards)
+        {
+            std::string payload;
+            appendBinary(payload, static_cast<uint32_t>(bounds.size()));
+            for (const uint64_t bound : bounds)
+            {   appendBinary(payload, bound);   }
+            for (const uint64_t fileSize : shard.sizes)
+            {   payload.push_back((m_cntFilesBySize[fileSize] >= 2) ? 1 : 0);  }
+            shard.channel->post(ShardChannel::kPartition, payload);
+            shard.sizes = std::vector<uint64_t>();
+        }
+        m_cntFilesBySize.clear();
+    }
+
+    static std::runtime_error getBrokenError(size_t idxShard)
+    {   return std::runtime_error("Broken message from shard " + std::to_string(idxShard)); }
+
+    void processMessage(size_t idxShard, ShardChannel::MessageType type, const std::string& payload
+                        , const std::function<void(DoublesGroup&& group)>& onGroup)
+    {
+        Shard& shard = m_shards[idxShard];
+        std::string_view in(payload);
+        switch (type)
+        {
+        case ShardChannel::kReady:
+            if (!m_tasks.empty())
+            {   postTask(shard);    }
+            else if (++m_cntIdle == m_shards.size())
+            {
+                for (auto& item : m_shards)
+                {   item.channel->post(ShardChannel::kWalkDone, {});  }
+                m_timeWalkDone = std::chrono::steady_clock::now();
+            }
+            break;
+
+        case ShardChannel::kSizes:
+            while (!in.empty())
+            {
+                uint64_t fileSize = 0;
+                uint64_t cntFiles = 0;
+                if (!readBinary(in, fileSize) || !readBinary(in, cntFiles))
+                {   throw getBrokenError(idxShard);   }
+                shard.sizes.push_back(fileSize);
+                m_cntFilesBySize[fileSize] += cntFiles;
+            }
+            break;
+
+        case ShardChannel::kSizesDone:
+            if (++m_cntSizes == m_shards.size())
+            {   postPartition();    }
+            break;
+
+        case ShardChannel::kFiles:
+        {
+            uint32_t owner = 0;
+            if (!readBinary(in, owner) || (owner >= m_shards.size()))
+            {   throw getBrokenError(idxShard);   }
+            m_shards[owner].channel->post(ShardChannel::kFiles, in);
+            if (m_shards[owner].channel->getOutputSize() > kMaxQueuedOutput)
+            {   shard.idxBlocker = owner;   }
+            break;
+        }
+
+        case ShardChannel::kFilesDone:
+            if (++m_cntFilesDone == m_shards.size())
+            {
+                for (auto& item : m_shards)
+                {   item.channel->post(ShardChannel::kFilesDone, {});  }
+                m_timeFilesDone = std::chrono::steady_clock::now();
+            }
+            break;
+
+        case ShardChannel::kGroup:
+        {
+            DoublesGroup group;
+            uint64_t fileSize = 0;
+            uint32_t cntFiles = 0;
+            if (!readBinary(in, fileSize) || !readBinary(in, group.digest) || !readBinary(in, cntFiles))
+            {   throw getBrokenError(idxShard);   }
+            group.fileSize = fileSize;
+            group.files.resize(cntFiles);
+            for (auto& file : group.files)
+            {
+                uint8_t isHardlink = 0;
+                if (!readBinary(in, file.pathToFile) || !readBinary(in, isHardlink))
+                {   throw getBrokenError(idxShard);   }
+                file.isHardlink = (isHardlink != 0);
+            }
+            onGroup(std::move(group));
+            break;
+        }
+
+        case ShardChannel::kDone:
+        {
+            uint64_t cntFiles = 0;
+            uint64_t bytesIndex = 0;
+            if (!readBinary(in, cntFiles) || !readBinary(in, bytesIndex) || !ioStats.add(in))
+            {   throw getBrokenError(idxShard);   }
+            ioStats.cntShardFiles += cntFiles;
+            ioStats.bytesShardIndex += bytesIndex;
+            shard.isDone = true;
+            ++m_cntDone;
+            break;
+        }
+
+        case ShardChannel::kError:
+            throw std::runtime_error("Shard " + std::to_string(idxShard) + ": " + payload);
+
+        default:
+            throw getBrokenError(idxShard);
+        }
+    }
+
+public:
+    /// Создание cntShards процессов поиска (до запуска потоков)
+    ShardCoordinator(const Settings& options, const ExclusionTrie& exclusions, size_t cntShards)
+        : m_options(options)
+        , m_exclusions(exclusions)
+    {
+        for (size_t i = 0; i < cntShards; ++i)
+        {
+            int handles[2];
+            if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, handles) != 0)
+            {   throw std::runtime_error(std::string("Error create socket of shard: ") + std::strerror(errno)); }
+
+            const pid_t pid = ::fork();
+            if (pid == 0)
+            {
+                ::close(handles[0]);
+                for (const auto& shard : m_shards)
+                {   ::close(shard.channel->getHandle());    }
+                const int code = ShardWorker(handles[1]).run();
+                ::_exit(code);
+            }
+
+            ::close(handles[1]);
+            if (pid == -1)
+            {
+                ::close(handles[0]);
+                throw std::runtime_error(std::string("Error create process of shard: ") + std::strerror(errno));
+            }
+            ::fcntl(handles[0], F_SETFL, ::fcntl(handles[0], F_GETFL) | O_NONBLOCK);
+
+            m_shards.emplace_back();
+            m_shards.back().pid = pid;
+            m_shards.back().channel = std::make_unique<ShardChannel>(handles[0]);
+        }
+    }
+
+    /// Незавершённые процессы (ошибка) останавливаются
+    ~ShardCoordinator()
+    {
+        for (auto& shard : m_shards)
+        {
+            shard.channel->close();
+            if (!shard.isDone)
+            {   ::kill(shard.pid, SIGTERM); }
+            ::waitpid(shard.pid, nullptr, 0);
+        }
+    }
+
+    ShardCoordinator(const ShardCoordinator&) = delete;
+    ShardCoordinator& operator=(const ShardCoordinator&) = delete;
+
+    /*!
+        Функция void run(...)
+        - поиск дубликатов процессами: каждая группа дубликатов передаётся
+        onGroup по мере получения от процессов
+    */
+    void run(const std::function<void(DoublesGroup&& group)>& onGroup)
+    {
+        const auto timeStart = std::chrono::steady_clock::now();
+
+        // Потоков у каждого процесса - поровну от числа ядер
+        SettingsBuilder optionsBuilder(m_options);
+        if (m_options.getCntThreads() == 0)
+        {   optionsBuilder.withCntThreads(std::max<size_t>(1, getCntThreads(m_options) / m_shards.size()));   }
+        std::string settings;
+        optionsBuilder.build().save(settings);
+        for (size_t i = 0; i < m_shards.size(); ++i)
+        {
+            std::string payload;
+            appendBinary(payload, static_cast<uint32_t>(i));
+            appendBinary(payload, static_cast<uint32_t>(m_shards.size()));
+            payload += settings;
+            m_shards[i].channel->post(ShardChannel::kSettings, payload);
+        }
+        makeTasks();
+
+        std::vector<struct pollfd> pollHandles(m_shards.size());
+        while (m_cntDone < m_shards.size())
+        {
+            bool isPending = false;     // разбор принятого, отложенный до освобождения очереди
+            for (size_t i = 0; i < m_shards.size(); ++i)
+            {
+                // Отправитель ждёт, пока очередь к получателю его файлов не сократится
+                Shard& shard = m_shards[i];
+                if ((shard.idxBlocker != kNoShard) && (m_shards[shard.idxBlocker].channel->getOutputSize() <= kMaxQueuedOutput))
+                {   shard.idxBlocker = kNoShard;    }
+                const bool isRead = (shard.idxBlocker == kNoShard);
+                const bool isWrite = shard.channel->hasOutput();
+                isPending = isPending || (isRead && !shard.isDone && shard.channel->hasMessage());
+
+                pollHandles[i].fd = (shard.isDone || (!isRead && !isWrite)) ? -1 : shard.channel->getHandle();
+                pollHandles[i].events = static_cast<short>((isRead ? POLLIN : 0) | (isWrite ? POLLOUT : 0));
+                pollHandles[i].revents = 0;
+            }
+            if ((::poll(pollHandles.data(), pollHandles.size(), isPending ? 0 : -1) < 0) && (errno != EINTR))
+            {   throw std::runtime_error(std::string("Error wait for shards: ") + std::strerror(errno));   }
+
+            for (size_t i = 0; i < m_shards.size(); ++i)
+            {
+                ShardChannel& channel = *m_shards[i].channel;
+                if (pollHandles[i].revents & POLLOUT)
+                {   channel.flush();    }
+
+                bool isOpened = true;
+                if ((pollHandles[i].events & POLLIN) && (pollHandles[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                {   isOpened = channel.receive();   }
+                ShardChannel::MessageType type;
+                std::string payload;
+                while (!m_shards[i].isDone && (m_shards[i].idxBlocker == kNoShard) && channel.takeMessage(type, payload))
+                {   processMessage(i, type, payload, onGroup);  }
+                if (!isOpened && !m_shards[i].isDone && (m_shards[i].idxBlocker == kNoShard))
+                {   throw std::runtime_error("Shard " + std::to_string(i) + " exited unexpectedly");   }
+            }
+        }
+
+        const auto timeEnd = std::chrono::steady_clock::now();
+        ioStats.addPhaseTime(IoStats::kPhaseScan, m_timeWalkDone - timeStart);
+        ioStats.addPhaseTime(IoStats::kPhaseGroup, m_timeFilesDone - m_timeWalkDone);
+        ioStats.addPhaseTime(IoStats::kPhaseCompare, timeEnd - m_timeFilesDone);
+    }
+};
+
+
+#ifdef BAYAN_HAVE_INOTIFY
+/*!
+    Класс DoublesWatcher - слежение за директориями сканирования (--watch).
+
+    Объект создаётся до обхода: обработчик getDirHandler() ставит
+    наблюдение inotify на каждую директорию перед её просмотром, поэтому
+    файлы, созданные во время обхода, не теряются. run() выполняет первый
+    поиск по fileIndex, затем переносит найденные файлы в живой индекс:
+    FileIndex (директория и имя файла, свойства) и карты номеров файлов
+    по хэшу (директория, имя) и по размеру. Ключи блоков файлов остаются
+    в BlockDigestCache (в памяти, с --cache - в его файле), поэтому при
+    изменении файл сравнивается только со своей группой одного размера и
+    читается в основном он сам: ключи блоков остальных файлов группы
+    берутся из кэша. Файл кэша переписывается целиком, поэтому
+    сохраняется не чаще kSaveInterval и при завершении.
+
+    События копятся, пока не наступит затишье kSettleTime (но не дольше
+    kMaxDelay), затем изменённые файлы заново опрашиваются stat() и
+    группы их размеров сравниваются повторно. Группа дубликатов передаётся
+    onGroup целиком, если в ней есть изменённый файл; удаление файла только
+    убирает его из индекса. Удалённые файлы остаются в FileIndex, пока их
+    не станет больше живых, тогда индекс собирается заново. Новые
+    директории обходятся ParallelWalker с учётом --dpth и --unsc. При
+    переполнении очереди событий (IN_Q_OVERFLOW) директории сканирования
+    обходятся заново.
+
+    В ожидании событий поток спит в poll() и не тратит процессор; SIGINT
+    и SIGTERM (через signalfd) завершают run(). Сигналы должны быть
+    заблокированы blockSignals() до создания других потоков, иначе их
+    получит поток без блокировки и процесс завершится без сброса вывода.
+*/
+class DoublesWatcher
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct WatchedDir
+    {
+        uint32_t dir = FileIndex::kNoDir;   // директория m_index
+        size_t level = 0;
+    };
+
+    using FileIds = std::unordered_multimap<uint64_t, uint32_t>;
+
+    static constexpr uint32_t kDirEvents = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+            | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+    static constexpr std::chrono::milliseconds kSettleTime{100};
+    static constexpr std::chrono::milliseconds kMaxDelay{1000};
+    static constexpr std::chrono::seconds kSaveInterval{60};
+
+    const Settings& m_options;
+    const ExclusionTrie& m_exclusions;
+    const FileMask m_fileMask;
+    BlockDigestCache m_cache;
+    DoublesFinder m_finder;
+
+    int m_inotifyHandle = -1;
+    int m_signalHandle = -1;
+
+    std::mutex m_dirsMutex;         // m_dirs, m_dirIds и директории m_index во время обхода
+    std::unordered_map<int, WatchedDir> m_dirs;
+    std::unordered_map<std::string, uint32_t> m_dirIds;     // путь -> директория m_index
+
+    FileIndex m_index;
+    FileIds m_fileIds;              // хэш (директория, имя) -> файл m_index
+    std::unordered_map<uint64_t, std::set<uint32_t>> m_idsBySize;
+    size_t m_cntRemoved = 0;        // удалённых файлов в m_index
+
+    std::set<std::pair<uint32_t, std::string>> m_changedFiles;   // директория m_index и имя
+    std::map<uint64_t, std::set<uint32_t>> m_dirtySizes;
+    bool m_isOverflow = false;
+
+    bool m_isCacheChanged = false;
+    Clock::time_point m_timeSaved;
+
+    static sigset_t getSignals()
+    {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        return signals;
+    }
+
+    static uint64_t getFileKey(uint32_t dir, std::string_view name)
+    {   return std::hash<std::string_view>()(name) * 31 + dir;   }
+
+    std::string getPathInDir(uint32_t dir, std::string_view name) const
+    {
+        std::string pathToFile = m_index.getDirPath(dir);
+        if (pathToFile.empty() || (pathToFile.back() != '/'))
+        {   pathToFile.push_back('/');  }
+        pathToFile.append(name.data(), name.size());
+        return pathToFile;
+    }
+
+    /// Директория m_index с путём pathToDir (добавляется, если её нет)
+    uint32_t getDir(const std::string& pathToDir)
+    {
+        const auto itDir = m_dirIds.find(pathToDir);
+        if (itDir != m_dirIds.end())
+        {   return itDir->second;   }
+
+        const uint32_t dir = m_index.addDir(FileIndex::kNoDir, pathToDir);
+        m_dirIds.emplace(pathToDir, dir);
+        return dir;
+    }
+
+    /// Наблюдение за директорией pathToDir уровня level; вызывается и потоками обхода
+    void addWatch(const std::string& pathToDir, size_t level)
+    {
+        const int watch = ::inotify_add_watch(m_inotifyHandle, pathToDir.c_str(), kDirEvents);
+        if ((watch == -1) && (errno == ENOSPC))
+        {   throw std::runtime_error("Too many directories to watch: increase fs.inotify.max_user_watches");   }
+        if (watch != -1)
+        {
+            std::lock_guard<std::mutex> lock(m_dirsMutex);
+            m_dirs[watch] = {getDir(pathToDir), level};
+        }
+    }
+
+    FileIds::iterator findFile(uint32_t dir, std::string_view name)
+    {
+        const auto range = m_fileIds.equal_range(getFileKey(dir, name));
+        for (auto itFile = range.first; itFile != range.second; ++itFile)
+        {
+            if ((m_index.getDir(itFile->second) == dir) && (m_index.getName(itFile->second) == name))
+            {   return itFile;  }
+        }
+        return m_fileIds.end();
+    }
+
+    FileIds::iterator removeFile(FileIds::iterator itFile)
+    {
+        const auto itSize = m_idsBySize.find(m_index.getSize(itFile->second));
+        itSize->second.erase(itFile->second);
+        if (itSize->second.empty())
+        {   m_idsBySize.erase(itSize);    }
+        ++m_cntRemoved;
+        return m_fileIds.erase(itFile);
+    }
+
+    void removeFile(uint32_t dir, std::string_view name)
+    {
+        const auto itFile = findFile(dir, name);
+        if (itFile != m_fileIds.end())
+        {   removeFile(itFile);  }
+    }
+
+    /// Новый или изменившийся файл: его группа размера сравнивается заново
+    uint32_t updateFile(uint32_t dir, std::string_view name, const FileStat& fileStat)
+    {
+        const auto itFile = findFile(dir, name);
+        uint32_t id = 0;
+        if (itFile != m_fileIds.end())
+        {
+            id = itFile->second;
+            const FileStat oldStat = m_index.getFileStat(id);
+            if (std::memcmp(&oldStat, &fileStat, sizeof(FileStat)) == 0)
+            {   return id;  }
+
+            const auto itSize = m_idsBySize.find(oldStat.size);
+            itSize->second.erase(id);
+            if (itSize->second.empty())
+            {   m_idsBySize.erase(itSize);    }
+            m_index.setFileStat(id, fileStat);
+        }
+        else
+        {
+            id = static_cast<uint32_t>(m_index.size());
+            m_index.addFile(dir, name, fileStat);
+            m_fileIds.emplace(getFileKey(dir, name), id);
+        }
+        m_idsBySize[fileStat.size].insert(id);
+        m_dirtySizes[fileStat.size].insert(id);
+        return id;
+    }
+
+    /// Перенос файлов fileIndex в живой индекс; isTaken (если задан) - отметки перенесённых
+    void takeFiles(std::vector<bool>* isTaken = nullptr)
+    {
+        std::vector<uint32_t> dirs(fileIndex.getCntDirs(), FileIndex::kNoDir);
+        for (size_t idxFile = 0; idxFile < fileIndex.size(); ++idxFile)
+        {
+            uint32_t& dir = dirs[fileIndex.getDir(idxFile)];
+            if (dir == FileIndex::kNoDir)
+            {   dir = getDir(fileIndex.getDirPath(fileIndex.getDir(idxFile)));   }
+
+            const uint32_t id = updateFile(dir, fileIndex.getName(idxFile), fileIndex.getFileStat(idxFile));
+            if (isTaken != nullptr)
+            {
+                if (id >= isTaken->size())
+                {   isTaken->resize(id + 1, false); }
+                (*isTaken)[id] = true;
+            }
+        }
+        fileIndex.clear();
+    }
+
+    /// Обход новой директории уровня level
+    void scanDir(const std::string& pathToDir, size_t level)
+    {
+        if (level >= m_options.getDepthScan())
+        {   return; }
+
+        SettingsBuilder optionsBuilder(m_options);
+        const Settings options = optionsBuilder.withDepthScan(m_options.getDepthScan() - level + 1).build();
+        try
+        {
+            ParallelWalker walker(options, m_exclusions);
+            walker.walk(pathToDir, getDirHandler(level));
+        }
+        catch (const filesystem_error&)
+        {
+            fileIndex.clear();
+            return;
+        }
+        takeFiles();
+    }
+
+    /// Директория переименована или удалена: её файлы и наблюдения забываются
+    void forgetDir(const std::string& pathToDir)
+    {
+        const std::string prefix = pathToDir + '/';
+        auto isInside = [&pathToDir, &prefix](const std::string& pathToEntry) {
+            return (pathToEntry == pathToDir) || (pathToEntry.compare(0, prefix.size(), prefix) == 0);
+        };
+
+        for (auto itDir = m_dirs.begin(); itDir != m_dirs.end();)
+        {
+            if (isInside(m_index.getDirPath(itDir->second.dir)))
+            {
+                ::inotify_rm_watch(m_inotifyHandle, itDir->first);
+                itDir = m_dirs.erase(itDir);
+            }
+            else
+            {   ++itDir;    }
+        }
+
+        std::unordered_set<uint32_t> dirs;
+        for (auto itDir = m_dirIds.begin(); itDir != m_dirIds.end();)
+        {
+            if (isInside(itDir->first))
+            {
+                dirs.insert(itDir->second);
+                itDir = m_dirIds.erase(itDir);
+            }
+            else
+            {   ++itDir;    }
+        }
+
+        for (auto itFile = m_fileIds.begin(); itFile != m_fileIds.end();)
+        {
+            if (dirs.count(m_index.getDir(itFile->second)) != 0)
+            {   itFile = removeFile(itFile);  }
+            else
+            {   ++itFile;   }
+        }
+    }
+
+    /// Сборка m_index заново без удалённых файлов и забытых директорий
+    void compact()
+    {
+        FileIndex index;
+        std::unordered_map<uint32_t, uint32_t> dirs;    // директория m_index -> новая
+        for (auto& item : m_dirIds)
+        {
+            const uint32_t dir = index.addDir(FileIndex::kNoDir, item.first);
+            dirs.emplace(item.second, dir);
+            item.second = dir;
+        }
+        for (auto itDir = m_dirs.begin(); itDir != m_dirs.end();)
+        {
+            const auto itNew = dirs.find(itDir->second.dir);
+            if (itNew == dirs.end())
+            {
+                ::inotify_rm_watch(m_inotifyHandle, itDir->first);
+                itDir = m_dirs.erase(itDir);
+                continue;
+            }
+            itDir->second.dir = itNew->second;
+            ++itDir;
+        }
+
+        FileIds fileIds;
+        m_idsBySize.clear();
+        for (const auto& item : m_fileIds)
+        {
+            const uint32_t dir = dirs.at(m_index.getDir(item.second));
+            const std::string_view name = m_index.getName(item.second);
+            const FileStat fileStat = m_index.getFileStat(item.second);
+            const auto id = static_cast<uint32_t>(index.size());
+            index.addFile(dir, name, fileStat);
+            fileIds.emplace(getFileKey(dir, name), id);
+            m_idsBySize[fileStat.size].insert(id);
+        }
+
+        m_index = std::move(index);
+        m_fileIds.swap(fileIds);
+        m_cntRemoved = 0;
+    }
+
+    /// Повторный обход всех директорий сканирования после потери событий
+    void rescan()
+    {
+        std::cerr << "Queue of events of --watch overflowed, directories are scanned again\n";
+
+        for (const std::string& pathForScan: m_options.getPathsForScan())
+        {
+            ParallelWalker walker(m_options, m_exclusions);
+            walker.walk(ExclusionTrie::canonicalize(path(pathForScan)), getDirHandler());
+        }
+
+        // Файлы без изменений не сравниваются заново, исчезнувшие забываются
+        std::vector<bool> isTaken;
+        takeFiles(&isTaken);
+        for (auto itFile = m_fileIds.begin(); itFile != m_fileIds.end();)
+        {
+            if ((itFile->second >= isTaken.size()) || !isTaken[itFile->second])
+            {   itFile = removeFile(itFile);  }
+            else
+            {   ++itFile;   }
+        }
+    }
+
+    /// Файл name директории dir после события: в индекс, если подходит под --mask и --msf
+    void refreshFile(uint32_t dir, const std::string& name)
+    {
+        // Директория забыта после события
+        const std::string pathToDir = m_index.getDirPath(dir);
+        const auto itDir = m_dirIds.find(pathToDir);
+        if ((itDir == m_dirIds.end()) || (itDir->second != dir))
+        {   return; }
+
+        const std::string pathToFile = getPathInDir(dir, name);
+        struct stat fileStat{};
+        ioStats.addStat();
+        const bool isMatched = (::stat(pathToFile.c_str(), &fileStat) == 0) && S_ISREG(fileStat.st_mode)
+                && (static_cast<uint64_t>(fileStat.st_size) >= m_options.getMinimalSizeOfFile())
+                && m_fileMask.match(name);
+        if (isMatched)
+        {   updateFile(dir, name, FileStat::fromStat(fileStat));  }
+        else
+        {   removeFile(dir, name); }
+    }
+
+    void readEvents()
+    {
+        alignas(struct inotify_event) char buffer[64 * 1024];
+        for (;;)
+        {
+            const ssize_t cntBytes = ::read(m_inotifyHandle, buffer, sizeof(buffer));
+            if ((cntBytes < 0) && (errno == EINTR))
+            {   continue;   }
+            if (cntBytes <= 0)
+            {   break;  }
+
+            for (ssize_t pos = 0; pos < cntBytes;)
+            {
+                const auto* event = reinterpret_cast<const struct inotify_event*>(buffer + pos);
+                pos += static_cast<ssize_t>(sizeof(struct inotify_event) + event->len);
+
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    m_isOverflow = true;
+                    continue;
+                }
+                if (event->mask & IN_IGNORED)
+                {
+                    m_dirs.erase(event->wd);
+                    continue;
+                }
+
+                const auto itDir = m_dirs.find(event->wd);
+                if ((itDir == m_dirs.end()) || (event->len == 0))
+                {   continue;   }
+                const std::string pathToEntry = getPathInDir(itDir->second.dir, event->name);
+
+                if (event->mask & IN_ISDIR)
+                {
+                    if (event->mask & (IN_MOVED_FROM | IN_DELETE))
+                    {   forgetDir(pathToEntry); }
+                    else if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    {   scanDir(pathToEntry, itDir->second.level + 1);   }
+                    continue;
+                }
+
+                // Создание файла - только жёсткая ссылка: новый файл ещё пишется,
+                // он будет сравнён после IN_CLOSE_WRITE
+                struct stat fileStat{};
+                if ((event->mask & IN_CREATE)
+                        && ((::stat(pathToEntry.c_str(), &fileStat) != 0) || (fileStat.st_nlink < 2)))
+                {   continue;   }
+
+                m_changedFiles.emplace(itDir->second.dir, event->name);
+            }
+        }
+    }
+
+    /// Сравнение изменившихся групп размера
+    void process(const std::function<void(DoublesGroup&& group)>& onGroup)
+    {
+        if (m_isOverflow)
+        {
+            m_isOverflow = false;
+            rescan();
+        }
+        for (const auto& changedFile : m_changedFiles)
+        {   refreshFile(changedFile.first, changedFile.second);    }
+        m_changedFiles.clear();
+
+        const bool isHardlinkDoubles = (m_options.getHardlinks() == "dup");
+        for (const auto& dirtySize : m_dirtySizes)
+        {
+            const auto itSize = m_idsBySize.find(dirtySize.first);
+            if ((itSize == m_idsBySize.end()) || (itSize->second.size() < 2))
+            {   continue;   }
+
+            // Корень "" - каждый путь файла в индексе полный
+            FileIndex index;
+            const uint32_t dir = index.addDir(FileIndex::kNoDir, "");
+            for (const uint32_t id : itSize->second)
+            {   index.addFile(dir, m_index.getPath(id), m_index.getFileStat(id));  }
+
+            std::set<std::string> changedPaths;
+            for (const uint32_t id : dirtySize.second)
+            {   changedPaths.insert(m_index.getPath(id));   }
+            try
+            {
+                compareSizeGroup(m_options, m_finder, index, makeSizeGroup(index, 0, index.size()), isHardlinkDoubles
+                                 , [&onGroup, &changedPaths](DoublesGroup&& group) {
+                    for (const auto& file : group.files)
+                    {
+                        if (changedPaths.count(file.pathToFile) != 0)
+                        {
+                            onGroup(std::move(group));
+                            return;
+                        }
+                    }
+                });
+            }
+            catch (const std::exception& except)
+            {   std::cerr << except.what() << '\n'; }
+        }
+        m_dirtySizes.clear();
+
+        if (m_cntRemoved > m_fileIds.size())
+        {   compact();  }
+
+        m_isCacheChanged = m_isCacheChanged || (m_options.getCompareMode() != "bytes");
+    }
+
+    /// Запись кэша не чаще kSaveInterval (isForced - сейчас, если он изменился)
+    void saveCache(bool isForced)
+    {
+        const auto now = Clock::now();
+        if (!m_isCacheChanged || (!isForced && (now < m_timeSaved + kSaveInterval)))
+        {   return; }
+
+        m_cache.save();
+        m_isCacheChanged = false;
+        m_timeSaved = now;
+    }
+
+public:
+    explicit DoublesWatcher(const Settings& options, const ExclusionTrie& exclusions)
+        : m_options(options)
+        , m_exclusions(exclusions)
+        , m_fileMask(options.getMasksForScan(), options.isMaskRegex())
+        , m_cache(options.getCachePath())
+        , m_finder(options, 0, &m_cache)
+    {
+        blockSignals();
+        const sigset_t signals = getSignals();
+
+        m_inotifyHandle = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m_inotifyHandle == -1)
+        {   throw std::runtime_error(std::string("inotify_init1: ") + std::strerror(errno));  }
+        m_signalHandle = ::signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (m_signalHandle == -1)
+        {
+            ::close(m_inotifyHandle);
+            throw std::runtime_error(std::string("signalfd: ") + std::strerror(errno));
+        }
+    }
+
+    ~DoublesWatcher()
+    {
+        ::close(m_signalHandle);
+        ::close(m_inotifyHandle);
+    }
+
+    DoublesWatcher(const DoublesWatcher&) = delete;
+    DoublesWatcher& operator=(const DoublesWatcher&) = delete;
+
+    /*!
+        Функция void blockSignals()
+        - блокировка SIGINT и SIGTERM в вызывающем потоке (и в потоках,
+        созданных им после вызова) для приёма через signalfd
+    */
+    static void blockSignals()
+    {
+        const sigset_t signals = getSignals();
+        ::pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    }
+
+    /*!
+        Функция ParallelWalker::DirHandler getDirHandler(size_t levelRoot)
+        - обработчик обхода, ставящий наблюдение на директорию до её
+        просмотра (levelRoot - уровень корня обхода). С этого момента
+        события директории копятся, в том числе во время первого поиска
+    */
+    ParallelWalker::DirHandler getDirHandler(size_t levelRoot = 1)
+    {
+        return [this, levelRoot](const path& dirPath, size_t level) {
+            addWatch(dirPath.string(), levelRoot + level - 1);
+        };
+    }
+
+    /*!
+        Функция void run(...)
+        - первый поиск по fileIndex и слежение за изменениями до SIGINT
+        или SIGTERM; группы дубликатов передаются onGroup
+    */
+    void run(const std::function<void(DoublesGroup&& group)>& onGroup)
+    {
+        findDoubles(m_options, onGroup, &m_cache);
+        takeFiles();
+        m_dirtySizes.clear();
+        m_timeSaved = Clock::now();
+
+        Clock::time_point timeFirst;
+        Clock::time_point timeLast;
+        auto isPending = [this]() {
+            return !m_changedFiles.empty() || !m_dirtySizes.empty() || m_isOverflow;
+        };
+
+        for (;;)
+        {
+            int timeoutMs = -1;
+            if (isPending() || m_isCacheChanged)
+            {
+                auto deadline = m_isCacheChanged ? (m_timeSaved + kSaveInterval) : Clock::time_point::max();
+                if (isPending())
+                {   deadline = std::min({deadline, timeLast + kSettleTime, timeFirst + kMaxDelay});   }
+                timeoutMs = static_cast<int>(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                                   deadline - Clock::now()).count() + 1));
+            }
+
+            struct pollfd handles[2] = {{m_inotifyHandle, POLLIN, 0}, {m_signalHandle, POLLIN, 0}};
+            if ((::poll(handles, 2, timeoutMs) < 0) && (errno != EINTR))
+            {   throw std::runtime_error(std::string("poll: ") + std::strerror(errno));  }
+
+            if (handles[1].revents & POLLIN)
+            {
+                struct signalfd_siginfo signalInfo{};
+                while (::read(m_signalHandle, &signalInfo, sizeof(signalInfo)) == sizeof(signalInfo))
+                {}
+                saveCache(true);
+                return;
+            }
+
+            if (handles[0].revents & POLLIN)
+            {
+                const bool wasPending = isPending();
+                readEvents();
+                timeLast = Clock::now();
+                if (!wasPending)
+                {   timeFirst = timeLast;   }
+            }
+
+            const auto now = Clock::now();
+            if (isPending() && ((now >= timeLast + kSettleTime) || (now >= timeFirst + kMaxDelay)))
+            {   process(onGroup);   }
+            saveCache(false);
+        }
+    }
+};
+#endif
+
+
+/*!
+    Класс ResultWriter - буферизованный вывод групп дубликатов в дескриптор
+    handle в формате --format:
+    plain - путь файла на строке (жёсткие ссылки с пометкой " (hardlink)"),
+    группы разделены пустой строкой;
+    null - путь завершается '\0', группа - ещё одним '\0' (-0);
+    jsonl - группа - объект JSON на строке: {"size":N,"digest":"hex"|null,
+    "files":[{"path":"...","hardlink":false},...]}. Путь, который не является
+    строкой UTF-8, в "path" записывается с заменой неверных байтов на U+FFFD,
+    а точно - в base64 в поле "path_base64".
+
+    Группы копятся в буфере на kCapacity байт и пишутся одним write() при
+    его заполнении. Поток сброса выводит неполный буфер не позже чем через
+    kFlushInterval после записи группы, поэтому результаты долгого поиска
+    появляются сразу, как только найдены. write() можно вызывать из
+    нескольких потоков; ошибка вывода бросается из write() или flush().
+*/
+class ResultWriter
+{
+    const int m_handle;
+    const std::string m_format;
+    const size_t m_capacity;
+
+    std::string m_buffer;
+    std::exception_ptr m_error;
+    bool m_isStopped = false;
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::thread m_flusher;
+
+    void writeAll(const char* data, size_t size)
+    {
+        while (size != 0)
+        {
+            const ssize_t cntWritten = ::write(m_handle, data, size);
+            if ((cntWritten < 0) && (errno == EINTR))
+            {   continue;   }
+            if (cntWritten < 0)
+            {   throw boost::system::system_error(boost::system::error_code(errno, boost::system::system_category()), "write of results");   }
+            data += cntWritten;
+            size -= static_cast<size_t>(cntWritten);
+        }
+    }
+
+    void flushLocked()
+    {
+        if (m_error)
+        {   std::rethrow_exception(m_error);    }
+        try
+        {
+            writeAll(m_buffer.data(), m_buffer.size());
+            m_buffer.clear();
+        }
+        catch (...)
+        {
+            m_error = std::current_exception();
+            throw;
+        }
+    }
+
+    void flushLoop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_isStopped)
+        {
+            m_condition.wait(lock, [this]() { return m_isStopped || !m_buffer.empty(); });
+            m_condition.wait_for(lock, kFlushInterval, [this]() { return m_isStopped; });
+            if (!m_buffer.empty() && !m_error)
+            {
+                try
+                {   flushLocked();  }
+                catch (...)
+                {}
+            }
+        }
+    }
+
+    /*!
+        Функция size_t getUtf8Length(std::string_view value, size_t pos)
+        - длина верной последовательности UTF-8 с позиции pos
+        (0 - байт value[pos] не начинает верную последовательность)
+    */
+    static size_t getUtf8Length(std::string_view value, size_t pos)
+    {
+        const auto lead = static_cast<unsigned char>(value[pos]);
+        if (lead < 0x80)
+        {   return 1;   }
+
+        size_t length = 0;
+        unsigned char min = 0x80;   // границы второго байта: без избыточных
+        unsigned char max = 0xBF;   // кодировок, суррогатов и кодов больше U+10FFFF
+        if ((lead >= 0xC2) && (lead <= 0xDF))
+        {   length = 2; }
+        else if ((lead >= 0xE0) && (lead <= 0xEF))
+        {
+            length = 3;
+            min = (lead == 0xE0) ? 0xA0 : 0x80;
+            max = (lead == 0xED) ? 0x9F : 0xBF;
+        }
+        else if ((lead >= 0xF0) && (lead <= 0xF4))
+        {
+            length = 4;
+            min = (lead == 0xF0) ? 0x90 : 0x80;
+            max = (lead == 0xF4) ? 0x8F : 0xBF;
+        }
+        else
+        {   return 0;   }
+
+        if (pos + length > value.size())
+        {   return 0;   }
+        for (size_t i = 1; i < length; ++i)
+        {
+            const auto next = static_cast<unsigned char>(value[pos + i]);
+            if ((next < ((i == 1) ? min : 0x80)) || (next > ((i == 1) ? max : 0xBF)))
+            {   return 0;   }
+        }
+        return length;
+    }
+
+    /// Запись строки JSON; false - в value были неверные байты UTF-8 (заменены на U+FFFD)
+    bool appendJsonString(std::string_view value)
+    {
+        bool isValid = true;
+        m_buffer.push_back('"');
+        for (size_t pos = 0; pos < value.size();)
+        {
+            const char symbol = value[pos];
+            const auto code = static_cast<unsigned char>(symbol);
+            const size_t length = getUtf8Length(value, pos);
+            if ((symbol == '"') || (symbol == '\\'))
+            {
+                m_buffer.push_back('\\');
+                m_buffer.push_back(symbol);
+            }
+            else if (code < 0x20)
+            {
+                char escape[8];
+                std::snprintf(escape, sizeof(escape), "\\u%04x", code);
+                m_buffer.append(escape);
+            }
+            else if (length == 0)
+            {
+                m_buffer.append("\\ufffd");
+                isValid = false;
+            }
+            else
+            {   m_buffer.append(value.data() + pos, length);  }
+            pos += std::max<size_t>(1, length);
+        }
+        m_buffer.push_back('"');
+        return isValid;
+    }
+
+    void appendBase64(std::string_view value)
+    {
+        static constexpr char kAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+        m_buffer.push_back('"');
+        for (size_t pos = 0; pos < value.size(); pos += 3)
+        {
+            const size_t cntBytes = std::min<size_t>(3, value.size() - pos);
+            uint32_t bits = 0;
+            for (size_t i = 0; i < 3; ++i)
+            {   bits = (bits << 8) | ((i < cntBytes) ? static_cast<unsigned char>(value[pos + i]) : 0u); }
+            for (size_t i = 0; i < 4; ++i)
+            {   m_buffer.push_back((i <= cntBytes) ? kAlphabet[(bits >> (18 - 6 * i)) & 0x3F] : '=');  }
+        }
+        m_buffer.push_back('"');
+    }
+
+    void appendGroup(const DoublesGroup& group)
+    {
+        if (m_format == "null")
+        {
+            for (const auto& file: group.files)
+            {
+                m_buffer.append(file.pathToFile);
+                m_buffer.push_back('\0');
+            }
+            m_buffer.push_back('\0');
+        }
+        else if (m_format == "jsonl")
+        {
+            m_buffer.append("{\"size\":");
+            m_buffer.append(std::to_string(group.fileSize));
+            m_buffer.append(",\"digest\":");
+            if (group.digest.empty())
+            {   m_buffer.append("null");    }
+            else
+            {
+                m_buffer.push_back('"');
+                boost::algorithm::hex_lower(group.digest.begin(), group.digest.end(), std::back_inserter(m_buffer));
+                m_buffer.push_back('"');
+            }
+            m_buffer.append(",\"files\":[");
+            for (size_t i = 0; i < group.files.size(); ++i)
+            {
+                m_buffer.append((i == 0) ? "{\"path\":" : ",{\"path\":");
+                if (!appendJsonString(group.files[i].pathToFile))
+                {
+                    m_buffer.append(",\"path_base64\":");
+                    appendBase64(group.files[i].pathToFile);
+                }
+                m_buffer.append(group.files[i].isHardlink ? ",\"hardlink\":true}" : ",\"hardlink\":false}");
+            }
+            m_buffer.append("]}\n");
+        }
+        else
+        {
+            for (const auto& file: group.files)
+            {
+                m_buffer.append(file.pathToFile);
+                m_buffer.append(file.isHardlink ? " (hardlink)\n" : "\n");
+            }
+            m_buffer.push_back('\n');
+        }
+    }
+
+public:
+    static constexpr size_t kCapacity = 1024 * 1024;
+    static constexpr std::chrono::milliseconds kFlushInterval{200};
+
+    ResultWriter(int handle, const std::string& format, size_t capacity = kCapacity)
+        : m_handle(handle)
+        , m_format(format)
+        , m_capacity(capacity)
+    {
+        if (!isFormat(format))
+        {   throw std::invalid_argument("Unknown --format: " + format + " (available: plain, null, jsonl)");  }
+        m_buffer.reserve(capacity);
+        m_flusher = std::thread(&ResultWriter::flushLoop, this);
+    }
+
+    ResultWriter(const ResultWriter&) = delete;
+    ResultWriter& operator=(const ResultWriter&) = delete;
+
+    ~ResultWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_isStopped = true;
+        }
+        m_condition.notify_one();
+        m_flusher.join();
+
+        try
+        {   flushLocked();  }
+        catch (...)
+        {}
+    }
+
+    static bool isFormat(const std::string& format)
+    {   return (format == "plain") || (format == "null") || (format == "jsonl");    }
+
+    /// Вывод группы дубликатов (в буфер)
+    void write(const DoublesGroup& group)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_error)
+        {   std::rethrow_exception(m_error);    }
+
+        const bool isEmpty = m_buffer.empty();
+        appendGroup(group);
+        if (m_buffer.size() >= m_capacity)
+        {   flushLocked();  }
+        else if (isEmpty)
+        {   m_condition.notify_one();   }
+    }
+
+    /// Вывод содержимого буфера
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        flushLocked();
+    }
+};
+
+
+/*!
+    Ф-ия вывода статистики --stats в out: текстом или одним объектом
+    JSON (isJson). Байты чтения этапа обхода - элементы директорий,
+    этапа сравнения - блоки файлов; доля прочитанного считается от
+    объёма файлов-кандидатов (файлов в группах одного размера)
+*/
+void printStats(std::ostream& out, bool isJson)
+{
+    auto getSeconds = [](IoStats::Phase phase) {
+        return static_cast<double>(ioStats.phaseTimesNs[phase].load()) / 1e9;
+    };
+    const double timeCompare = getSeconds(IoStats::kPhaseCompare);
+    const uint64_t bytesRead = ioStats.bytesRead.load();
+    const double rate = (timeCompare > 0) ? static_cast<double>(bytesRead) / timeCompare : 0.0;
+    const double shareRead = (ioStats.bytesCandidates.load() != 0)
+            ? static_cast<double>(bytesRead) / static_cast<double>(ioStats.bytesCandidates.load()) : 0.0;
+
+    size_t cntRounds = IoStats::kMaxRounds;
+    while ((cntRounds != 0) && (ioStats.rounds[cntRounds - 1].cntGroups.load() == 0))
+    {   --cntRounds;    }
+
+    std::sort(ioStats.groups.begin(), ioStats.groups.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.fileSize > rhs.fileSize;
+    });
+
+    if (!isJson)
+    {
+        out << "Scan: time: " << getSeconds(IoStats::kPhaseScan) << " s"
+            << ", directories: " << ioStats.cntDirs.load()
+            << ", entries: " << ioStats.cntEntries.load()
+            << ", bytes of entries: " << ioStats.bytesEntries.load()
+            << ", stats: " << ioStats.cntStats.load() << '\n';
+        out << "Group: time: " << getSeconds(IoStats::kPhaseGroup) << " s"
+            << ", files: " << fileIndex.size() + ioStats.cntShardFiles
+            << ", candidates: " << ioStats.cntCandidates.load()
+            << ", bytes of candidates: " << ioStats.bytesCandidates.load() << '\n';
+        out << "Compare: time: " << timeCompare << " s"
+            << ", opens: " << ioStats.cntOpens.load()
+            << ", read calls: " << ioStats.cntReadCalls.load()
+            << ", reads: " << ioStats.cntReads.load()
+            << ", bytes: " << bytesRead
+            << " (" << shareRead * 100 << " % of candidates)"
+            << ", rate: " << rate << " B/s"
+            << ", blocks hashed: " << ioStats.cntBlocksHashed.load() << '\n';
+        out << "Blocks in holes: " << ioStats.cntHoles.load()
+            << ", bytes: " << ioStats.bytesHoles.load() << '\n';
+        out << "Blocks from cache: " << ioStats.cntCacheHits.load()
+            << ", bytes: " << ioStats.bytesCacheHits.load() << '\n';
+        out << "Allocations of buffers: " << ioStats.cntAllocations.load()
+            << ", bytes: " << ioStats.bytesAllocated.load() << '\n';
+        out << "Memory: index: " << fileIndex.getBytesUsed() + ioStats.bytesShardIndex << " B"
+            << ", peak RSS: " << getPeakRss() << " B\n";
+
+        for (size_t round = 0; round < cntRounds; ++round)
+        {
+            const auto& roundStats = ioStats.rounds[round];
+            out << "Round " << round << ((round + 1 == IoStats::kMaxRounds) ? "+" : "")
+                << ": groups: " << roundStats.cntGroups.load()
+                << ", files: " << roundStats.cntFiles.load()
+                << ", subgroups: " << roundStats.cntSubGroups.load() << '\n';
+        }
+        for (const auto& [dev, deviceStats]: ioStats.devices)
+        {
+            out << "Device " << major(dev) << ':' << minor(dev)
+                << ": reads: " << deviceStats.cntReads
+                << ", bytes: " << deviceStats.bytesRead
+                << ", seeks: " << deviceStats.cntSeeks << '\n';
+        }
+        for (const auto& group: ioStats.groups)
+        {
+            out << "Group of doubles: size " << group.fileSize
+                << ", files: " << group.cntFiles
+                << ", reads: " << group.cntReads
+                << ", bytes: " << group.bytesRead << '\n';
+        }
+        return;
+    }
+
+    out << "{\"phases\":{"
+        << "\"scan\":{\"time_s\":" << getSeconds(IoStats::kPhaseScan) << ",\"bytes_read\":" << ioStats.bytesEntries.load() << "},"
+        << "\"group\":{\"time_s\":" << getSeconds(IoStats::kPhaseGroup) << ",\"bytes_read\":0},"
+        << "\"compare\":{\"time_s\":" << timeCompare << ",\"bytes_read\":" << bytesRead << "}},";
+    out << "\"scan\":{\"directories\":" << ioStats.cntDirs.load()
+        << ",\"entries\":" << ioStats.cntEntries.load()
+        << ",\"stats\":" << ioStats.cntStats.load() << "},";
+    out << "\"files\":{\"found\":" << fileIndex.size() + ioStats.cntShardFiles
+        << ",\"candidates\":" << ioStats.cntCandidates.load()
+        << ",\"candidate_bytes\":" << ioStats.bytesCandidates.load() << "},";
+    out << "\"io\":{\"opens\":" << ioStats.cntOpens.load()
+        << ",\"read_calls\":" << ioStats.cntReadCalls.load()
+        << ",\"reads\":" << ioStats.cntReads.load()
+        << ",\"bytes_read\":" << bytesRead
+        << ",\"share_of_candidates\":" << shareRead
+        << ",\"rate\":" << rate
+        << ",\"blocks_hashed\":" << ioStats.cntBlocksHashed.load()
+        << ",\"hole_blocks\":" << ioStats.cntHoles.load()
+        << ",\"hole_bytes\":" << ioStats.bytesHoles.load()
+        << ",\"cache_blocks\":" << ioStats.cntCacheHits.load()
+        << ",\"cache_bytes\":" << ioStats.bytesCacheHits.load()
+        << ",\"allocations\":" << ioStats.cntAllocations.load()
+        << ",\"allocated_bytes\":" << ioStats.bytesAllocated.load() << "},";
+    out << "\"memory\":{\"index_bytes\":" << fileIndex.getBytesUsed() + ioStats.bytesShardIndex
+        << ",\"peak_rss\":" << getPeakRss() << "},";
+
+    out << "\"rounds\":[";
+    for (size_t round = 0; round < cntRounds; ++round)
+    {
+        const auto& roundStats = ioStats.rounds[round];
+        out << ((round == 0) ? "" : ",")
+            << "{\"groups\":" << roundStats.cntGroups.load()
+            << ",\"files\":" << roundStats.cntFiles.load()
+            << ",\"subgroups\":" << roundStats.cntSubGroups.load() << '}';
+    }
+    out << "],\"devices\":[";
+    for (auto itDevice = ioStats.devices.begin(); itDevice != ioStats.devices.end(); ++itDevice)
+    {
+        out << ((itDevice == ioStats.devices.begin()) ? "" : ",")
+            << "{\"device\":\"" << major(itDevice->first) << ':' << minor(itDevice->first) << '"'
+            << ",\"reads\":" << itDevice->second.cntReads
+            << ",\"bytes\":" << itDevice->second.bytesRead
+            << ",\"seeks\":" << itDevice->second.cntSeeks << '}';
+    }
+    out << "],\"groups\":[";
+    for (size_t i = 0; i < ioStats.groups.size(); ++i)
+    {
+        const auto& group = ioStats.groups[i];
+        out << ((i == 0) ? "" : ",")
+            << "{\"size\":" << group.fileSize
+            << ",\"files\":" << group.cntFiles
+            << ",\"reads\":" << group.cntReads
+            << ",\"bytes\":" << group.bytesRead << '}';
+    }
+    out << "]}\n";
+}
+
+
+/*!
+    Класс CpuProfiler - профилирование gperftools (--profile) в файл
+    pathToProfile на время жизни объекта; пустой путь - без профилирования.
+    Доступно только в сборке с BAYAN_WITH_PROFILER
+*/
+class CpuProfiler
+{
+    bool m_isStarted = false;
+
+public:
+    explicit CpuProfiler(const std::string& pathToProfile)
+    {
+        if (pathToProfile.empty())
+        {   return; }
+#ifdef BAYAN_WITH_PROFILER
+        m_isStarted = (ProfilerStart(pathToProfile.c_str()) != 0);
+#else
+        throw std::invalid_argument("--profile is not available: bayan is built without BAYAN_WITH_PROFILER");
+#endif
+    }
+
+    CpuProfiler(const CpuProfiler&) = delete;
+    CpuProfiler& operator=(const CpuProfiler&) = delete;
+
+    ~CpuProfiler()
+    {
+#ifdef BAYAN_WITH_PROFILER
+        if (m_isStarted)
+        {   ProfilerStop(); }
+#endif
+    }
+};
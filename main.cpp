@@ -1,6 +1,5 @@
-#include <gperftools/profiler.h>
-
 #include <condition_variable>
+#include <chrono>
 #include <unordered_map>
 #include <unordered_set>
 #include <iostream>
@@ -18,8 +17,6 @@
 
 int main(int argc, const char* argv[])
 {
-    ProfilerStart("bayan.prof");
-
 ///    Условие
 ///    Пользуясь имеющимися в библиотеке Boost структурами и алгоритмами
 ///    разработать утилиту для обнаружения файлов-дубликатов.
@@ -123,8 +120,6 @@ int main(int argc, const char* argv[])
 
     try
     {
-        std::cout << "Constructions project of objects:\n\n";
-
         SettingsBuilder optionsBuilder;
 
         prog_opt::options_description desc{"Options"};
@@ -133,22 +128,57 @@ int main(int argc, const char* argv[])
                 ("unsc",prog_opt::value<std::vector<std::string>>()->multitoken(),  "directories for unscan (\"path\", ..., \"path\")")
                 ("dpth",prog_opt::value<size_t>()->default_value(0),                "depth in tree of directories for scan (0..)")
                 ("msf", prog_opt::value<size_t>()->default_value(1),                "minimal size of file (1..)")
-                ("mask",prog_opt::value<std::string>()->default_value("*"),         "mask of file for scan (regexp)")
-                ("sb",  prog_opt::value<size_t>()->default_value(1),                "size of block in file (bytes)")
-                ("hash",prog_opt::value<std::string>()->default_value("md5"),       "algorithm of hash (md5, crc32)")
+                ("mask",prog_opt::value<std::vector<std::string>>()->multitoken()->default_value({"*"}, "*"), "masks of name of file for scan, case-insensitive (\"*.jpg\" ... \"img_??.*\")")
+                ("mask-regex",prog_opt::bool_switch(),                              "masks are regular expressions (ECMAScript) searched in name of file")
+                ("sb",  prog_opt::value<size_t>()->default_value(4096),             "size of first block in file (bytes)")
+                ("sbmax",prog_opt::value<size_t>()->default_value(1024 * 1024),     "maximum size of block: blocks double from --sb up to it (bytes)")
+                ("hash",prog_opt::value<std::string>()->default_value("md5"),       "algorithm of hash (md5, sha1, crc32, xxh3, xxh128, blake3)")
+                ("cmp", prog_opt::value<std::string>()->default_value("hash"),      "mode of compare of blocks (hash, bytes)")
+                ("fdmax",prog_opt::value<size_t>()->default_value(0),               "maximum of opened files at once (0 - by RLIMIT_NOFILE)")
+                ("io",  prog_opt::value<std::string>()->default_value("auto"),      "method of read of files (mmap, stream, pread, auto - by size of file)")
+                ("qd",  prog_opt::value<size_t>()->default_value(32),               "depth of queue of asynchronous reads for --io=pread (0 - synchronous reads)")
+                ("direct",prog_opt::bool_switch(),                                  "read files by --io=pread bypassing page cache (O_DIRECT, --sb multiple of 4096)")
+                ("cache",prog_opt::value<std::string>(),                            "file of cache of keys of blocks between runs (--cmp=hash)")
+                ("hardlinks",prog_opt::value<std::string>()->default_value("dup"),  "hard links to one file: dup - are doubles, ignore - are not")
+                ("sample",prog_opt::bool_switch(),                                  "compare last and middle blocks of files right after first one")
+                ("order",prog_opt::value<std::string>()->default_value("physical"), "order of reads of files (physical, inode, none)")
+                ("devq",prog_opt::value<size_t>()->default_value(0),                "reads at once from one device (0 - 1 for rotational disks, unlimited for others)")
+                ("format",prog_opt::value<std::string>()->default_value("plain"),   "format of output of doubles (plain, null, jsonl)")
+                ("null,0",prog_opt::bool_switch(),                                  "paths of files end with NUL, groups too (--format=null)")
+                ("stats",prog_opt::value<std::string>()->implicit_value("text"),   "print statistics of scan and reads to stderr (text, json)")
+                ("profile",prog_opt::value<std::string>(),                          "write profile of CPU to file (build with BAYAN_WITH_PROFILER)")
+                ("threads",prog_opt::value<size_t>()->default_value(0),             "count of threads for scan and compare (0 - by count of cores)")
+                ("watch",prog_opt::bool_switch(),                                   "after search watch directories (inotify) and print new doubles until SIGINT/SIGTERM")
+                ("checkpoint",prog_opt::value<std::string>(),                       "file of checkpoints of search for --resume (removed after success)")
+                ("resume",prog_opt::bool_switch(),                                  "continue interrupted search from --checkpoint")
+                ("shards",prog_opt::value<size_t>()->default_value(0),              "count of processes of search partitioned by directories and sizes (0 - in this process)")
                 ;
 
         ///    Пример запуска этой утилиты
         // bayan --sc="path" "path" --unsc="path" "path" --dpth=2 --msf=5 --mask="*" --sb=20 --hash=md5
-        // bayan --sc="./" "/home/user/0_projects" --unsc="/home/user/0_projects/Arduino/libraries/ArduinoRS485"  "/home/ermolov/0_projects/Arduino/libraries/Modbus-Master-Slave-for-Arduino-master" --dpth=4 --msf=5 --mask=".*\.(cpp|h)" --sb=20 --hash=sha1
+        // bayan --sc="./" "/home/user/0_projects" --unsc="/home/user/0_projects/Arduino/libraries/ArduinoRS485"  "/home/ermolov/0_projects/Arduino/libraries/Modbus-Master-Slave-for-Arduino-master" --dpth=4 --msf=5 --mask="*.cpp" "*.h" --sb=20 --hash=sha1
 
         prog_opt::variables_map vm;
         prog_opt::store(parse_command_line(argc, argv, desc), vm);
         prog_opt::notify(vm);
 
+        const CpuProfiler profiler(vm.count("profile") ? vm["profile"].as<std::string>() : std::string());
+        const std::string statsFormat = vm.count("stats") ? vm["stats"].as<std::string>() : std::string();
+        if (!statsFormat.empty() && (statsFormat != "text") && (statsFormat != "json"))
+        {   throw std::invalid_argument("Unknown --stats format: " + statsFormat + " (available: text, json)"); }
+
         if (vm.count("sc"))
         {
-            optionsBuilder.withPathScan(vm["sc"].as<std::vector<std::string>>());
+            ///    Повторённый корень сканирования обходится один раз (вложенные
+            ///    корни остаются: глубина --dpth отсчитывается от каждого)
+            std::vector<std::string> pathsForScan;
+            for (const std::string& pathForScan: vm["sc"].as<std::vector<std::string>>())
+            {
+                const std::string root = ExclusionTrie::canonicalize(path(pathForScan)).string();
+                if (std::find(pathsForScan.begin(), pathsForScan.end(), root) == pathsForScan.end())
+                {   pathsForScan.push_back(root);   }
+            }
+            optionsBuilder.withPathScan(pathsForScan);
         }
         if (vm.count("unsc"))
         {
@@ -164,195 +194,228 @@ int main(int argc, const char* argv[])
         }
         if (vm.count("mask"))
         {
-            optionsBuilder.withMaskForScan(vm["mask"].as<std::string>());
+            optionsBuilder.withMasksForScan(vm["mask"].as<std::vector<std::string>>());
+        }
+        if (vm["mask-regex"].as<bool>())
+        {
+            optionsBuilder.withMaskRegex(true);
+        }
+        for (const char* name : {"sb", "sbmax"})
+        {
+            // Размеры блоков хранятся в DataFile как uint32_t, 0 не сдвигает чтение
+            const size_t size = vm[name].as<size_t>();
+            if ((size == 0) || (size > std::numeric_limits<uint32_t>::max()))
+            {   throw std::invalid_argument("--" + std::string(name) + " must be from 1 to " + std::to_string(std::numeric_limits<uint32_t>::max()));  }
         }
         if (vm.count("sb"))
         {
             optionsBuilder.withSizeOfBlock(vm["sb"].as<size_t>());
         }
+        if (vm.count("sbmax"))
+        {
+            optionsBuilder.withMaxSizeOfBlock(vm["sbmax"].as<size_t>());
+        }
         if (vm.count("hash"))
         {
             optionsBuilder.withHashAlg(vm["hash"].as<std::string>());
         }
+        if (vm.count("cmp"))
+        {
+            const std::string compareMode = vm["cmp"].as<std::string>();
+            if ((compareMode != "hash") && (compareMode != "bytes"))
+            {   throw std::invalid_argument("Unknown --cmp mode: " + compareMode + " (available: hash, bytes)");  }
+            optionsBuilder.withCompareMode(compareMode);
+        }
+        if (vm.count("fdmax"))
+        {
+            optionsBuilder.withMaxOpenFiles(vm["fdmax"].as<size_t>());
+        }
+        if (vm.count("io"))
+        {
+            const std::string ioMode = vm["io"].as<std::string>();
+            if ((ioMode != "auto") && (ioMode != "mmap") && (ioMode != "stream") && (ioMode != "pread"))
+            {   throw std::invalid_argument("Unknown --io method: " + ioMode + " (available: mmap, stream, pread, auto)");  }
+            optionsBuilder.withIoMode(ioMode);
+        }
+        if (vm.count("qd"))
+        {
+            optionsBuilder.withQueueDepth(vm["qd"].as<size_t>());
+        }
+        if (vm["direct"].as<bool>())
+        {
+            if ((vm["sb"].as<size_t>() % AlignedBufferPool::kAlignment == 0)
+                    && (vm["sbmax"].as<size_t>() % AlignedBufferPool::kAlignment == 0))
+            {   optionsBuilder.withDirectIo(true);  }
+            else
+            {   std::cerr << "--direct is ignored: --sb and --sbmax must be multiples of " << AlignedBufferPool::kAlignment << '\n';  }
+        }
+        if (vm.count("cache"))
+        {
+            optionsBuilder.withCachePath(vm["cache"].as<std::string>());
+        }
+        if (vm.count("hardlinks"))
+        {
+            optionsBuilder.withHardlinks(vm["hardlinks"].as<std::string>());
+        }
+        if (vm["sample"].as<bool>())
+        {
+            optionsBuilder.withSample(true);
+        }
+        if (vm.count("threads"))
+        {
+            optionsBuilder.withCntThreads(vm["threads"].as<size_t>());
+        }
+        if (vm.count("order"))
+        {
+            optionsBuilder.withReadOrder(vm["order"].as<std::string>());
+        }
+        if (vm.count("devq"))
+        {
+            optionsBuilder.withDeviceQueueDepth(vm["devq"].as<size_t>());
+        }
+        if (vm.count("format"))
+        {
+            optionsBuilder.withOutputFormat(vm["format"].as<std::string>());
+        }
+        if (vm["null"].as<bool>())
+        {
+            optionsBuilder.withOutputFormat("null");
+        }
+        if (vm["watch"].as<bool>())
+        {
+            optionsBuilder.withWatch(true);
+        }
+        if (vm.count("checkpoint"))
+        {
+            optionsBuilder.withCheckpointPath(vm["checkpoint"].as<std::string>());
+        }
+        if (vm["resume"].as<bool>())
+        {
+            optionsBuilder.withResume(true);
+        }
+        if (vm.count("shards"))
+        {
+            optionsBuilder.withCntShards(vm["shards"].as<size_t>());
+        }
 
 
         Settings options = optionsBuilder.build();
 
+        if (options.getCompareMode() != "bytes")
+        {   findHashAlgorithm(options.getHashAlg());   }
+        if ((options.getHardlinks() != "dup") && (options.getHardlinks() != "ignore"))
+        {   throw std::invalid_argument("Unknown --hardlinks mode: " + options.getHardlinks() + " (available: dup, ignore)"); }
+        if ((options.getReadOrder() != "physical") && (options.getReadOrder() != "inode") && (options.getReadOrder() != "none"))
+        {   throw std::invalid_argument("Unknown --order: " + options.getReadOrder() + " (available: physical, inode, none)"); }
+        if (options.isResume() && options.getCheckpointPath().empty())
+        {   throw std::invalid_argument("--resume requires --checkpoint");  }
+        if (options.isWatch() && !options.getCheckpointPath().empty())
+        {   throw std::invalid_argument("--checkpoint cannot be used with --watch");    }
+        if ((options.getCntShards() != 0) && (options.isWatch() || !options.getCheckpointPath().empty() || !options.getCachePath().empty()))
+        {   throw std::invalid_argument("--shards cannot be used with --watch, --checkpoint or --cache");  }
+
+        // SIGINT и SIGTERM для --watch принимаются через signalfd: блокируются
+        // до создания потока сброса вывода
+        if (options.isWatch())
+        {
+#ifdef BAYAN_HAVE_INOTIFY
+            DoublesWatcher::blockSignals();
+#else
+            throw std::invalid_argument("--watch is not supported on this system (no inotify)");
+#endif
+        }
 
-        size_t curDepthScan = 0;
-        const auto& listUnScan = options.getPathsForUnScan();
+        ioStats.isCollectGroups = !statsFormat.empty();
+        ioStats.isCollectDevices = !statsFormat.empty();
 
         ///    1. Исколючение из поиска путей, которые не нужно сканировать (m_pathsForUnScan)
-        for (path currPath: options.getPathsForScan())
-        {
-            currPath = (currPath.is_relative())? current_path() : currPath;
+        const ExclusionTrie exclusions(options.getPathsForUnScan());
 
+        // Процессы --shards создаются до потока сброса вывода
+        std::unique_ptr<ShardCoordinator> shardCoordinator;
+        if (options.getCntShards() != 0)
+        {   shardCoordinator = std::make_unique<ShardCoordinator>(options, exclusions, options.getCntShards());  }
 
-            // Исключение из проверки
-            bool isFoundFullUnScanPath = false;
-            std::vector<path> foundPartialUnScanPath(listUnScan.size());
-            for (const auto& item : listUnScan)
-            {
-//                std::cout << "1@ " << currPath << '\t';
-//                std::cout << "2@ " << item << '\n';
-                if ((currPath.compare(item) == 0))
-                {
-//                    std::cout << "Full@ " << item << '\n';
-                    isFoundFullUnScanPath = true;   // Full match
-                    break;
-                }
+        ResultWriter resultWriter(STDOUT_FILENO, options.getOutputFormat());
 
-                if ((currPath.compare(item) == -1))
+        auto onGroup = [&resultWriter](DoublesGroup&& group) {
+            ///    7. Вывод настоящих файлов-дубликатов сразу после подтверждения группы
+            resultWriter.write(group);
+        };
+
+        if (shardCoordinator)
+        {
+            ///    1-6. Обход и сравнение процессами, группы размеров разделены между ними
+            shardCoordinator->run(onGroup);
+            shardCoordinator.reset();
+        }
+        else
+        {
+            ///    Продолжение прерванного поиска: индекс обхода и уже найденные
+            ///    группы берутся из контрольной точки
+            std::unique_ptr<Checkpoint> checkpoint;
+            bool isResumed = false;
+            if (!options.getCheckpointPath().empty())
+            {
+                checkpoint = std::make_unique<Checkpoint>(options.getCheckpointPath(), options);
+                if (options.isResume())
                 {
-//                    std::cout << "Part@" << item << '\n';
-                    foundPartialUnScanPath.push_back(item);  // Partial match
+                    isResumed = checkpoint->load(onGroup);
+                    if (!isResumed)
+                    {   std::cerr << "No checkpoint in " << options.getCheckpointPath() << ", search starts anew\n";  }
                 }
             }
 
-            if (!isFoundFullUnScanPath)
+            ///    Наблюдение за директориями (--watch) ставится по ходу обхода
+            ParallelWalker::DirHandler onDir;
+#ifdef BAYAN_HAVE_INOTIFY
+            std::unique_ptr<DoublesWatcher> watcher;
+            if (options.isWatch())
             {
-                if (!foundPartialUnScanPath.empty())
-                {
-//                    std::cout << "Part " << currPath.string() << '\n';
+                watcher = std::make_unique<DoublesWatcher>(options, exclusions);
+                onDir = watcher->getDirHandler();
+            }
+#endif
 
-                    outputFiles(options, currPath, curDepthScan, foundPartialUnScanPath);
-                }
-                else
+            if (!isResumed)
+            {
+                const PhaseTimer phaseTimer(IoStats::kPhaseScan);
+                for (const std::string& pathForScan: options.getPathsForScan())
                 {
-//                    std::cout << "|878_" << currPath.string() << '\n';
-                    outputFiles(options, currPath, curDepthScan, foundPartialUnScanPath);
+                    outputFiles(options, ExclusionTrie::canonicalize(path(pathForScan)), exclusions, onDir);
                 }
+                if (checkpoint)
+                {   checkpoint->start();    }
             }
-            else
+
+            ///    2-6. Поиск дубликатов среди файлов одного размера
+#ifdef BAYAN_HAVE_INOTIFY
+            if (watcher)
             {
-                // Исключение path из проверки
-//                std::cout << "Full " << currPath.string() << '\n';
-                continue;
+                ///    8. Слежение за директориями: новые дубликаты выводятся по мере появления
+                watcher->run(onGroup);
             }
-        }
-
-
-
-        ///    2 б). Исколючение из поиска файлов, которые "уникальны" по размеру
-        for (auto itMap = doubleFiles.begin(); itMap != doubleFiles.end();)
-        {
-            if (doubleFiles.count(itMap->first) == 1)
-            {   itMap = doubleFiles.erase(itMap);    }
             else
+#endif
             {
-                auto bucket = doubleFiles.bucket(itMap->first);
-                auto itr = doubleFiles.begin(bucket);
-                auto referenceSize = file_size((*itr).second);
-                auto blockSize = options.getSizeOfBlock();
-
-
-                std::list<DataFile> openedFiles;
-                for (auto it = doubleFiles.begin(bucket); it != doubleFiles.end(bucket); ++it)
-                {
-                    if (referenceSize == file_size((*it).second))
-                    {
-                        openedFiles.emplace_back((*it).second.string(), blockSize);
-                    }
-                }
-
-std::cout << '\n';
-std::cout << '\n';
-std::cout << '\n';
-
-                size_t cntProcessedFiles = 0;
-                while(cntProcessedFiles != openedFiles.size())
-                {
-                    for (auto& item: openedFiles)
-                    {
-                        auto restReadSize = item.fileSize - item.fd.tellg();
-                        if (restReadSize > 0)
-                        {
-                            ///    3. Формирование необходимого  размера блока данных
-                            auto currBlockSize = ((restReadSize / item.blockSize)  >= 1.0) ? item.blockSize : restReadSize;
-                            std::unique_ptr<char[]> readBlock = std::make_unique<char[]>(item.blockSize);
-
-                            ///    4. Чтение блока данных из преодполагаемых файлов-дубликатов
-                            item.fd.read(readBlock.get(), currBlockSize);
-
-                            if (!item.fd.fail())
-                            {
-//                                std::cout << std::string(readBlock.get(), currBlockSize) << '\n';
-
-                                ///    5. Получение хэша блока данных выбранным методом
-                                if (options.getHashAlg() == "sha1")
-                                {
-                                    item.hashFile += getHash<sha1, sha1::digest_type>(readBlock.get(), currBlockSize);
-                                }
-                                else
-                                {
-                                    item.hashFile += getHash<md5, md5::digest_type>(readBlock.get(), currBlockSize);
-                                }
-                            }
-                        }
-                        else
-                        {
-                            ++cntProcessedFiles;
-                            ++itMap;
-
-                            if (item.fd.is_open())
-                            {   item.fd.close();    }
-
-                             continue;
-                        }
-                    }
-
-                    ///    6. Немедленное прекращение чтения файла, который оказался уникальным
-                    std::queue<decltype(openedFiles.begin())> removeItems;
-                    for (auto refIt = openedFiles.begin(); refIt != openedFiles.end(); ++refIt)
-                    {
-                        const std::string& referenceStr = (*refIt).hashFile;
-                        auto otherIt = openedFiles.begin();
-                        for (; otherIt != openedFiles.end(); ++otherIt)
-                        {
-                            if (((*otherIt).hashFile == referenceStr) && (otherIt != refIt))
-                            {   break;  }
-                        }
-
-                        if (otherIt == openedFiles.end())
-                        {
-//                            std::cout << "Erase()! " << (*refIt).pathToFile << '\t';
-
-                            if ((*refIt).fd.is_open())
-                            {   (*refIt).fd.close();   }
-
-                            ++itMap;
-
-                            removeItems.push(refIt);
-                        }
-                    }
-
-                    while(removeItems.size() != 0)
-                    {
-                        openedFiles.erase(removeItems.front());
-                        removeItems.pop();
-                    }
-                }
-
-                ///    7. Вывод настоящих файлов-дубликатов
-                std::cout << "Doubles:\n";
-                for (auto& item: openedFiles)
-                {
-                    std::cout << item.pathToFile << '\n';
-                }
+                findDoubles(options, onGroup, nullptr, checkpoint.get());
+                if (checkpoint)
+                {   checkpoint->finish();   }
             }
         }
+        resultWriter.flush();
 
-        std::cout << "\n\nDestructions objects:\n";
+        if (!statsFormat.empty())
+        {
+            printStats(std::cerr, statsFormat == "json");
+        }
     }
     catch (const std::exception& except)
     {
         std::cerr << except.what() << '\n';
+        return 1;
     }
 
-
-    std::cout << "\n";
-
-    ProfilerStop();
     return 0;
 }
 
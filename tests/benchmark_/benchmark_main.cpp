@@ -0,0 +1,271 @@
+#include "../../lib.hpp"
+#include "tree_generator.hpp"
+
+#include <benchmark/benchmark.h>
+
+
+/*!
+    Бенчмарки bayan: микробенчмарки обхода директорий, сопоставления масок,
+    хэширования блоков и уточнения групп одного размера, а также полный
+    поиск дубликатов в синтетических деревьях.
+
+    Деревья создаются generateTree() в getBenchDir() (по умолчанию tmpfs
+    /dev/shm) один раз за запуск и удаляются при выходе. Полный поиск
+    сообщает пропускную способность (объём дерева в секунду), объём
+    прочитанного и его отношение к нижней границе bytesMinRead.
+*/
+namespace
+{
+
+/// Деревья бенчмарков по именам; удаляются при завершении программы
+class TreeCache
+{
+    std::map<std::string, bench::GeneratedTree> m_trees;
+
+public:
+    ~TreeCache()
+    {
+        for (const auto& item : m_trees)
+        {
+            boost::system::error_code error;
+            remove_all(item.second.root, error);
+        }
+    }
+
+    const bench::GeneratedTree& get(const std::string& name, const bench::TreeSpec& spec)
+    {
+        auto itTree = m_trees.find(name);
+        if (itTree == m_trees.end())
+        {
+            const path root = bench::getBenchDir() / ("bayan-bench-" + name + "-" + std::to_string(::getpid()));
+            itTree = m_trees.emplace(name, bench::generateTree(spec, root)).first;
+        }
+        return itTree->second;
+    }
+};
+
+TreeCache treeCache;
+
+
+/// Много мелких файлов в глубоком дереве: стоимость обхода, а не чтения
+bench::TreeSpec getWalkSpec()
+{
+    bench::TreeSpec spec;
+    spec.depth = 4;
+    spec.dirsPerDir = 4;
+    spec.filesPerDir = 32;
+    spec.minFileSize = 8;
+    spec.maxFileSize = 64;
+    spec.cntSizeClasses = 0;
+    return spec;
+}
+
+/// Смесь размеров от 1 КиБ до 1 МиБ, пятая часть файлов - копии
+bench::TreeSpec getMixedSpec()
+{
+    bench::TreeSpec spec;
+    spec.seed = 2;
+    return spec;
+}
+
+/// Тысячи мелких файлов, много групп одного размера и мало дубликатов
+bench::TreeSpec getSmallSpec()
+{
+    bench::TreeSpec spec;
+    spec.seed = 3;
+    spec.depth = 3;
+    spec.filesPerDir = 32;
+    spec.minFileSize = 64;
+    spec.maxFileSize = 16 * 1024;
+    spec.cntSizeClasses = 256;
+    spec.duplicateRatio = 0.1;
+    spec.sharedPrefix = 0;
+    return spec;
+}
+
+/// Крупные файлы нескольких размеров с общим заголовком 64 КиБ (медиафайлы)
+bench::TreeSpec getMediaSpec()
+{
+    bench::TreeSpec spec;
+    spec.seed = 4;
+    spec.depth = 1;
+    spec.filesPerDir = 8;
+    spec.minFileSize = 1024 * 1024;
+    spec.maxFileSize = 4 * 1024 * 1024;
+    spec.isLogUniform = false;
+    spec.cntSizeClasses = 4;
+    spec.duplicateRatio = 0.3;
+    spec.sharedPrefix = 64 * 1024;
+    return spec;
+}
+
+
+/// Обход дерева getWalkSpec() в state.range(0) потоков (0 - по числу ядер)
+void BM_Walker(benchmark::State& state)
+{
+    const auto& tree = treeCache.get("walk", getWalkSpec());
+
+    SettingsBuilder optionsBuilder;
+    Settings options = optionsBuilder.withDepthScan(getWalkSpec().depth + 2)
+                                     .withCntThreads(static_cast<size_t>(state.range(0))).build();
+    const ExclusionTrie exclusions;
+
+    for (auto _ : state)
+    {
+        fileIndex.clear();
+        outputFiles(options, tree.root, exclusions);
+        if (fileIndex.size() != tree.paths.size())
+        {   state.SkipWithError("walker found wrong count of files");  }
+    }
+    fileIndex.clear();
+
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * (tree.paths.size() + tree.cntDirs)));
+    state.counters["dirs"] = static_cast<double>(tree.cntDirs);
+    state.counters["files"] = static_cast<double>(tree.paths.size());
+}
+BENCHMARK(BM_Walker)->Arg(1)->Arg(0)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+
+/// Сопоставление 10000 имён с масками
+void BM_FileMask(benchmark::State& state, const std::vector<std::string>& masks, bool isRegex)
+{
+    const auto names = bench::generateNames(1, 10000, {".txt", ".cpp", ".h", ".hpp", ".JPG", ".tar.gz", ""});
+    const FileMask fileMask(masks, isRegex);
+
+    for (auto _ : state)
+    {
+        size_t cntMatched = 0;
+        for (const auto& name : names)
+        {   cntMatched += fileMask.match(name) ? 1 : 0;   }
+        benchmark::DoNotOptimize(cntMatched);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * names.size()));
+}
+BENCHMARK_CAPTURE(BM_FileMask, any, std::vector<std::string>{"*"}, false);
+BENCHMARK_CAPTURE(BM_FileMask, suffix, std::vector<std::string>{"*.cpp"}, false);
+BENCHMARK_CAPTURE(BM_FileMask, suffixes, std::vector<std::string>{"*.cpp", "*.h", "*.hpp", "*.jpg"}, false);
+BENCHMARK_CAPTURE(BM_FileMask, glob, std::vector<std::string>{"*a?[0-9]*.*"}, false);
+BENCHMARK_CAPTURE(BM_FileMask, regex, std::vector<std::string>{"\\.(cpp|hpp)$"}, true);
+
+
+/// Хэширование блока размера state.range(0)
+template <typename Hasher>
+void BM_Hash(benchmark::State& state)
+{
+    std::string block(static_cast<size_t>(state.range(0)), '\0');
+    bench::SplitMix64 random(1);
+    for (auto& ch : block)
+    {   ch = static_cast<char>(random.next());  }
+
+    for (auto _ : state)
+    {   benchmark::DoNotOptimize(getHash<Hasher>(block.data(), block.size()));  }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * block.size()));
+}
+BENCHMARK_TEMPLATE(BM_Hash, Md5Hasher)->Range(4 * 1024, 1024 * 1024);
+BENCHMARK_TEMPLATE(BM_Hash, Sha1Hasher)->Range(4 * 1024, 1024 * 1024);
+BENCHMARK_TEMPLATE(BM_Hash, Crc32Hasher)->Range(4 * 1024, 1024 * 1024);
+#if defined(__x86_64__)
+BENCHMARK_TEMPLATE(BM_Hash, Crc32HwHasher)->Range(4 * 1024, 1024 * 1024);
+#endif
+#ifdef BAYAN_WITH_XXHASH
+BENCHMARK_TEMPLATE(BM_Hash, Xxh3Hasher)->Range(4 * 1024, 1024 * 1024);
+BENCHMARK_TEMPLATE(BM_Hash, Xxh128Hasher)->Range(4 * 1024, 1024 * 1024);
+#endif
+#ifdef BAYAN_WITH_BLAKE3
+BENCHMARK_TEMPLATE(BM_Hash, Blake3Hasher)->Range(4 * 1024, 1024 * 1024);
+#endif
+
+
+/*!
+    Уточнение одной группы из state.range(0) файлов по 256 КиБ с общим
+    началом state.range(1) байт, четверть файлов - копии
+*/
+void BM_GroupRefinement(benchmark::State& state, const std::string& compareMode)
+{
+    bench::TreeSpec spec;
+    spec.depth = 0;
+    spec.filesPerDir = static_cast<size_t>(state.range(0));
+    spec.minFileSize = 256 * 1024;
+    spec.maxFileSize = spec.minFileSize;
+    spec.cntSizeClasses = 1;
+    spec.duplicateRatio = 0.25;
+    spec.sharedPrefix = static_cast<uint64_t>(state.range(1));
+    const auto& tree = treeCache.get("group-" + std::to_string(state.range(0)) + "-" + std::to_string(state.range(1)), spec);
+
+    SettingsBuilder optionsBuilder;
+    const Settings options = optionsBuilder.withCompareMode(compareMode).build();
+    DoublesFinder finder(options);
+
+    const uint64_t bytesReadStart = ioStats.bytesRead;
+    for (auto _ : state)
+    {
+        std::list<DataFile> openedFiles;
+        for (const auto& pathToFile : tree.paths)
+        {   openedFiles.emplace_back(pathToFile, options.getSizeOfBlock(), options.getMaxSizeOfBlock());  }
+
+        size_t cntGroups = 0;
+        finder.find(openedFiles, [&cntGroups](std::vector<std::string>&&, const std::string&) {
+            ++cntGroups;
+        });
+        if (cntGroups != tree.cntDoubleGroups)
+        {   state.SkipWithError("wrong count of groups of doubles");  }
+    }
+
+    const uint64_t bytesRead = ioStats.bytesRead - bytesReadStart;
+    state.SetBytesProcessed(static_cast<int64_t>(bytesRead));
+    state.counters["read_ratio"] = static_cast<double>(bytesRead) / static_cast<double>(state.iterations() * tree.bytesMinRead);
+}
+BENCHMARK_CAPTURE(BM_GroupRefinement, hash, std::string("hash"))
+        ->ArgsProduct({{16, 64}, {0, 64 * 1024, 192 * 1024}})->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_GroupRefinement, bytes, std::string("bytes"))
+        ->ArgsProduct({{16, 64}, {0, 64 * 1024, 192 * 1024}})->Unit(benchmark::kMillisecond);
+
+
+/*!
+    Полный поиск: обход дерева, группировка по размеру и сравнение
+    в state.range(0) потоков. Пропускная способность - объём дерева
+    в секунду; bytes_read - прочитано за проход, bytes_min - нижняя
+    граница, read_ratio - их отношение
+*/
+void BM_EndToEnd(benchmark::State& state, const std::string& name, const bench::TreeSpec& spec)
+{
+    const auto& tree = treeCache.get(name, spec);
+
+    SettingsBuilder optionsBuilder;
+    Settings options = optionsBuilder.withDepthScan(spec.depth + 2)
+                                     .withCntThreads(static_cast<size_t>(state.range(0))).build();
+    const ExclusionTrie exclusions;
+
+    const uint64_t bytesReadStart = ioStats.bytesRead;
+    for (auto _ : state)
+    {
+        fileIndex.clear();
+        outputFiles(options, tree.root, exclusions);
+
+        size_t cntGroups = 0;
+        findDoubles(options, [&cntGroups](DoublesGroup&&) {
+            ++cntGroups;
+        });
+        if (cntGroups != tree.cntDoubleGroups)
+        {   state.SkipWithError("wrong count of groups of doubles");  }
+    }
+    fileIndex.clear();
+
+    const double bytesRead = static_cast<double>(ioStats.bytesRead - bytesReadStart) / static_cast<double>(state.iterations());
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * tree.bytesTotal));
+    state.counters["files"] = static_cast<double>(tree.paths.size());
+    state.counters["bytes_read"] = bytesRead;
+    state.counters["bytes_min"] = static_cast<double>(tree.bytesMinRead);
+    state.counters["read_ratio"] = bytesRead / static_cast<double>(tree.bytesMinRead);
+}
+BENCHMARK_CAPTURE(BM_EndToEnd, mixed, std::string("mixed"), getMixedSpec())
+        ->Arg(1)->Arg(0)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_EndToEnd, small, std::string("small"), getSmallSpec())
+        ->Arg(1)->Arg(0)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_EndToEnd, media, std::string("media"), getMediaSpec())
+        ->Arg(1)->Arg(0)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+}   // namespace
+
+
+BENCHMARK_MAIN();
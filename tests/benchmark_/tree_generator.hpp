@@ -0,0 +1,274 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+
+/*!
+    Генератор синтетических деревьев директорий с дубликатами для бенчмарков.
+
+    Дерево полностью определяется TreeSpec: одинаковые параметры и seed
+    дают одинаковые имена, размеры и содержимое файлов на любой машине
+    (собственный генератор SplitMix64 вместо std::*_distribution, которые
+    зависят от реализации стандартной библиотеки).
+*/
+namespace bench
+{
+
+/// Генератор псевдослучайных чисел SplitMix64
+class SplitMix64
+{
+    uint64_t m_state;
+
+public:
+    explicit SplitMix64(uint64_t seed)
+        : m_state(seed)
+    {}
+
+    uint64_t next()
+    {
+        uint64_t z = (m_state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    /// Число из [0, bound)
+    uint64_t uniform(uint64_t bound)
+    {   return static_cast<uint64_t>((static_cast<unsigned __int128>(next()) * bound) >> 64);  }
+
+    /// Число из [0, 1)
+    double uniformReal()
+    {   return static_cast<double>(next() >> 11) * 0x1.0p-53;  }
+
+    /// Число из [minValue, maxValue], равномерное по значению или по его логарифму
+    uint64_t range(uint64_t minValue, uint64_t maxValue, bool isLogUniform)
+    {
+        if (!isLogUniform)
+        {   return minValue + uniform(maxValue - minValue + 1);  }
+        const double logMin = std::log(static_cast<double>(minValue));
+        const double logMax = std::log(static_cast<double>(maxValue) + 1.0);
+        const uint64_t value = static_cast<uint64_t>(std::exp(logMin + uniformReal() * (logMax - logMin)));
+        return std::min(std::max(value, minValue), maxValue);
+    }
+};
+
+
+/*!
+    Структура TreeSpec - параметры дерева:
+    depth - уровней вложенных директорий под корнем (0 - только корень),
+    dirsPerDir и filesPerDir - директорий и файлов в каждой директории,
+    размеры файлов - из [minFileSize, maxFileSize] (не меньше 8 байт),
+    равномерно или равномерно по логарифму (много мелких, мало крупных);
+    cntSizeClasses - сколько разных размеров выбирается заранее
+    (0 - свой размер у каждого файла), чем их меньше, тем больше файлов
+    попадает в группы одного размера;
+    duplicateRatio - доля файлов, копирующих уже созданный файл;
+    sharedPrefix - длина общего начала у всех файлов одного размера
+    (заголовки медиафайлов, образы дисков).
+*/
+struct TreeSpec
+{
+    uint64_t seed = 1;
+    size_t depth = 2;
+    size_t dirsPerDir = 4;
+    size_t filesPerDir = 16;
+    uint64_t minFileSize = 1024;
+    uint64_t maxFileSize = 1024 * 1024;
+    bool isLogUniform = true;
+    size_t cntSizeClasses = 64;
+    double duplicateRatio = 0.2;
+    uint64_t sharedPrefix = 4096;
+    std::vector<std::string> extensions = {".txt", ".cpp", ".h", ".jpg", ".bin"};
+};
+
+
+/*!
+    Структура GeneratedTree - созданное дерево и ожидаемый результат поиска.
+
+    bytesCandidates - объём файлов в группах одного размера.
+    bytesMinRead - нижняя граница объёма чтения для любого алгоритма:
+    каждая копия дубликата читается целиком, а уникальный файл из группы
+    одного размера - хотя бы до первого отличающегося байта (общее начало
+    плюс один байт). Файлы уникального размера можно не читать.
+*/
+struct GeneratedTree
+{
+    boost::filesystem::path root;
+    std::vector<std::string> paths;
+    size_t cntDirs = 0;
+    uint64_t bytesTotal = 0;
+    size_t cntDoubleGroups = 0;
+    size_t cntDoubleFiles = 0;
+    uint64_t bytesCandidates = 0;
+    uint64_t bytesMinRead = 0;
+};
+
+
+/// Длина общего начала файлов размера fileSize: за ним всегда есть 8 байт номера содержимого
+inline uint64_t getPrefixSize(const TreeSpec& spec, uint64_t fileSize)
+{   return std::min(spec.sharedPrefix, (fileSize > 8) ? fileSize - 8 : 0);  }
+
+/*!
+    Ф-ия записи содержимого contentId размера fileSize в файл pathToFile:
+    общее начало (одинаковое для всех содержимых этого размера),
+    8 байт contentId и псевдослучайный хвост, свой у каждого содержимого
+*/
+inline void writeContent(const TreeSpec& spec, const boost::filesystem::path& pathToFile
+                         , uint64_t fileSize, uint64_t contentId)
+{
+    static constexpr size_t kChunkSize = 1024 * 1024;
+
+    const uint64_t prefixSize = getPrefixSize(spec, fileSize);
+    SplitMix64 prefixRandom(spec.seed * 0x100000001B3ULL ^ fileSize);
+    SplitMix64 tailRandom(spec.seed * 0x100000001B3ULL ^ (contentId << 20) ^ 0x5DEECE66DULL);
+
+    std::ofstream out(pathToFile.string(), std::ios::binary | std::ios::trunc);
+    std::vector<char> chunk(kChunkSize);
+    for (uint64_t chunkOffset = 0; chunkOffset < fileSize; chunkOffset += kChunkSize)
+    {
+        const size_t size = static_cast<size_t>(std::min<uint64_t>(kChunkSize, fileSize - chunkOffset));
+        for (size_t i = 0; i < size; i += sizeof(uint64_t))
+        {
+            const uint64_t word = (chunkOffset + i < prefixSize) ? prefixRandom.next() : tailRandom.next();
+            std::memcpy(chunk.data() + i, &word, std::min(sizeof(word), size - i));
+        }
+        for (uint64_t i = 0; i < sizeof(contentId); ++i)
+        {
+            const uint64_t offset = prefixSize + i;
+            if ((offset >= chunkOffset) && (offset < chunkOffset + size))
+            {   chunk[offset - chunkOffset] = static_cast<char>(contentId >> (8 * i));  }
+        }
+        out.write(chunk.data(), static_cast<std::streamsize>(size));
+    }
+    if (!out)
+    {   throw std::runtime_error("Cannot write " + pathToFile.string());    }
+}
+
+/*!
+    Ф-ия создания дерева spec в директории root (прежнее содержимое root
+    удаляется)
+*/
+inline GeneratedTree generateTree(const TreeSpec& spec, const boost::filesystem::path& root)
+{
+    struct Content
+    {
+        uint64_t fileSize = 0;
+        size_t cntCopies = 0;
+    };
+
+    GeneratedTree tree;
+    tree.root = root;
+    boost::filesystem::remove_all(root);
+    boost::filesystem::create_directories(root);
+
+    SplitMix64 random(spec.seed);
+    std::vector<uint64_t> sizeClasses(spec.cntSizeClasses);
+    for (auto& fileSize : sizeClasses)
+    {   fileSize = random.range(std::max<uint64_t>(8, spec.minFileSize), spec.maxFileSize, spec.isLogUniform);  }
+
+    std::vector<Content> contents;
+    std::vector<boost::filesystem::path> dirs = {root};
+    for (size_t level = 0, begin = 0; level <= spec.depth; ++level)
+    {
+        const size_t end = dirs.size();
+        for (size_t idxDir = begin; idxDir < end; ++idxDir)
+        {
+            for (size_t i = 0; i < spec.filesPerDir; ++i)
+            {
+                uint64_t contentId = contents.size();
+                if (!contents.empty() && (random.uniformReal() < spec.duplicateRatio))
+                {   contentId = random.uniform(contents.size());  }
+                else if (!sizeClasses.empty())
+                {   contents.push_back({sizeClasses[random.uniform(sizeClasses.size())], 0});    }
+                else
+                {   contents.push_back({random.range(std::max<uint64_t>(8, spec.minFileSize), spec.maxFileSize, spec.isLogUniform), 0});    }
+
+                const std::string name = "f" + std::to_string(tree.paths.size())
+                        + spec.extensions[random.uniform(spec.extensions.size())];
+                const boost::filesystem::path pathToFile = dirs[idxDir] / name;
+                writeContent(spec, pathToFile, contents[contentId].fileSize, contentId);
+
+                ++contents[contentId].cntCopies;
+                tree.paths.push_back(pathToFile.string());
+                tree.bytesTotal += contents[contentId].fileSize;
+            }
+
+            for (size_t i = 0; (level < spec.depth) && (i < spec.dirsPerDir); ++i)
+            {
+                dirs.push_back(dirs[idxDir] / ("d" + std::to_string(i)));
+                boost::filesystem::create_directory(dirs.back());
+            }
+        }
+        begin = end;
+    }
+    tree.cntDirs = dirs.size();
+
+    std::map<uint64_t, size_t> cntFilesBySize;
+    for (const auto& content : contents)
+    {   cntFilesBySize[content.fileSize] += content.cntCopies;  }
+
+    for (const auto& content : contents)
+    {
+        if (cntFilesBySize[content.fileSize] < 2)
+        {   continue;   }
+
+        tree.bytesCandidates += content.cntCopies * content.fileSize;
+        if (content.cntCopies >= 2)
+        {
+            ++tree.cntDoubleGroups;
+            tree.cntDoubleFiles += content.cntCopies;
+            tree.bytesMinRead += content.cntCopies * content.fileSize;
+        }
+        else
+        {   tree.bytesMinRead += getPrefixSize(spec, content.fileSize) + 1;  }
+    }
+    return tree;
+}
+
+/*!
+    Ф-ия генерации count имён файлов (буквы разного регистра, цифры,
+    точки внутри имени и расширение из extensions) для сопоставления с масками
+*/
+inline std::vector<std::string> generateNames(uint64_t seed, size_t count, const std::vector<std::string>& extensions)
+{
+    static const char kChars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-.";
+
+    SplitMix64 random(seed);
+    std::vector<std::string> names(count);
+    for (auto& name : names)
+    {
+        const size_t length = 4 + random.uniform(28);
+        for (size_t i = 0; i < length; ++i)
+        {   name += kChars[random.uniform(sizeof(kChars) - 1)];  }
+        name += extensions[random.uniform(extensions.size())];
+    }
+    return names;
+}
+
+/*!
+    Ф-ия получения директории для деревьев бенчмарков: $BAYAN_BENCH_DIR,
+    иначе /dev/shm (tmpfs: чтения не зависят от диска и кэша страниц),
+    иначе временная директория
+*/
+inline boost::filesystem::path getBenchDir()
+{
+    const char* benchDir = std::getenv("BAYAN_BENCH_DIR");
+    if ((benchDir != nullptr) && (*benchDir != '\0'))
+    {   return benchDir;    }
+    if (boost::filesystem::is_directory("/dev/shm"))
+    {   return "/dev/shm";  }
+    return boost::filesystem::temp_directory_path();
+}
+
+}   // namespace bench
@@ -10,3 +10,1060 @@ TEST(Test_static_input, Subtest_1)
 {
 
 }
+
+TEST(Test_doubles_finder, Subtest_split_groups)
+{
+    const path dir = temp_directory_path() / unique_path();
+    create_directories(dir);
+
+    const std::vector<std::pair<std::string, std::string>> files = {
+        {"world.txt",  "Hello, World\n"},
+        {"world2.txt", "Hello, World\n"},
+        {"cpp.txt",    "Hello, C++\n\n\n"},
+        {"cpp2.txt",   "Hello, C++\n\n\n"},
+        {"other.txt",  "Hello, Wo\n\n\n\n"},
+    };
+    for (const auto& item : files)
+    {
+        std::ofstream(dir / item.first, std::ios::binary) << item.second;
+    }
+
+    for (const std::string compareMode : {"hash", "bytes"})
+    {
+        SettingsBuilder optionsBuilder;
+        Settings options = optionsBuilder.withSizeOfBlock(5).withCompareMode(compareMode).build();
+
+        std::list<DataFile> openedFiles;
+        for (const auto& item : files)
+        {
+            openedFiles.emplace_back((dir / item.first).string(), options.getSizeOfBlock());
+        }
+
+        DoublesFinder finder(options);
+        auto doubles = finder.find(openedFiles);
+        for (auto& group : doubles)
+        {   std::sort(group.begin(), group.end());  }
+        std::sort(doubles.begin(), doubles.end());
+
+        const std::vector<std::vector<std::string>> expected = {
+            {(dir / "cpp.txt").string(), (dir / "cpp2.txt").string()},
+            {(dir / "world.txt").string(), (dir / "world2.txt").string()},
+        };
+        EXPECT_EQ(doubles, expected) << compareMode;
+    }
+
+    remove_all(dir);
+}
+
+TEST(Test_async_reader, Subtest_read_batch)
+{
+    const path filePath = temp_directory_path() / unique_path();
+    std::string content;
+    for (size_t i = 0; i < 10000; ++i)
+    {   content += static_cast<char>('a' + i % 26);  }
+    std::ofstream(filePath, std::ios::binary) << content;
+
+    const int handle = ::open(filePath.c_str(), O_RDONLY);
+    ASSERT_NE(handle, -1);
+
+    std::vector<std::unique_ptr<AsyncReader>> readers;
+    readers.push_back(makeAsyncReader(4));
+    readers.push_back(std::make_unique<PreadPoolReader>(4));
+    readers.push_back(std::make_unique<PreadPoolReader>(2));
+    // читатели делят один пул потоков процесса
+    EXPECT_EQ(PreadThreadPool::getShared(1)->getCntThreads(), 4u);
+
+    for (auto& reader : readers)
+    {
+        std::vector<std::string> buffers(16, std::string(500, '\0'));
+        std::vector<ReadRequest> batch;
+        for (size_t i = 0; i < buffers.size(); ++i)
+        {   batch.push_back({handle, buffers[i].data(), i * 600, buffers[i].size(), buffers[i].size(), false});  }
+
+        reader->submit(batch);
+        reader->wait();
+
+        for (size_t i = 0; i < buffers.size(); ++i)
+        {
+            EXPECT_TRUE(batch[i].isDone);
+            EXPECT_EQ(buffers[i], content.substr(i * 600, 500));
+        }
+    }
+
+    ::close(handle);
+    remove(filePath);
+}
+
+#ifdef BAYAN_HAVE_IO_URING
+/// IoUringReader, у которого io_uring_enter() с номером из failedCalls завершается ошибкой
+class FailingIoUringReader : public IoUringReader
+{
+    std::set<size_t> m_failedCalls;
+    size_t m_idxCall = 0;
+
+    explicit FailingIoUringReader(std::set<size_t> failedCalls)
+        : m_failedCalls(std::move(failedCalls))
+    {}
+
+protected:
+    bool enter(unsigned cntSubmit, unsigned minComplete) override
+    {
+        if (m_failedCalls.count(m_idxCall++) != 0)
+        {
+            errno = EIO;
+            return false;
+        }
+        return IoUringReader::enter(cntSubmit, minComplete);
+    }
+
+public:
+    static std::unique_ptr<FailingIoUringReader> create(unsigned queueDepth, std::set<size_t> failedCalls)
+    {
+        std::unique_ptr<FailingIoUringReader> reader(new FailingIoUringReader(std::move(failedCalls)));
+        if (!reader->setup(queueDepth))
+        {   return nullptr; }
+        return reader;
+    }
+};
+
+TEST(Test_async_reader, Subtest_io_uring_enter_failure)
+{
+    const path filePath = temp_directory_path() / unique_path();
+    std::string content;
+    for (size_t i = 0; i < 10000; ++i)
+    {   content += static_cast<char>('a' + i % 26);  }
+    std::ofstream(filePath, std::ios::binary) << content;
+
+    const int handle = ::open(filePath.c_str(), O_RDONLY);
+    ASSERT_NE(handle, -1);
+
+    // 0 - отправка первого пакета, 1 - первое ожидание в следующем тесте
+    for (const size_t idxFailedCall: {0, 1})
+    {
+        auto reader = FailingIoUringReader::create(4, {idxFailedCall});
+        if (!reader)
+        {   GTEST_SKIP() << "io_uring is not available";    }
+
+        for (size_t idxBatch = 0; idxBatch < 2; ++idxBatch)
+        {
+            std::vector<std::string> buffers(16, std::string(500, '\0'));
+            std::vector<ReadRequest> batch;
+            for (size_t i = 0; i < buffers.size(); ++i)
+            {   batch.push_back({handle, buffers[i].data(), (i + idxBatch) * 300, buffers[i].size(), buffers[i].size(), false});  }
+
+            reader->submit(batch);
+            reader->wait();
+
+            // после ошибки невыполненные запросы читаются синхронно, как в PreadBlockSource
+            for (size_t i = 0; i < buffers.size(); ++i)
+            {
+                if (idxBatch != 0)
+                {   EXPECT_TRUE(batch[i].isDone);   }
+                if (!batch[i].isDone)
+                {   EXPECT_TRUE(preadFull(handle, buffers[i].data(), buffers[i].size(), batch[i].offset, buffers[i].size()));    }
+                EXPECT_EQ(buffers[i], content.substr((i + idxBatch) * 300, 500));
+            }
+        }
+    }
+
+    ::close(handle);
+    remove(filePath);
+}
+#endif
+
+TEST(Test_hash, Subtest_crc32c)
+{
+    const std::string data = "123456789";
+    const uint32_t expected = 0xE3069283;
+
+    uint32_t checksum = 0;
+    std::memcpy(&checksum, getHash<Crc32Hasher>(data.data(), data.size()).data(), sizeof(checksum));
+    EXPECT_EQ(checksum, expected);
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        const std::string longData = data + data + data + "0";
+        EXPECT_EQ(getHash<Crc32HwHasher>(longData.data(), longData.size())
+                  , getHash<Crc32Hasher>(longData.data(), longData.size()));
+
+        std::memcpy(&checksum, getHash<Crc32HwHasher>(data.data(), data.size()).data(), sizeof(checksum));
+        EXPECT_EQ(checksum, expected);
+    }
+#endif
+}
+
+TEST(Test_buffer_pool, Subtest_reuse_buffers)
+{
+    AlignedBufferPool pool;
+
+    char* first = pool.acquire(100);
+    char* second = pool.acquire(5000);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(first) % AlignedBufferPool::kAlignment, 0u);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(second) % AlignedBufferPool::kAlignment, 0u);
+    EXPECT_EQ(AlignedBufferPool::getCapacity(5000), 8192u);
+
+    pool.release(first, 100);
+    pool.release(second, 5000);
+    EXPECT_EQ(pool.acquire(4096), first);
+    EXPECT_EQ(pool.acquire(8000), second);
+    EXPECT_EQ(pool.getCntBuffers(), 2u);
+}
+
+TEST(Test_open_files_cache, Subtest_budget_and_lru)
+{
+    const path dir = temp_directory_path() / unique_path();
+    create_directories(dir);
+
+    std::list<DataFile> files;
+    for (const std::string name: {"a", "b", "c"})
+    {
+        std::ofstream(dir / name) << name;
+        files.emplace_back((dir / name).string(), 1);
+    }
+    DataFile& a = files.front();
+    DataFile& b = *std::next(files.begin());
+    DataFile& c = files.back();
+
+    size_t cntOpen = 0;
+    size_t maxCntOpen = 0;
+    std::map<std::string, size_t> cntOpens;
+    const OpenFilesCache::OpenFunc openHandle = [&](DataFile& item)
+    {
+        item.handle = ::open(item.pathToFile.c_str(), O_RDONLY);
+        maxCntOpen = std::max(maxCntOpen, ++cntOpen);
+        ++cntOpens[item.pathToFile];
+        return item.handle != -1;
+    };
+    const OpenFilesCache::CloseFunc closeHandle = [&](DataFile& item)
+    {
+        ::close(item.handle);
+        item.handle = -1;
+        --cntOpen;
+    };
+    // второй способ чтения делит с первым тот же бюджет
+    const OpenFilesCache::OpenFunc openStream = [&](DataFile& item)
+    {
+        item.fd.open(item.pathToFile, std::ios::in | std::ios::binary);
+        maxCntOpen = std::max(maxCntOpen, ++cntOpen);
+        return item.fd.is_open();
+    };
+    const OpenFilesCache::CloseFunc closeStream = [&](DataFile& item)
+    {
+        item.fd.close();
+        --cntOpen;
+    };
+    OpenFilesCache cache(2);
+
+    EXPECT_TRUE(cache.acquire(a, openHandle, closeHandle));
+    EXPECT_TRUE(cache.acquire(b, openHandle, closeHandle));
+    EXPECT_TRUE(cache.acquire(a, openHandle, closeHandle));
+    EXPECT_TRUE(cache.acquire(c, openStream, closeStream));     // закрывается b - дольше всех не читался
+    EXPECT_NE(a.handle, -1);
+    EXPECT_EQ(b.handle, -1);
+    EXPECT_TRUE(c.fd.is_open());
+
+    EXPECT_TRUE(cache.acquire(b, openHandle, closeHandle));     // b переоткрывается, закрывается a
+    EXPECT_EQ(a.handle, -1);
+    EXPECT_NE(b.handle, -1);
+    EXPECT_EQ(cntOpens[b.pathToFile], 2u);
+    EXPECT_EQ(cntOpens[a.pathToFile], 1u);
+    EXPECT_EQ(cache.size(), 2u);
+    EXPECT_EQ(maxCntOpen, 2u);
+
+    cache.closeAll(closeHandle);
+    EXPECT_EQ(b.handle, -1);
+    EXPECT_TRUE(c.fd.is_open());
+    cache.close(c);
+    EXPECT_FALSE(c.fd.is_open());
+    EXPECT_EQ(cntOpen, 0u);
+    EXPECT_EQ(cache.size(), 0u);
+
+    // поиск с бюджетом в 2 файла переоткрывает файлы, но находит ту же группу
+    const Settings options = SettingsBuilder().withSizeOfBlock(4).withMaxOpenFiles(2).build();
+    std::list<DataFile> openedFiles;
+    for (int i = 0; i < 5; ++i)
+    {
+        const path pathToFile = dir / ("same" + std::to_string(i));
+        std::ofstream(pathToFile) << "0123456789ab";
+        openedFiles.emplace_back(pathToFile.string(), options.getSizeOfBlock());
+    }
+    const uint64_t cntOpensBefore = ioStats.cntOpens.load();
+    auto doubles = DoublesFinder(options, options.getMaxOpenFiles()).find(openedFiles);
+    ASSERT_EQ(doubles.size(), 1u);
+    EXPECT_EQ(doubles.front().size(), 5u);
+    EXPECT_GT(ioStats.cntOpens.load() - cntOpensBefore, 5u);
+
+    remove_all(dir);
+}
+
+TEST(Test_digest_cache, Subtest_save_and_lookup)
+{
+    const path cachePath = temp_directory_path() / unique_path();
+    const path filePath = temp_directory_path() / unique_path();
+    std::ofstream(filePath, std::ios::binary) << "0123456789";
+
+    const CacheKey key = CacheKey::make(FileStat::load(filePath.string()), 5, 5, "md5");
+    CacheKey otherKey = key;
+    otherKey.blockSize = 4;
+
+    {
+        BlockDigestCache cache(cachePath.string());
+        EXPECT_TRUE(cache.lookup(key, 4).empty());
+        cache.update(key, 4, "aaaabbbb");
+        ASSERT_TRUE(cache.save());
+    }
+    {
+        BlockDigestCache cache(cachePath.string());
+        EXPECT_EQ(cache.lookup(key, 4), "aaaabbbb");
+        EXPECT_TRUE(cache.lookup(key, 8).empty());
+        cache.update(otherKey, 4, "cccc");
+        ASSERT_TRUE(cache.save());
+    }
+    {
+        BlockDigestCache cache(cachePath.string());
+        EXPECT_EQ(cache.lookup(key, 4), "aaaabbbb");
+        EXPECT_EQ(cache.lookup(otherKey, 4), "cccc");
+    }
+
+    // запись, которую не ищут kMaxUnusedRuns запусков подряд, удаляется
+    for (uint64_t run = 1; run <= BlockDigestCache::kMaxUnusedRuns; ++run)
+    {
+        BlockDigestCache cache(cachePath.string());
+        EXPECT_EQ(cache.lookup(key, 4), "aaaabbbb");
+        CacheKey newKey = key;
+        newKey.blockSize = static_cast<uint32_t>(100 + run);
+        cache.update(newKey, 4, "dddd");
+        ASSERT_TRUE(cache.save());
+
+        BlockDigestCache savedCache(cachePath.string());
+        EXPECT_EQ(savedCache.lookup(otherKey, 4).empty(), run == BlockDigestCache::kMaxUnusedRuns);
+    }
+    {
+        BlockDigestCache cache(cachePath.string());
+        EXPECT_EQ(cache.lookup(key, 4), "aaaabbbb");
+    }
+
+    remove(filePath);
+    remove(cachePath);
+}
+
+TEST(Test_digest_cache, Subtest_file_changed_after_scan)
+{
+    const path dir = temp_directory_path() / unique_path();
+    create_directories(dir);
+    const Settings options = SettingsBuilder().withSizeOfBlock(4).build();
+    BlockDigestCache cache("");
+
+    auto find = [&](const std::vector<std::string>& names, const std::function<void()>& afterScan) {
+        std::list<DataFile> openedFiles;
+        for (const auto& name: names)
+        {   openedFiles.emplace_back((dir / name).string(), options.getSizeOfBlock());   }
+        afterScan();
+        auto doubles = DoublesFinder(options, 0, &cache).find(openedFiles);
+        cache.save();
+        return doubles;
+    };
+
+    // в кэше два первых блока b: с c он разошёлся на втором блоке
+    std::ofstream(dir / "b") << "0123ABCDzzzz";
+    std::ofstream(dir / "c") << "0123XXXX89ab";
+    EXPECT_TRUE(find({"b", "c"}, [] {}).empty());
+
+    // b переписан после обхода: ни до, ни после он не совпадал с a, но его
+    // ключи из кэша совпадают с началом a, а конец - с концом a
+    std::ofstream(dir / "a") << "0123ABCD89ab";
+    const auto doubles = find({"a", "b"}, [&dir] {
+        const std::time_t writeTime = last_write_time(dir / "b");
+        std::ofstream(dir / "b") << "0123WXYZ89ab";
+        last_write_time(dir / "b", writeTime + 10);
+    });
+    EXPECT_TRUE(doubles.empty());
+
+    remove_all(dir);
+}
+
+TEST(Test_hardlinks, Subtest_collapse_links)
+{
+    const path dir = temp_directory_path() / unique_path();
+    create_directories(dir);
+    std::ofstream(dir / "a.txt", std::ios::binary) << "Hello, World\n";
+    std::ofstream(dir / "b.txt", std::ios::binary) << "Hello, World\n";
+    std::ofstream(dir / "u.txt", std::ios::binary) << "Hello, C++\n\n\n";
+    create_hard_link(dir / "a.txt", dir / "a_link.txt");
+    create_hard_link(dir / "u.txt", dir / "u_link.txt");
+
+    for (const std::string hardlinks : {"dup", "ignore"})
+    {
+        SettingsBuilder optionsBuilder;
+        Settings options = optionsBuilder.withDepthScan(2).withMaskForScan("*").withHardlinks(hardlinks).build();
+
+        fileIndex.clear();
+        outputFiles(options, dir, {});
+        const auto doubles = findDoubles(options);
+
+        // Представитель файла - ссылка с наименьшим путём, остальные помечены
+        std::vector<std::pair<std::vector<std::string>, std::vector<std::string>>> groups;
+        for (const auto& group : doubles)
+        {
+            groups.emplace_back();
+            for (const auto& file : group)
+            {
+                const std::string name = path(file.pathToFile).filename().string();
+                groups.back().first.push_back(name);
+                if (file.isHardlink)
+                {   groups.back().second.push_back(name);   }
+            }
+            std::sort(groups.back().first.begin(), groups.back().first.end());
+            std::sort(groups.back().second.begin(), groups.back().second.end());
+        }
+        std::sort(groups.begin(), groups.end());
+
+        std::vector<std::pair<std::vector<std::string>, std::vector<std::string>>> expected = {
+            {{"a.txt", "a_link.txt", "b.txt"}, {"a_link.txt"}},
+        };
+        if (hardlinks == "dup")
+        {   expected.push_back({{"u.txt", "u_link.txt"}, {"u_link.txt"}});  }
+        EXPECT_EQ(groups, expected) << hardlinks;
+    }
+
+    // Пересекающиеся корни сканирования: путь, найденный дважды, не ссылка на себя
+    {
+        SettingsBuilder optionsBuilder;
+        Settings options = optionsBuilder.withDepthScan(2).withMaskForScan("*").withHardlinks("dup").build();
+
+        fileIndex.clear();
+        outputFiles(options, dir, {});
+        outputFiles(options, dir, {});
+        for (const auto& group : findDoubles(options))
+        {
+            std::set<std::string> paths;
+            for (const auto& file : group)
+            {   EXPECT_TRUE(paths.insert(file.pathToFile).second) << file.pathToFile;  }
+            EXPECT_EQ(group.size(), (paths.count((dir / "a.txt").string()) != 0) ? 3u : 2u);
+        }
+    }
+
+    fileIndex.clear();
+    remove_all(dir);
+}
+
+TEST(Test_block_schedule, Subtest_geometric_blocks)
+{
+    const path filePath = temp_directory_path() / unique_path();
+    std::ofstream(filePath, std::ios::binary) << "0123456789";
+
+    const DataFile item(filePath.string(), 3, 20);
+    const std::vector<std::pair<uint64_t, uint64_t>> expected = {{3, 0}, {6, 1}, {12, 2}, {20, 3}, {20, 4}, {20, 5}};
+
+    uint64_t offset = 0;
+    for (const auto& block : expected)
+    {
+        uint64_t idxBlock = 0;
+        EXPECT_EQ(item.getBlockSize(offset, &idxBlock), block.first) << offset;
+        EXPECT_EQ(idxBlock, block.second) << offset;
+        offset += block.first;
+    }
+
+    const DataFile fixedItem(filePath.string(), 4);
+    uint64_t idxBlock = 0;
+    EXPECT_EQ(fixedItem.getBlockSize(8, &idxBlock), 4u);
+    EXPECT_EQ(idxBlock, 2u);
+
+    remove(filePath);
+}
+
+TEST(Test_doubles_finder, Subtest_sample_blocks)
+{
+    const path dir = temp_directory_path() / unique_path();
+    create_directories(dir);
+
+    const std::string content(1000, 'x');
+    std::string tail = content;
+    tail.back() = 'y';
+    std::string middle = content;
+    middle[500] = 'y';
+    const std::vector<std::pair<std::string, std::string>> files = {
+        {"a.bin", content}, {"tail.bin", tail}, {"b.bin", content}, {"middle.bin", middle}, {"tail2.bin", tail},
+    };
+    for (const auto& item : files)
+    {
+        std::ofstream(dir / item.first, std::ios::binary) << item.second;
+    }
+
+    for (const size_t maxBlockSize : {7, 64})
+    {
+        SettingsBuilder optionsBuilder;
+        Settings options = optionsBuilder.withSizeOfBlock(7).withMaxSizeOfBlock(maxBlockSize).withSample(true).build();
+
+        std::list<DataFile> openedFiles;
+        for (const auto& item : files)
+        {
+            openedFiles.emplace_back((dir / item.first).string(), options.getSizeOfBlock(), options.getMaxSizeOfBlock());
+        }
+
+        DoublesFinder finder(options);
+        auto doubles = finder.find(openedFiles);
+        for (auto& group : doubles)
+        {   std::sort(group.begin(), group.end());  }
+        std::sort(doubles.begin(), doubles.end());
+
+        const std::vector<std::vector<std::string>> expected = {
+            {(dir / "a.bin").string(), (dir / "b.bin").string()},
+            {(dir / "tail.bin").string(), (dir / "tail2.bin").string()},
+        };
+        EXPECT_EQ(doubles, expected) << maxBlockSize;
+
+        for (const auto& item : openedFiles)
+        {   EXPECT_LE(item.bytesRead, item.fileSize) << item.pathToFile;   }
+    }
+
+    remove_all(dir);
+}
+
+TEST(Test_file_mask, Subtest_glob_and_regex)
+{
+    const FileMask any({"*"}, false);
+    EXPECT_TRUE(any.match("photo.JPG"));
+    EXPECT_TRUE(any.match(""));
+
+    const FileMask globs({"*.jpg", "IMG_??.*", "readme", "data*", "[a-c]*[!0-9].t?t"}, false);
+    EXPECT_TRUE(globs.match("photo.JPG"));
+    EXPECT_FALSE(globs.match("photo.jpeg"));
+    EXPECT_TRUE(globs.match("img_01.png"));
+    EXPECT_FALSE(globs.match("img_1.png"));
+    EXPECT_TRUE(globs.match("README"));
+    EXPECT_FALSE(globs.match("readme.md"));
+    EXPECT_TRUE(globs.match("Data.bin"));
+    EXPECT_TRUE(globs.match("b_report.txt"));
+    EXPECT_FALSE(globs.match("b_report1.txt"));
+    EXPECT_FALSE(globs.match("d_report.txt"));
+
+    const FileMask regexes({"\\.(cpp|h)$"}, true);
+    EXPECT_TRUE(regexes.match("lib.CPP"));
+    EXPECT_FALSE(regexes.match("lib.hpp"));
+}
+
+TEST(Test_exclusions, Subtest_trie_and_globs)
+{
+    const ExclusionTrie exclusions({"/srv/data/", "/srv/tenants/*/cache", "**/node_modules", "/srv/a/./b/../c"});
+
+    ExclusionTrie::State state;
+    EXPECT_TRUE(exclusions.start("/srv/data", state));
+    EXPECT_TRUE(exclusions.start("/srv/data/x/y", state));
+    EXPECT_TRUE(exclusions.start("/srv/a/c", state));
+    EXPECT_FALSE(exclusions.start("/srv/a", state));
+    EXPECT_FALSE(exclusions.start("/srv/datax", state));
+
+    ASSERT_FALSE(exclusions.start("/srv/tenants", state));
+    ExclusionTrie::State tenantState;
+    ExclusionTrie::State nextState;
+    ASSERT_FALSE(exclusions.next(state, "t1", tenantState));
+    EXPECT_TRUE(exclusions.next(tenantState, "cache", nextState));
+    EXPECT_FALSE(exclusions.next(tenantState, "Cache", nextState));
+    EXPECT_TRUE(exclusions.next(tenantState, "node_modules", nextState));
+    EXPECT_FALSE(exclusions.next(tenantState, "src", nextState));
+    EXPECT_EQ(nextState.size(), 1u);    // только корень исключений "**/"
+
+    // путь из нескольких компонент на любой глубине
+    const ExclusionTrie anyDepth({"**/build/*.tmp"});
+    EXPECT_TRUE(anyDepth.start("/x/build/a.tmp", state));
+    EXPECT_TRUE(anyDepth.start("/build/build/a.tmp/y", state));
+    EXPECT_FALSE(anyDepth.start("/x/build", state));
+    EXPECT_FALSE(anyDepth.start("/x/a.tmp", state));
+    EXPECT_FALSE(anyDepth.start("/build/y/a.tmp", state));
+
+    EXPECT_THROW(ExclusionTrie({"**/a/**/b"}), std::invalid_argument);
+    EXPECT_THROW(ExclusionTrie({"**/"}), std::invalid_argument);
+    EXPECT_THROW(ExclusionTrie({"**/a/../b"}), std::invalid_argument);
+
+    EXPECT_EQ(ExclusionTrie::canonicalize("/srv/data/"), path("/srv/data"));
+    EXPECT_EQ(ExclusionTrie::canonicalize("/"), path("/"));
+}
+
+TEST(Test_file_index, Subtest_paths_and_size_ranges)
+{
+    FileIndex index;
+    const uint32_t root = index.addDir(FileIndex::kNoDir, "/");
+    const uint32_t srv = index.addDir(root, "srv");
+    const uint32_t data = index.addDir(srv, "data");
+
+    FileStat fileStat;
+    fileStat.size = 20;
+    fileStat.ino = 1;
+    index.addFile(data, "b.txt", fileStat);
+    fileStat.size = 10;
+    fileStat.ino = 2;
+    index.addFile(root, "a.txt", fileStat);
+    fileStat.size = 20;
+    fileStat.ino = 3;
+    index.addFile(srv, "c.txt", fileStat);
+
+    index.sortBySize();
+    ASSERT_EQ(index.size(), 3u);
+    EXPECT_EQ(index.getPath(0), "/a.txt");
+    EXPECT_EQ(index.getPath(1), "/srv/data/b.txt");
+    EXPECT_EQ(index.getPath(2), "/srv/c.txt");
+    EXPECT_EQ(index.getSize(0), 10u);
+    EXPECT_EQ(index.getFileStat(1).ino, 1u);
+    EXPECT_EQ(index.getFileStat(2).ino, 3u);
+    EXPECT_GT(index.getBytesUsed(), 0u);
+
+    index.clear();
+    EXPECT_EQ(index.size(), 0u);
+}
+
+TEST(Test_file_index, Subtest_walk_order)
+{
+    const path dir = ExclusionTrie::canonicalize(temp_directory_path() / unique_path());
+    for (const std::string subDir: {"a", "a/b", "a/b/c", "d", "d/e", "f"})
+    {
+        create_directories(dir / subDir);
+        for (const std::string name: {"1.txt", "2.txt", "3.txt"})
+        {   std::ofstream(dir / subDir / name) << name;  }
+    }
+    std::ofstream(dir / "root.txt") << "root";
+
+    // Порядок последовательного рекурсивного обхода в порядке readdir()
+    std::vector<std::string> expected;
+    std::function<void(const path&)> walk = [&](const path& dirPath) {
+        for (directory_iterator itr(dirPath); itr != directory_iterator(); ++itr)
+        {
+            if (is_directory(itr->path()))
+            {   walk(itr->path());  }
+            else
+            {   expected.push_back(itr->path().string());  }
+        }
+    };
+    walk(dir);
+
+    for (const size_t cntThreads: {1, 4})
+    {
+        Settings options = SettingsBuilder().withDepthScan(10).withMaskForScan("*").withCntThreads(cntThreads).build();
+        fileIndex.clear();
+        outputFiles(options, dir, {});
+
+        std::vector<std::string> paths;
+        for (size_t idxFile = 0; idxFile < fileIndex.size(); ++idxFile)
+        {   paths.push_back(fileIndex.getPath(idxFile));    }
+        EXPECT_EQ(paths, expected);
+        EXPECT_EQ(fileIndex.getCntDirs(), 7u);
+    }
+
+    // Директория, удалённая во время обхода, пропускается; недоступный корень - ошибка
+    {
+        Settings options = SettingsBuilder().withDepthScan(10).withMaskForScan("*").withCntThreads(4).build();
+        fileIndex.clear();
+        outputFiles(options, dir, {}, [&](const path& dirPath, size_t) {
+            if (dirPath == dir / "d")
+            {   remove_all(dirPath);    }
+        });
+
+        std::vector<std::string> paths;
+        for (size_t idxFile = 0; idxFile < fileIndex.size(); ++idxFile)
+        {   paths.push_back(fileIndex.getPath(idxFile));    }
+        std::vector<std::string> expectedLeft;
+        std::copy_if(expected.begin(), expected.end(), std::back_inserter(expectedLeft), [&](const std::string& filePath) {
+            return (filePath.compare(0, (dir / "d/").string().size(), (dir / "d/").string()) != 0);
+        });
+        EXPECT_EQ(paths, expectedLeft);
+
+        fileIndex.clear();
+        EXPECT_THROW(outputFiles(options, dir / "missing", {}), filesystem_error);
+    }
+
+    fileIndex.clear();
+    remove_all(dir);
+}
+
+TEST(Test_result_writer, Subtest_formats)
+{
+    DoublesGroup group{12, std::string("\x01\xab", 2), {{"/d/a\"b", false}, {"/d/c", true}}};
+
+    const std::map<std::string, std::string> expected = {
+        {"plain", std::string("/d/a\"b\n/d/c (hardlink)\n\n")},
+        {"null", std::string("/d/a\"b\0/d/c\0\0", 13)},
+        {"jsonl", std::string("{\"size\":12,\"digest\":\"01ab\",\"files\":[{\"path\":\"/d/a\\\"b\",\"hardlink\":false},"
+                              "{\"path\":\"/d/c\",\"hardlink\":true}]}\n")},
+    };
+    for (const auto& [format, output] : expected)
+    {
+        const path filePath = temp_directory_path() / unique_path();
+        const int handle = ::open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        ASSERT_NE(handle, -1);
+        {
+            ResultWriter writer(handle, format, 16);
+            writer.write(group);
+            writer.write(group);
+        }
+        ::close(handle);
+
+        std::ifstream file(filePath.string(), std::ios::binary);
+        const std::string written((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        EXPECT_EQ(written, output + output) << format;
+        remove(filePath);
+    }
+
+    // путь не в UTF-8: неверный байт заменяется, точный путь - в base64
+    {
+        const path filePath = temp_directory_path() / unique_path();
+        const int handle = ::open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        ASSERT_NE(handle, -1);
+        {
+            ResultWriter writer(handle, "jsonl");
+            writer.write({1, std::string(), {{"/d/\xff\xc3\xa9x", false}, {"/d/\xc3\xa9", false}}});
+        }
+        ::close(handle);
+
+        std::ifstream file(filePath.string(), std::ios::binary);
+        const std::string written((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        EXPECT_EQ(written, "{\"size\":1,\"digest\":null,\"files\":["
+                           "{\"path\":\"/d/\\ufffd\xc3\xa9x\",\"path_base64\":\"L2Qv/8OpeA==\",\"hardlink\":false},"
+                           "{\"path\":\"/d/\xc3\xa9\",\"hardlink\":false}]}\n");
+        remove(filePath);
+    }
+
+    EXPECT_THROW(ResultWriter(STDOUT_FILENO, "csv"), std::invalid_argument);
+}
+
+TEST(Test_device_queues, Subtest_depth_and_seeks)
+{
+    DeviceQueues queues;
+    std::atomic<bool> isAcquired{false};
+    {
+        DeviceQueues::Slots slots;
+        slots.acquire(queues, {7}, 1);
+
+        std::thread other([&]() {
+            queues.acquire(7, 1);
+            isAcquired = true;
+            queues.release(7);
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        EXPECT_FALSE(isAcquired.load());
+
+        slots.release();
+        other.join();
+        EXPECT_TRUE(isAcquired.load());
+    }
+
+    IoStats stats;
+    stats.isCollectDevices = true;
+    stats.addDeviceRead(7, 1, 0, 10);
+    stats.addDeviceRead(7, 1, 10, 20);
+    stats.addDeviceRead(7, 2, 0, 10);
+    stats.addDeviceRead(8, 1, 0, 10);
+    EXPECT_EQ(stats.devices[7].cntReads, 3u);
+    EXPECT_EQ(stats.devices[7].bytesRead, 40u);
+    EXPECT_EQ(stats.devices[7].cntSeeks, 2u);
+    EXPECT_EQ(stats.devices[8].cntSeeks, 1u);
+
+    const path filePath = temp_directory_path() / unique_path();
+    std::ofstream(filePath, std::ios::binary) << std::string(8192, 'x');
+    uint64_t physicalOffset = 0;
+    const int handle = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    ASSERT_NE(handle, -1);
+    bool isSupported = true;
+    if (getPhysicalOffset(handle, physicalOffset, &isSupported))
+    {
+        EXPECT_NE(physicalOffset, 0u);
+        EXPECT_TRUE(isSupported);
+    }
+    ::close(handle);
+    EXPECT_FALSE(getPhysicalOffset(-1, physicalOffset));
+    remove(filePath);
+}
+
+TEST(Test_sparse_files, Subtest_holes_are_zero_blocks)
+{
+    const path dir = temp_directory_path() / unique_path();
+    create_directories(dir);
+    const uint64_t fileSize = 4 * 1024 * 1024;
+    for (const std::string name : {"sparse", "sparse_other"})
+    {
+        std::ofstream file((dir / name).string(), std::ios::binary);
+        file << (name == "sparse" ? "head" : "HEAD");
+        file.seekp(static_cast<std::streamoff>(fileSize - 4));
+        file << "tail";
+    }
+    {
+        std::ofstream file((dir / "dense").string(), std::ios::binary);
+        file << "head" << std::string(fileSize - 8, '\0') << "tail";
+    }
+
+    const int handle = ::open((dir / "sparse").c_str(), O_RDONLY);
+    ASSERT_NE(handle, -1);
+    DataFile item((dir / "sparse").string(), 4096, 4096);
+    item.holes = getHoles(handle, fileSize);
+    ::close(handle);
+    if (!item.holes.empty())
+    {
+        EXPECT_FALSE(item.isHole(0, 4096));
+        EXPECT_TRUE(item.isHole(1024 * 1024, 4096));
+        EXPECT_FALSE(item.isHole(fileSize - 4096, 4096));
+    }
+
+    for (const std::string compareMode : {"hash", "bytes"})
+    {
+        SettingsBuilder optionsBuilder;
+        Settings options = optionsBuilder.withSizeOfBlock(4096).withMaxSizeOfBlock(64 * 1024).withCompareMode(compareMode).build();
+
+        std::list<DataFile> openedFiles;
+        for (const std::string name : {"sparse", "dense", "sparse_other"})
+        {   openedFiles.emplace_back((dir / name).string(), options.getSizeOfBlock(), options.getMaxSizeOfBlock());   }
+
+        const uint64_t cntHoles = ioStats.cntHoles.load();
+        const uint64_t cntOpens = ioStats.cntOpens.load();
+        DoublesFinder finder(options);
+        auto doubles = finder.find(openedFiles);
+        ASSERT_EQ(doubles.size(), 1u) << compareMode;
+        // дыры запрашиваются через дескриптор, открытый для чтения
+        EXPECT_EQ(ioStats.cntOpens.load() - cntOpens, 3u) << compareMode;
+        std::sort(doubles.front().begin(), doubles.front().end());
+        EXPECT_EQ(doubles.front(), std::vector<std::string>({(dir / "dense").string(), (dir / "sparse").string()})) << compareMode;
+        if (!item.holes.empty())
+        {   EXPECT_GT(ioStats.cntHoles.load(), cntHoles) << compareMode;  }
+    }
+
+    remove_all(dir);
+}
+
+TEST(Test_stats, Subtest_counters_and_report)
+{
+    const path dir = temp_directory_path() / unique_path();
+    create_directories(dir);
+    for (const std::string name : {"a.txt", "b.txt", "c.txt"})
+    {   std::ofstream(dir / name, std::ios::binary) << (name == "c.txt" ? "Hello, C++!!\n" : "Hello, World\n");  }
+
+    SettingsBuilder optionsBuilder;
+    Settings options = optionsBuilder.withDepthScan(2).withIoMode("pread").withQueueDepth(0).build();
+
+    const uint64_t cntDirs = ioStats.cntDirs.load();
+    const uint64_t cntReadCalls = ioStats.cntReadCalls.load();
+    const uint64_t cntGroups = ioStats.rounds[0].cntGroups.load();
+    const uint64_t cntSubGroups = ioStats.rounds[0].cntSubGroups.load();
+    const uint64_t cntBlocksHashed = ioStats.cntBlocksHashed.load();
+    const uint64_t bytesCandidates = ioStats.bytesCandidates.load();
+
+    fileIndex.clear();
+    outputFiles(options, dir, {});
+    EXPECT_EQ(findDoubles(options).size(), 1u);
+
+    EXPECT_EQ(ioStats.cntDirs.load() - cntDirs, 1u);
+    EXPECT_EQ(ioStats.cntReadCalls.load() - cntReadCalls, 3u);
+    EXPECT_EQ(ioStats.rounds[0].cntGroups.load() - cntGroups, 1u);
+    EXPECT_EQ(ioStats.rounds[0].cntSubGroups.load() - cntSubGroups, 2u);
+    EXPECT_EQ(ioStats.cntBlocksHashed.load() - cntBlocksHashed, 3u);
+    EXPECT_EQ(ioStats.bytesCandidates.load() - bytesCandidates, 3 * 13u);
+
+    std::ostringstream report;
+    printStats(report, true);
+    const std::string json = report.str();
+    EXPECT_EQ(json.front(), '{');
+    EXPECT_EQ(json.substr(json.size() - 2), "}\n");
+    EXPECT_NE(json.find("\"read_calls\":"), std::string::npos);
+
+    fileIndex.clear();
+    remove_all(dir);
+}
+
+#ifdef BAYAN_HAVE_INOTIFY
+TEST(Test_watch, Subtest_new_doubles)
+{
+    const path dir = ExclusionTrie::canonicalize(temp_directory_path() / unique_path());
+    create_directories(dir / "sub");
+    std::ofstream(dir / "sub" / "a.txt", std::ios::binary) << "Hello, World\n";
+    std::ofstream(dir / "b.txt", std::ios::binary) << "Hello, C++\n";
+
+    SettingsBuilder optionsBuilder;
+    Settings options = optionsBuilder.withDepthScan(4).withSizeOfBlock(5).withWatch(true).build();
+    const ExclusionTrie exclusions;
+
+    sigset_t oldSignals;
+    ::pthread_sigmask(SIG_SETMASK, nullptr, &oldSignals);
+
+    // Наблюдение ставится во время обхода
+    DoublesWatcher watcher(options, exclusions);
+    fileIndex.clear();
+    outputFiles(options, dir, exclusions, watcher.getDirHandler());
+
+    std::mutex groupsMutex;
+    std::condition_variable groupsChanged;
+    std::vector<std::vector<std::string>> groups;
+    auto waitGroups = [&](size_t cntGroups) {
+        std::unique_lock<std::mutex> lock(groupsMutex);
+        return groupsChanged.wait_for(lock, std::chrono::seconds(10), [&] { return groups.size() >= cntGroups; });
+    };
+
+    std::thread thread([&] {
+        watcher.run([&](DoublesGroup&& group) {
+            std::vector<std::string> paths;
+            for (const auto& file : group.files)
+            {   paths.push_back(file.pathToFile);  }
+            std::sort(paths.begin(), paths.end());
+
+            std::lock_guard<std::mutex> lock(groupsMutex);
+            groups.push_back(paths);
+            groupsChanged.notify_all();
+        });
+    });
+
+    // Копия в наблюдаемой директории и в новой поддиректории
+    std::ofstream(dir / "c.txt", std::ios::binary) << "Hello, World\n";
+    ASSERT_TRUE(waitGroups(1));
+    create_directories(dir / "new");
+    std::ofstream(dir / "new" / "d.txt", std::ios::binary) << "Hello, World\n";
+    ASSERT_TRUE(waitGroups(2));
+    // Файлы удалённой директории забываются
+    remove_all(dir / "new");
+    std::ofstream(dir / "e.txt", std::ios::binary) << "Hello, World\n";
+    ASSERT_TRUE(waitGroups(3));
+
+    ::kill(::getpid(), SIGTERM);
+    thread.join();
+    ::pthread_sigmask(SIG_SETMASK, &oldSignals, nullptr);
+
+    const std::vector<std::vector<std::string>> expected = {
+        {(dir / "c.txt").string(), (dir / "sub" / "a.txt").string()},
+        {(dir / "c.txt").string(), (dir / "new" / "d.txt").string(), (dir / "sub" / "a.txt").string()},
+        {(dir / "c.txt").string(), (dir / "e.txt").string(), (dir / "sub" / "a.txt").string()},
+    };
+    EXPECT_EQ(groups, expected);
+
+    fileIndex.clear();
+    remove_all(dir);
+}
+#endif
+
+TEST(Test_checkpoint, Subtest_resume)
+{
+    const path dir = ExclusionTrie::canonicalize(temp_directory_path() / unique_path());
+    const std::string pathToCheckpoint = (temp_directory_path() / unique_path()).string();
+    create_directories(dir);
+    std::ofstream(dir / "a.txt", std::ios::binary) << "Hello, World\n";
+    std::ofstream(dir / "b.txt", std::ios::binary) << "Hello, World\n";
+    std::ofstream(dir / "c.txt", std::ios::binary) << "Hello, C++!!\n";
+    std::ofstream(dir / "d.txt", std::ios::binary) << "0123456789abcdefghij";
+    std::ofstream(dir / "e.txt", std::ios::binary) << "0123456789abcdefghij";
+    std::ofstream(dir / "f.txt", std::ios::binary) << "0123456789abcdefghiJ";
+    std::ofstream(dir / "x.txt", std::ios::binary) << "0123456789abcdefXYZW";
+    std::ofstream(dir / "y.txt", std::ios::binary) << "0123456789abcdefXYZW";
+
+    auto getNames = [](std::vector<std::vector<std::string>>& groups) {
+        return [&groups](DoublesGroup&& group) {
+            groups.emplace_back();
+            for (const auto& file : group.files)
+            {   groups.back().push_back(path(file.pathToFile).filename().string());  }
+            std::sort(groups.back().begin(), groups.back().end());
+        };
+    };
+
+    for (const std::string compareMode : {"hash", "bytes"})
+    {
+        SettingsBuilder optionsBuilder;
+        Settings options = optionsBuilder.withDepthScan(2).withSizeOfBlock(5).withMaxSizeOfBlock(5)
+                .withCntThreads(1).withCompareMode(compareMode).build();
+
+        // Прерванный поиск: группа 20 байт сравнивается первой, поиск
+        // прерывается на второй её группе дубликатов (в последнем блоке)
+        fileIndex.clear();
+        outputFiles(options, dir, {});
+        std::vector<std::vector<std::string>> interrupted;
+        {
+            Checkpoint checkpoint(pathToCheckpoint, options, std::chrono::seconds(0));
+            checkpoint.start();
+            EXPECT_THROW(findDoubles(options, [&interrupted, &getNames](DoublesGroup&& group) {
+                if (!interrupted.empty())
+                {   throw std::runtime_error("interrupted");    }
+                getNames(interrupted)(std::move(group));
+            }, nullptr, &checkpoint), std::runtime_error);
+        }
+        ASSERT_EQ(interrupted.size(), 1u);
+
+        // Продолжение с другими настройками отклоняется
+        {
+            SettingsBuilder otherBuilder(options);
+            Checkpoint checkpoint(pathToCheckpoint, otherBuilder.withSizeOfBlock(4).build());
+            EXPECT_THROW(checkpoint.load([](DoublesGroup&&) {}), std::invalid_argument);
+        }
+
+        // Продолжение: индекс и выведенная группа из контрольной точки, у
+        // группы 20 байт читается только последний блок оставшихся файлов,
+        // группа 13 байт сравнивается целиком (c.txt отличается во втором блоке)
+        fileIndex.clear();
+        std::vector<std::vector<std::string>> groups;
+        Checkpoint checkpoint(pathToCheckpoint, options, std::chrono::seconds(0));
+        ASSERT_TRUE(checkpoint.load(getNames(groups)));
+        EXPECT_EQ(groups, interrupted);
+        EXPECT_EQ(fileIndex.size(), 8u);
+
+        const uint64_t cntBlocksHashed = ioStats.cntBlocksHashed.load();
+        findDoubles(options, getNames(groups), nullptr, &checkpoint);
+        checkpoint.finish();
+
+        EXPECT_EQ(ioStats.cntBlocksHashed.load() - cntBlocksHashed, (compareMode == "hash") ? 3u + 8u : 0u);
+        std::sort(groups.begin(), groups.end());
+        const std::vector<std::vector<std::string>> expected = {{"a.txt", "b.txt"}, {"d.txt", "e.txt"}, {"x.txt", "y.txt"}};
+        EXPECT_EQ(groups, expected);
+        EXPECT_FALSE(exists(pathToCheckpoint));
+    }
+
+    fileIndex.clear();
+    remove_all(dir);
+}
+
+TEST(Test_shards, Subtest_same_as_one_process)
+{
+    const path dir = ExclusionTrie::canonicalize(temp_directory_path() / unique_path());
+    for (const std::string sub : {"a", "a/b", "c", "d"})
+    {   create_directories(dir / sub);  }
+    std::ofstream(dir / "x.txt", std::ios::binary) << "Hello, World\n";
+    std::ofstream(dir / "a" / "x.txt", std::ios::binary) << "Hello, World\n";
+    std::ofstream(dir / "a" / "b" / "y.txt", std::ios::binary) << "Hello, C++!!\n";
+    std::ofstream(dir / "c" / "y.txt", std::ios::binary) << "Hello, C++!!\n";
+    std::ofstream(dir / "c" / "z.txt", std::ios::binary) << "0123456789abcdefghij";
+    std::ofstream(dir / "d" / "z.txt", std::ios::binary) << "0123456789abcdefghij";
+    std::ofstream(dir / "d" / "u.txt", std::ios::binary) << "0123456789abcdefghiJ";
+    create_hard_link(dir / "d" / "u.txt", dir / "u_link.txt");
+
+    SettingsBuilder optionsBuilder;
+    Settings options = optionsBuilder.withPathScan({dir.string()}).withDepthScan(4).withSizeOfBlock(5).withCntThreads(1).build();
+
+    // Настройки передаются процессам без потерь
+    std::string settings;
+    options.save(settings);
+    Settings loaded;
+    ASSERT_TRUE(loaded.load(settings));
+    std::string settingsLoaded;
+    loaded.save(settingsLoaded);
+    EXPECT_EQ(settingsLoaded, settings);
+
+    auto getPaths = [](std::vector<std::vector<std::pair<std::string, bool>>>& groups) {
+        return [&groups](DoublesGroup&& group) {
+            groups.emplace_back();
+            for (const auto& file : group.files)
+            {   groups.back().emplace_back(file.pathToFile, file.isHardlink);   }
+            std::sort(groups.back().begin(), groups.back().end());
+        };
+    };
+
+    std::vector<std::vector<std::pair<std::string, bool>>> expected;
+    fileIndex.clear();
+    outputFiles(options, dir, {});
+    findDoubles(options, getPaths(expected));
+    fileIndex.clear();
+    std::sort(expected.begin(), expected.end());
+    EXPECT_EQ(expected.size(), 4u);
+
+    const ExclusionTrie exclusions;
+    for (const size_t cntShards : {1, 3})
+    {
+        std::vector<std::vector<std::pair<std::string, bool>>> groups;
+        ShardCoordinator coordinator(options, exclusions, cntShards);
+        coordinator.run(getPaths(groups));
+        std::sort(groups.begin(), groups.end());
+        EXPECT_EQ(groups, expected) << cntShards;
+    }
+
+    remove_all(dir);
+}